@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+/* Default chunk size; bigger requests get a chunk of their own size */
+#define ARENA_CHUNK_SIZE 65536
+
+/* Every allocation is rounded up so the next one stays aligned */
+#define ARENA_ALIGN 8
+#define ALIGN_UP(n) (((n) + (ARENA_ALIGN - 1)) & ~(size_t)(ARENA_ALIGN - 1))
+
+/* Start of the usable bytes of a chunk */
+#define CHUNK_DATA(chunk) ((char *)(chunk) + ALIGN_UP(sizeof(ArenaChunk)))
+
+/* Allocates a new chunk with room for at least size bytes */
+static ArenaChunk *new_chunk(size_t size) {
+    ArenaChunk *chunk;
+
+    if (size < ARENA_CHUNK_SIZE) {
+        size = ARENA_CHUNK_SIZE;
+    }
+    chunk = malloc(ALIGN_UP(sizeof(ArenaChunk)) + size);
+    if (chunk == NULL) {
+        fprintf(stderr, "Failed to allocate memory for assembler tables\n");
+        exit(EXIT_FAILURE);
+    }
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+/* Bump-allocates from the current chunk, moving on to the next one when full */
+void* arena_alloc(Arena *arena, size_t size) {
+    ArenaChunk *chunk;
+    void *ptr;
+
+    size = ALIGN_UP(size);
+
+    if (arena->first == NULL) {
+        arena->first = arena->current = new_chunk(size);
+    }
+
+    /* Walk forward through chunks kept from before the last reset */
+    chunk = arena->current;
+    while (chunk->size - chunk->used < size) {
+        if (chunk->next == NULL) {
+            chunk->next = new_chunk(size);
+        }
+        chunk = chunk->next;
+        chunk->used = 0;
+    }
+    arena->current = chunk;
+
+    ptr = CHUNK_DATA(chunk) + chunk->used;
+    chunk->used += size;
+    arena->last = ptr;
+    arena->last_size = size;
+    return ptr;
+}
+
+/* Grows a block, in place when it is the last one handed out */
+void* arena_grow(Arena *arena, void *ptr, size_t old_size, size_t new_size) {
+    ArenaChunk *chunk = arena->current;
+    void *new_ptr;
+
+    if (ptr != NULL && ptr == arena->last) {
+        size_t extra;
+
+        if (ALIGN_UP(new_size) <= arena->last_size) {
+            return ptr;
+        }
+        extra = ALIGN_UP(new_size) - arena->last_size;
+        if (chunk->size - chunk->used >= extra) {
+            chunk->used += extra;
+            arena->last_size += extra;
+            return ptr;
+        }
+    }
+
+    new_ptr = arena_alloc(arena, new_size);
+    if (ptr != NULL && old_size > 0) {
+        memcpy(new_ptr, ptr, old_size);
+    }
+    return new_ptr;
+}
+
+/* Rewinds to the first chunk; later chunks are reset as they are reached */
+void arena_reset(Arena *arena) {
+    if (arena->first != NULL) {
+        arena->first->used = 0;
+    }
+    arena->current = arena->first;
+    arena->last = NULL;
+    arena->last_size = 0;
+}
+
+/* Frees every chunk of the arena */
+void arena_free(Arena *arena) {
+    ArenaChunk *chunk = arena->first;
+    ArenaChunk *next;
+
+    while (chunk != NULL) {
+        next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->first = arena->current = NULL;
+    arena->last = NULL;
+    arena->last_size = 0;
+}
@@ -0,0 +1,39 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* A chunk of arena memory; the usable bytes follow the header */
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;          /* Next chunk in the chain */
+    size_t size;                      /* Usable bytes in this chunk */
+    size_t used;                      /* Bytes already handed out */
+} ArenaChunk;
+
+/* Bump allocator that owns all tables of one assembly.
+   Memory is never freed piece by piece: the whole arena is reset
+   between input files, keeping its chunks for reuse. */
+typedef struct {
+    ArenaChunk *first;                /* First chunk (NULL until first use) */
+    ArenaChunk *current;              /* Chunk allocations are taken from */
+    void *last;                       /* Most recent allocation (can grow in place) */
+    size_t last_size;                 /* Size of the most recent allocation */
+} Arena;
+
+/* Initial value for an empty arena */
+#define ARENA_INIT {NULL, NULL, NULL, 0}
+
+/* Allocates size bytes from the arena. Exits on allocation failure. */
+void* arena_alloc(Arena *arena, size_t size);
+
+/* Returns a block of new_size bytes holding the first old_size bytes of ptr.
+   The most recent allocation is extended in place when the chunk has room. */
+void* arena_grow(Arena *arena, void *ptr, size_t old_size, size_t new_size);
+
+/* Forgets every allocation in O(1); the chunks are kept for reuse */
+void arena_reset(Arena *arena);
+
+/* Returns all chunks to the system */
+void arena_free(Arena *arena);
+
+#endif /* ARENA_H */
@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+#include "context.h"
+#include "source.h"
+
+AsmContext *asm_create(void) {
+    /* All-zero is the empty state of every table, like the former globals */
+    AsmContext *ctx = calloc(1, sizeof(AsmContext));
+    if (ctx == NULL) {
+        fprintf(stderr, "Failed to allocate memory for assembler context\n");
+        exit(EXIT_FAILURE);
+    }
+    ctx->diagnostics = stderr;
+    return ctx;
+}
+
+void asm_destroy(AsmContext *ctx) {
+    if (ctx == NULL) {
+        return;
+    }
+    free_memory(ctx);
+    free_macros(ctx);
+    output_free(&ctx->object);
+    output_free(&ctx->entries);
+    output_free(&ctx->externals);
+    output_free(&ctx->expanded);
+    output_free(&ctx->binary);
+    output_free(&ctx->compressed);
+    free(ctx);
+}
+
+void asm_set_options(AsmContext *ctx, unsigned int options) {
+    ctx->options = options;
+}
+
+void asm_set_diagnostics(AsmContext *ctx, FILE *stream) {
+    ctx->diagnostics = stream ? stream : stderr;
+}
+
+void asm_set_threads(AsmContext *ctx, int count) {
+    ctx->threads = count;
+}
+
+int open_context_output(AsmContext *ctx, Output *out, const char *extension) {
+    char path[FILENAME_MAX];
+
+    if (!ctx->writeFiles) {
+        return output_open(out, NULL);
+    }
+    if (strlen(ctx->baseName) + strlen(extension) >= FILENAME_MAX) {
+        return 0;
+    }
+    strcpy(path, ctx->baseName);
+    strcat(path, extension);
+    return output_open(out, path);
+}
+
+/* Runs one assembly of a source; the outputs go where writeFiles says */
+static int assemble(AsmContext *ctx, const SourceFile *source, const char *name) {
+    char *dot;
+
+    /* Outputs are named after the input without its .as extension */
+    if (strlen(name) >= FILENAME_MAX) {
+        fprintf(ctx->diagnostics, "Error: File name too long: %s\n", name);
+        return 1;
+    }
+    strcpy(ctx->baseName, name);
+    dot = strstr(ctx->baseName, ".as");
+    if (dot != NULL) {
+        *dot = '\0';
+    }
+
+    /* Outputs that this assembly does not produce read as missing */
+    ctx->object.opened = 0;
+    ctx->entries.opened = 0;
+    ctx->externals.opened = 0;
+    ctx->expanded.opened = 0;
+    ctx->binary.opened = 0;
+    ctx->compressed.opened = 0;
+
+    /* Start with empty tables, then preprocess macros and run both passes */
+    set_streaming(ctx, (ctx->options & ASM_STREAM) != 0);
+    set_one_pass(ctx, (ctx->options & (ASM_ONE_PASS | ASM_STREAM)) == ASM_ONE_PASS);
+    reset_tables(ctx);
+    return macro_handle(ctx, source, name);
+}
+
+/* Points a result buffer at an output kept in memory */
+static void fill_buffer(AsmBuffer *buffer, const Output *out) {
+    if (!out->opened) {
+        buffer->data = NULL;
+        buffer->length = 0;
+        return;
+    }
+    buffer->data = out->data ? out->data : "";
+    buffer->length = out->length;
+}
+
+int asm_assemble(AsmContext *ctx, const char *name, const char *source, long size,
+                 AsmResult *result) {
+    SourceFile file;
+    int errors;
+
+    file.data = source;
+    file.size = size;
+    file.mapped = 0;
+
+    ctx->writeFiles = 0;
+    errors = assemble(ctx, &file, name);
+
+    if (result != NULL) {
+        result->errors = errors;
+        fill_buffer(&result->object, &ctx->object);
+        fill_buffer(&result->entries, &ctx->entries);
+        fill_buffer(&result->externals, &ctx->externals);
+        fill_buffer(&result->expanded, &ctx->expanded);
+        fill_buffer(&result->binary, &ctx->binary);
+        fill_buffer(&result->compressed, &ctx->compressed);
+    }
+    return errors;
+}
+
+int asm_assemble_file(AsmContext *ctx, const char *path) {
+    SourceFile source;
+    int errors;
+
+    if (!open_source(path, &source)) {
+        return -1;
+    }
+    ctx->writeFiles = 1;
+    errors = assemble(ctx, &source, path);
+    close_source(&source);
+    return errors;
+}
+
+int asm_include_count(const AsmContext *ctx) {
+    return ctx->pre.includeCount;
+}
+
+const char *asm_include_path(const AsmContext *ctx, int index) {
+    if (index < 0 || index >= ctx->pre.includeCount) {
+        return NULL;
+    }
+    return ctx->pre.includes[index];
+}
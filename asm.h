@@ -0,0 +1,80 @@
+#ifndef ASM_H
+#define ASM_H
+
+#include <stdio.h>
+
+/* Library interface of the assembler (libassembler).
+   All state of an assembly lives in an AsmContext: the tables, the string
+   pool, the macros and the outputs. Contexts share nothing, so different
+   threads may each assemble with their own context at the same time.
+   Diagnostics are printed to stderr unless the context is given another
+   stream (asm_set_diagnostics). A program past the memory limit or an
+   output that cannot be created is an error of the file like any other;
+   only running out of memory prints to stderr and exits. */
+
+/* Opaque assembler state, see context.h */
+typedef struct AsmContext AsmContext;
+
+/* Version of the assembler's output; bumped whenever the same source
+   may assemble differently (build caches key their entries with it) */
+#define ASM_VERSION "1.5"
+
+/* Options (asm_set_options) */
+#define ASM_WRITE_EXPANDED 0x1        /* Also produce the expanded program (.am) */
+#define ASM_STREAM         0x2        /* Streaming mode: bounded memory for huge inputs */
+#define ASM_ONE_PASS       0x4        /* Backpatch label uses instead of a second traversal */
+#define ASM_WRITE_BINARY   0x8        /* Also produce the binary object file (.obx, see obx.h) */
+#define ASM_WRITE_COMPRESSED 0x10     /* Produce the compressed .obz (obz.h) instead of the .ob */
+
+/* One output of an assembly, owned by the context */
+typedef struct {
+    const char *data;                 /* Contents (not null-terminated), NULL if not produced */
+    long length;                      /* Bytes in data */
+} AsmBuffer;
+
+/* Outputs of asm_assemble; valid until the next call on the same context */
+typedef struct {
+    int errors;                       /* Errors that stopped the assembly (0 = success) */
+    AsmBuffer object;                 /* .ob contents */
+    AsmBuffer entries;                /* .ent contents */
+    AsmBuffer externals;              /* .ext contents */
+    AsmBuffer expanded;               /* .am contents (with ASM_WRITE_EXPANDED) */
+    AsmBuffer binary;                 /* .obx contents (with ASM_WRITE_BINARY) */
+    AsmBuffer compressed;             /* .obz contents (with ASM_WRITE_COMPRESSED) */
+} AsmResult;
+
+/* Creates an empty context; exits if memory runs out */
+AsmContext *asm_create(void);
+
+/* Frees a context and everything it owns */
+void asm_destroy(AsmContext *ctx);
+
+/* Sets the ASM_* options for the following assemblies */
+void asm_set_options(AsmContext *ctx, unsigned int options);
+
+/* Sends the diagnostics of the following assemblies to a stream
+   (NULL for stderr) */
+void asm_set_diagnostics(AsmContext *ctx, FILE *stream);
+
+/* Lets each following assembly use up to count threads for large files
+   (first pass split into chunks); 1 keeps it on the calling thread */
+void asm_set_threads(AsmContext *ctx, int count);
+
+/* Assembles a source held in memory. name is used for messages and to
+   find .include files. The outputs are kept in memory (see AsmResult).
+   Returns the number of errors. */
+int asm_assemble(AsmContext *ctx, const char *name, const char *source, long size,
+                 AsmResult *result);
+
+/* Assembles a source file and writes the .ob, .ent, .ext (and .am) files
+   next to it, named after it without its .as extension.
+   Returns the number of errors, or -1 if the file cannot be opened. */
+int asm_assemble_file(AsmContext *ctx, const char *path);
+
+/* Number of files read through .include by the last assembly */
+int asm_include_count(const AsmContext *ctx);
+
+/* Path of one of them, as it was opened; valid until the next assembly */
+const char *asm_include_path(const AsmContext *ctx, int index);
+
+#endif /* ASM_H */
@@ -0,0 +1,589 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#include "cache.h"
+#include "source.h"
+
+/* First line of an entry's description (bump when the layout changes) */
+#define CACHE_MAGIC "ASMCACHE1"
+
+/* Every output an entry may hold, and its description */
+static const char *const all_extensions[] = {".am", ".ob", ".obz", ".obx", ".ent", ".ext"};
+#define EXTENSION_COUNT 6
+#define META_EXTENSION ".meta"
+
+/* Seconds after which a file no entry owns is taken as left behind */
+#define CACHE_STALE_AGE 3600
+
+/* Hit, miss, store and eviction counts */
+typedef struct {
+    long hits;
+    long misses;
+    long stores;
+    long evictions;
+} CacheStats;
+
+struct BuildCache {
+    char *dir;
+    long limit;                       /* Size limit in bytes */
+    CacheStats run;                   /* Counts of this run */
+};
+
+/* An entry found when the cache is trimmed */
+typedef struct {
+    char key[CACHE_KEY_LENGTH + 1];
+    time_t used;                      /* Last hit or store */
+} CacheEntry;
+
+/* Two independent hashes of the bytes that make up a key */
+typedef struct {
+    unsigned long fnv;                /* FNV-1a */
+    unsigned long djb;                /* djb2 */
+    unsigned long size;
+} Hasher;
+
+static void hasher_start(Hasher *hasher) {
+    hasher->fnv = 0xcbf29ce484222325UL;
+    hasher->djb = 5381;
+    hasher->size = 0;
+}
+
+static void hasher_add(Hasher *hasher, const char *data, long length) {
+    long i;
+
+    for (i = 0; i < length; i++) {
+        hasher->fnv = (hasher->fnv ^ (unsigned char)data[i]) * 0x100000001b3UL;
+        hasher->djb = ((hasher->djb << 5) + hasher->djb) + (unsigned char)data[i];
+    }
+    hasher->size += (unsigned long)length;
+}
+
+/* Formats the hashes as CACHE_KEY_LENGTH hex digits */
+static void hasher_key(const Hasher *hasher, char *key) {
+    sprintf(key, "%016lx%016lx%08lx", hasher->fnv & 0xFFFFFFFFFFFFFFFFUL,
+            hasher->djb & 0xFFFFFFFFFFFFFFFFUL, hasher->size & 0xFFFFFFFFUL);
+    key[CACHE_KEY_LENGTH] = '\0';
+}
+
+/* Hashes a whole file; returns 0 if it cannot be read */
+static int hash_file(const char *path, char *key) {
+    SourceFile file;
+    Hasher hasher;
+
+    if (!open_source(path, &file)) {
+        return 0;
+    }
+    hasher_start(&hasher);
+    hasher_add(&hasher, file.data, file.size);
+    hasher_key(&hasher, key);
+    close_source(&file);
+    return 1;
+}
+
+/* Allocates the concatenation of two or three strings */
+static char *join(const char *a, const char *b, const char *c) {
+    char *text = malloc(strlen(a) + strlen(b) + strlen(c) + 1);
+
+    if (text == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the build cache\n");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(text, a);
+    strcat(text, b);
+    strcat(text, c);
+    return text;
+}
+
+/* Path of one file of an entry: DIR/KEY.ext */
+static char *entry_path(const BuildCache *cache, const char *key, const char *extension) {
+    char *prefix = join(cache->dir, "/", key);
+    char *path = join(prefix, extension, "");
+
+    free(prefix);
+    return path;
+}
+
+/* The output name of a source for an extension, like asm_assemble_file */
+static char *output_path(const char *source, const char *extension) {
+    char *path = join(source, extension, "");
+    char *dot = strstr(source, ".as");
+
+    if (dot != NULL) {
+        strcpy(path + (dot - source), extension);
+    }
+    return path;
+}
+
+/* The outputs asm_assemble_file writes with these options (see second_pass) */
+static int produced_outputs(unsigned int options, const char **extensions) {
+    int streaming = (options & ASM_STREAM) != 0;
+    int count = 0;
+
+    if (options & ASM_WRITE_EXPANDED) {
+        extensions[count++] = ".am";
+    }
+    extensions[count++] = (options & ASM_WRITE_COMPRESSED) && !streaming ? ".obz" : ".ob";
+    extensions[count++] = ".ent";
+    extensions[count++] = ".ext";
+    if ((options & ASM_WRITE_BINARY) && !streaming) {
+        extensions[count++] = ".obx";
+    }
+    return count;
+}
+
+/* Copies a file; returns 0 on failure */
+static int copy_file(const char *from, const char *to) {
+    FILE *in = fopen(from, "rb");
+    FILE *out;
+    char buffer[BUFSIZ];
+    size_t length;
+    int ok = 1;
+
+    if (in == NULL) {
+        return 0;
+    }
+    out = fopen(to, "wb");
+    if (out == NULL) {
+        fclose(in);
+        return 0;
+    }
+    while ((length = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        if (fwrite(buffer, 1, length, out) != length) {
+            ok = 0;
+            break;
+        }
+    }
+    if (fclose(out) != 0) {
+        ok = 0;
+    }
+    fclose(in);
+    return ok;
+}
+
+/* Makes to a hardlink of from (a copy across file systems); an existing
+   file at to is replaced. Returns 0 on failure. */
+static int place_file(const char *from, const char *to) {
+    remove(to);
+    return link(from, to) == 0 || copy_file(from, to);
+}
+
+/* Puts a file into the cache under a temporary name, then its own */
+static int store_file(const char *from, const char *to) {
+    char suffix[32];
+    char *temporary;
+    int ok;
+
+    sprintf(suffix, ".%ld.tmp", (long)getpid());
+    temporary = join(to, suffix, "");
+    ok = place_file(from, temporary) && rename(temporary, to) == 0;
+    if (!ok) {
+        remove(temporary);
+    }
+    free(temporary);
+    return ok;
+}
+
+/* Reads the counts saved in DIR/stats (zero if there are none) */
+static void read_stats(const BuildCache *cache, CacheStats *stats) {
+    char *path = join(cache->dir, "/stats", "");
+    FILE *file = fopen(path, "r");
+
+    memset(stats, 0, sizeof(*stats));
+    if (file != NULL) {
+        if (fscanf(file, "hits %ld misses %ld stores %ld evictions %ld", &stats->hits,
+                   &stats->misses, &stats->stores, &stats->evictions) != 4) {
+            memset(stats, 0, sizeof(*stats));
+        }
+        fclose(file);
+    }
+    free(path);
+}
+
+BuildCache *cache_open(const char *dir, long limit) {
+    BuildCache *cache;
+    struct stat info;
+
+    if (stat(dir, &info) != 0 && mkdir(dir, 0777) != 0) {
+        fprintf(stderr, "Error: Cannot create cache directory %s\n", dir);
+        return NULL;
+    }
+    cache = malloc(sizeof(BuildCache));
+    if (cache == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the build cache\n");
+        exit(EXIT_FAILURE);
+    }
+    cache->dir = join(dir, "", "");
+    cache->limit = limit;
+    memset(&cache->run, 0, sizeof(cache->run));
+    return cache;
+}
+
+/* Computes the key of a source; returns 0 if it cannot be read */
+static int source_key(const char *path, unsigned int options, char *key) {
+    SourceFile source;
+    Hasher hasher;
+    char text[32];
+
+    if (!open_source(path, &source)) {
+        return 0;
+    }
+    hasher_start(&hasher);
+    hasher_add(&hasher, ASM_VERSION, (long)strlen(ASM_VERSION) + 1);
+    sprintf(text, "%x", options);
+    hasher_add(&hasher, text, (long)strlen(text) + 1);
+    hasher_add(&hasher, path, (long)strlen(path) + 1);
+    hasher_add(&hasher, source.data, source.size);
+    hasher_key(&hasher, key);
+    close_source(&source);
+    return 1;
+}
+
+/* Checks an entry's description: its included files must be unchanged
+   and its outputs present. Fills extensions and the diagnostics length;
+   leaves the file at the start of the diagnostics. Returns the number of
+   outputs, or -1 if the entry cannot be used. */
+static int read_meta(const BuildCache *cache, FILE *file, const char *key, const char **extensions,
+                     long *message_length) {
+    char word[16];
+    char hash[CACHE_KEY_LENGTH + 1];
+    char current[CACHE_KEY_LENGTH + 1];
+    char name[FILENAME_MAX];
+    char *path;
+    struct stat info;
+    int count = 0;
+    int i, found;
+
+    if (fscanf(file, "%15s", word) != 1 || strcmp(word, CACHE_MAGIC) != 0) {
+        return -1;
+    }
+    while (fscanf(file, "%15s", word) == 1) {
+        if (strcmp(word, "include") == 0) {
+            /* The file name is the rest of the line */
+            if (fscanf(file, "%40s ", hash) != 1 || fgets(name, sizeof(name), file) == NULL) {
+                return -1;
+            }
+            name[strcspn(name, "\n")] = '\0';
+            if (!hash_file(name, current) || strcmp(hash, current) != 0) {
+                return -1;
+            }
+        } else if (strcmp(word, "output") == 0) {
+            if (fscanf(file, "%15s", word) != 1 || count == EXTENSION_COUNT) {
+                return -1;
+            }
+            for (i = 0, found = 0; i < EXTENSION_COUNT && !found; i++) {
+                if (strcmp(word, all_extensions[i]) == 0) {
+                    extensions[count] = all_extensions[i];
+                    found = 1;
+                }
+            }
+            path = found ? entry_path(cache, key, extensions[count]) : NULL;
+            if (path == NULL || stat(path, &info) != 0) {
+                free(path);
+                return -1;
+            }
+            free(path);
+            count++;
+        } else if (strcmp(word, "messages") == 0) {
+            if (fscanf(file, "%ld", message_length) != 1 || fgetc(file) != '\n') {
+                return -1;
+            }
+            return count;
+        } else {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+int cache_fetch(BuildCache *cache, const char *path, unsigned int options, CacheKey *key,
+                Output *messages) {
+    const char *extensions[EXTENSION_COUNT];
+    char buffer[BUFSIZ];
+    char *meta;
+    char *from;
+    char *to;
+    FILE *file;
+    long length;
+    size_t chunk;
+    int count, i;
+    int hit = 1;
+
+    key->valid = source_key(path, options, key->name);
+    if (!key->valid) {
+        return 0;
+    }
+
+    meta = entry_path(cache, key->name, META_EXTENSION);
+    file = fopen(meta, "r");
+    count = file != NULL ? read_meta(cache, file, key->name, extensions, &length) : -1;
+    for (i = 0; i < count && hit; i++) {
+        from = entry_path(cache, key->name, extensions[i]);
+        to = output_path(path, extensions[i]);
+        hit = place_file(from, to);
+        free(from);
+        free(to);
+    }
+    if (count < 0 || !hit) {
+        if (file != NULL) {
+            fclose(file);
+        }
+        free(meta);
+        cache->run.misses++;
+        return 0;
+    }
+
+    while (length > 0 && (chunk = fread(buffer, 1, length < (long)sizeof(buffer) ? (size_t)length : sizeof(buffer), file)) > 0) {
+        output_bytes(messages, buffer, (long)chunk);
+        length -= (long)chunk;
+    }
+    fclose(file);
+
+    /* The time of the description is the entry's last use */
+    utime(meta, NULL);
+    free(meta);
+    cache->run.hits++;
+    return 1;
+}
+
+/* Removes every file of an entry; returns the bytes freed */
+static long remove_entry(const BuildCache *cache, const char *key) {
+    struct stat info;
+    char *path;
+    long freed = 0;
+    int i;
+
+    for (i = 0; i <= EXTENSION_COUNT; i++) {
+        path = entry_path(cache, key, i < EXTENSION_COUNT ? all_extensions[i] : META_EXTENSION);
+        if (stat(path, &info) == 0 && remove(path) == 0) {
+            freed += (long)info.st_size;
+        }
+        free(path);
+    }
+    return freed;
+}
+
+void cache_store(BuildCache *cache, const char *path, unsigned int options, const CacheKey *key,
+                 const char *const *includes, int include_count, const char *messages,
+                 long length) {
+    const char *extensions[EXTENSION_COUNT];
+    char hash[CACHE_KEY_LENGTH + 1];
+    char suffix[32];
+    char *meta;
+    char *temporary;
+    char *from;
+    char *to;
+    FILE *file;
+    int count = produced_outputs(options, extensions);
+    int ok = 1;
+    int i;
+
+    if (!key->valid) {
+        return;
+    }
+
+    /* An older entry of the key stops counting before its outputs are
+       replaced; the new one counts once its description exists */
+    meta = entry_path(cache, key->name, META_EXTENSION);
+    remove(meta);
+    for (i = 0; i < count && ok; i++) {
+        from = output_path(path, extensions[i]);
+        to = entry_path(cache, key->name, extensions[i]);
+        ok = store_file(from, to);
+        free(from);
+        free(to);
+    }
+
+    sprintf(suffix, ".%ld.tmp", (long)getpid());
+    temporary = join(meta, suffix, "");
+    file = ok ? fopen(temporary, "w") : NULL;
+    if (file != NULL) {
+        fprintf(file, "%s\n", CACHE_MAGIC);
+        for (i = 0; i < include_count && ok; i++) {
+            ok = hash_file(includes[i], hash) && strchr(includes[i], '\n') == NULL;
+            if (ok) {
+                fprintf(file, "include %s %s\n", hash, includes[i]);
+            }
+        }
+        for (i = 0; i < count; i++) {
+            fprintf(file, "output %s\n", extensions[i]);
+        }
+        fprintf(file, "messages %ld\n", length);
+        fwrite(messages, 1, length, file);
+        ok = fclose(file) == 0 && ok && rename(temporary, meta) == 0;
+    }
+
+    /* A failed store leaves nothing of the entry behind */
+    if (file == NULL || !ok) {
+        remove(temporary);
+        remove_entry(cache, key->name);
+    } else {
+        cache->run.stores++;
+    }
+    free(temporary);
+    free(meta);
+}
+
+/* Oldest entries first */
+static int compare_entries(const void *a, const void *b) {
+    const CacheEntry *left = a;
+    const CacheEntry *right = b;
+
+    if (left->used != right->used) {
+        return left->used < right->used ? -1 : 1;
+    }
+    return strcmp(left->key, right->key);
+}
+
+/* Entry keys in order, for bsearch */
+static int compare_keys(const void *a, const void *b) {
+    return strcmp(((const CacheEntry *)a)->key, ((const CacheEntry *)b)->key);
+}
+
+/* Kinds of file names in the cache directory */
+#define OTHER_FILE 0
+#define OUTPUT_FILE 1                 /* A key and one of all_extensions */
+#define META_FILE 2                   /* A key and META_EXTENSION */
+
+static int file_kind(const char *name) {
+    int i;
+
+    if (strspn(name, "0123456789abcdef") != CACHE_KEY_LENGTH) {
+        return OTHER_FILE;
+    }
+    name += CACHE_KEY_LENGTH;
+    if (strcmp(name, META_EXTENSION) == 0) {
+        return META_FILE;
+    }
+    for (i = 0; i < EXTENSION_COUNT; i++) {
+        if (strcmp(name, all_extensions[i]) == 0) {
+            return OUTPUT_FILE;
+        }
+    }
+    return OTHER_FILE;
+}
+
+/* Evicts the entries used longest ago until the cache fits its limit.
+   Only entries with a description count towards the size. Outputs
+   without one and temporary files are what a store that failed or was
+   stopped leaves behind; they are removed once CACHE_STALE_AGE old
+   (younger ones may belong to a build still storing them). */
+static void trim_cache(BuildCache *cache) {
+    DIR *dir = opendir(cache->dir);
+    struct dirent *item;
+    struct stat info;
+    CacheEntry *entries = NULL;
+    CacheEntry probe;
+    int entry_count = 0;
+    int entry_capacity = 0;
+    long total = 0;
+    time_t now = time(NULL);
+    size_t length;
+    char *path;
+    int kind;
+    int i;
+
+    if (dir == NULL) {
+        return;
+    }
+
+    /* First the entries, found by their descriptions */
+    while ((item = readdir(dir)) != NULL) {
+        if (file_kind(item->d_name) != META_FILE) {
+            continue;
+        }
+        path = join(cache->dir, "/", item->d_name);
+        if (stat(path, &info) == 0 && S_ISREG(info.st_mode)) {
+            total += (long)info.st_size;
+            if (entry_count == entry_capacity) {
+                entry_capacity = entry_capacity ? entry_capacity * 2 : 64;
+                entries = realloc(entries, entry_capacity * sizeof(CacheEntry));
+                if (entries == NULL) {
+                    fprintf(stderr, "Failed to allocate memory for the build cache\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            memcpy(entries[entry_count].key, item->d_name, CACHE_KEY_LENGTH);
+            entries[entry_count].key[CACHE_KEY_LENGTH] = '\0';
+            entries[entry_count].used = info.st_mtime;
+            entry_count++;
+        }
+        free(path);
+    }
+    if (entry_count > 0) {
+        qsort(entries, entry_count, sizeof(CacheEntry), compare_keys);
+    }
+
+    /* Then their outputs, and what stopped stores left */
+    rewinddir(dir);
+    while ((item = readdir(dir)) != NULL) {
+        kind = file_kind(item->d_name);
+        length = strlen(item->d_name);
+        if (kind == META_FILE ||
+            (kind == OTHER_FILE && (length < 4 || strcmp(item->d_name + length - 4, ".tmp") != 0))) {
+            continue;
+        }
+        path = join(cache->dir, "/", item->d_name);
+        if (stat(path, &info) == 0 && S_ISREG(info.st_mode)) {
+            if (kind == OUTPUT_FILE) {
+                memcpy(probe.key, item->d_name, CACHE_KEY_LENGTH);
+                probe.key[CACHE_KEY_LENGTH] = '\0';
+            }
+            if (kind == OUTPUT_FILE && entry_count > 0 &&
+                bsearch(&probe, entries, entry_count, sizeof(CacheEntry), compare_keys) != NULL) {
+                total += (long)info.st_size;
+            } else if (difftime(now, info.st_mtime) > CACHE_STALE_AGE) {
+                remove(path);
+            }
+        }
+        free(path);
+    }
+    closedir(dir);
+
+    if (total > cache->limit && entry_count > 0) {
+        qsort(entries, entry_count, sizeof(CacheEntry), compare_entries);
+        for (i = 0; i < entry_count && total > cache->limit; i++) {
+            total -= remove_entry(cache, entries[i].key);
+            cache->run.evictions++;
+        }
+    }
+    free(entries);
+}
+
+void cache_close(BuildCache *cache, int print_stats) {
+    CacheStats total;
+    char *path;
+    FILE *file;
+
+    trim_cache(cache);
+
+    /* Add this run's counts to the saved ones */
+    read_stats(cache, &total);
+    total.hits += cache->run.hits;
+    total.misses += cache->run.misses;
+    total.stores += cache->run.stores;
+    total.evictions += cache->run.evictions;
+    path = join(cache->dir, "/stats", "");
+    file = fopen(path, "w");
+    if (file != NULL) {
+        fprintf(file, "hits %ld\nmisses %ld\nstores %ld\nevictions %ld\n", total.hits, total.misses,
+                total.stores, total.evictions);
+        fclose(file);
+    }
+    free(path);
+
+    if (print_stats) {
+        printf("Cache: %ld hits, %ld misses, %ld stored, %ld evicted (total %ld hits, %ld misses)\n",
+               cache->run.hits, cache->run.misses, cache->run.stores, cache->run.evictions,
+               total.hits, total.misses);
+    }
+    free(cache->dir);
+    free(cache);
+}
@@ -0,0 +1,58 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "asm.h"
+#include "output.h"
+
+/* Build cache (-cache DIR): skips the assembly of a file whose outputs are
+   known. An entry is keyed by a hash of the source path and content, the
+   options and ASM_VERSION, and records the files read through .include
+   (size and hash), the diagnostics, and the outputs. On a hit whose
+   included files are unchanged, the outputs are hardlinked next to the
+   source (copied where links are not possible) and the diagnostics are
+   printed again. Only assemblies without errors are stored.
+
+   Entry files are written under temporary names and renamed, so a build
+   that stops halfway never leaves an entry that looks complete. When the
+   cache grows past its limit, the entries used longest ago are evicted;
+   files that no entry owns (left by a stopped build) are removed once
+   they are an hour old.
+   Hit, miss, store and eviction counts are kept in DIR/stats; builds
+   that share the cache at the same time may lose some counts. */
+
+/* Default size limit of a cache in bytes */
+#define CACHE_DEFAULT_LIMIT (256L * 1024 * 1024)
+
+/* Hex digits of a cache key */
+#define CACHE_KEY_LENGTH 40
+
+typedef struct BuildCache BuildCache;
+
+/* The key of one source, computed by cache_fetch */
+typedef struct {
+    char name[CACHE_KEY_LENGTH + 1];
+    int valid;                        /* 0 if the source could not be read */
+} CacheKey;
+
+/* Opens (and creates) the cache in a directory. Returns NULL with a
+   message if the directory cannot be created. */
+BuildCache *cache_open(const char *dir, long limit);
+
+/* Looks a source up. On a hit, the outputs are placed next to it, its
+   diagnostics are appended to messages and 1 is returned. Otherwise
+   returns 0; key is set for cache_store either way. */
+int cache_fetch(BuildCache *cache, const char *path, unsigned int options, CacheKey *key,
+                Output *messages);
+
+/* Stores the outputs of an assembly of path without errors, made with
+   the given options, under the key cache_fetch gave it. Failing to store
+   is not an error: the file is assembled again next time. */
+void cache_store(BuildCache *cache, const char *path, unsigned int options, const CacheKey *key,
+                 const char *const *includes, int include_count, const char *messages,
+                 long length);
+
+/* Evicts entries down to the size limit, saves the counts and closes the
+   cache; with print_stats, prints the counts to stdout */
+void cache_close(BuildCache *cache, int print_stats);
+
+#endif /* CACHE_H */
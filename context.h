@@ -0,0 +1,35 @@
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include <stdio.h>
+#include "asm.h"
+#include "intern.h"
+#include "table.h"
+#include "pre_prossecor.h"
+#include "output.h"
+
+/* Everything one assembly works on. Only the library sources see the
+   layout; users of asm.h hold a pointer. */
+struct AsmContext {
+    StringPool strings;               /* Interned labels */
+    Tables tables;                    /* Symbols, image, entries, externs */
+    Preprocessor pre;                 /* Macros, tokens and expanded program */
+    unsigned int options;             /* ASM_* options */
+    FILE *diagnostics;                /* Where errors are reported (stderr by default) */
+    int threads;                      /* Threads one assembly may use (0 or 1 = one) */
+    int writeFiles;                   /* Outputs go to files named after baseName */
+    char baseName[FILENAME_MAX];      /* Input name without its .as extension */
+    Output object;                    /* .ob */
+    Output entries;                   /* .ent */
+    Output externals;                 /* .ext */
+    Output expanded;                  /* .am */
+    Output binary;                    /* .obx */
+    Output compressed;                /* .obz */
+};
+
+/* Starts one output of the current assembly: the file baseName+extension
+   when writing files, the context's memory buffer otherwise.
+   Returns 0 if the file cannot be created. */
+int open_context_output(AsmContext *ctx, Output *out, const char *extension);
+
+#endif /* CONTEXT_H */
@@ -2,216 +2,345 @@
 #include "first_pass.h"
 #include "util.h"
 #include "table.h"
+#include "isa.h"
+#include "second_pass.h"
+#include "context.h"
+#include "parallel.h"
+
+/* Fewest lines worth a chunk of their own in the parallel first pass */
+#define PARALLEL_CHUNK_LINES 16384
+
+/* A run of program lines assembled on its own thread, in a context of its
+   own and from address 0; merged back in order once all chunks are done */
+typedef struct {
+    AsmContext *part;
+    const ProgramLine *lines;
+    int line_count;
+    int IC;                           /* Code words of the chunk */
+    int DC;                           /* Data words of the chunk */
+    FILE *diagnostics;                /* Its messages, printed in chunk order */
+} FirstPassChunk;
+
+/* What the threads of the parallel first pass share (read only) */
+typedef struct {
+    AsmContext *ctx;
+    const Token *tokens;
+    int shared;                       /* Strings interned before the pass */
+    FirstPassChunk *chunks;
+} FirstPassSplit;
+
+static int define_label(AsmContext *ctx, const Token *label, int address);
+static AddressingMode operand_mode(const Token *operand);
+static int immediate_in_range(AsmContext *ctx, const Token *operand, int report_errors);
+static void decode_operand_value(AsmContext *ctx, const Token *operand, AddressingMode mode,
+                                 int *value, StringId *label);
+static void encode_operand_word(AsmContext *ctx, AddressingMode mode, int value, StringId label,
+                                int *address, int *instruction_counter);
+static void first_pass_split(AsmContext *ctx, const ProgramLine *lines, int line_count,
+                             const Token *tokens, int *IC, int *DC);
+
+/* Check if a given addressing mode is in a legal-mode mask of the ISA table */
+int is_mode_allowed(int mode, unsigned int allowed_modes) {
+    return (allowed_modes & ISA_MODE_BIT(mode)) != 0;
+}
 
-/* Instruction table: maps instruction mnemonics to their opcode and function code */
-Instruction instruction_table[] = {
-    {0, 0, "mov"}, {1, 0, "cmp"}, {2, 1, "add"}, {2, 2, "sub"},
-    {4, 0, "lea"}, {5, 1, "clr"}, {5, 2, "not"}, {5, 3, "inc"}, {5, 4, "dec"},
-    {9, 1, "jmp"}, {9, 2, "bne"}, {9, 3, "jsr"}, {12, 0, "red"},
-    {13, 0, "prn"}, {14, 0, "rts"}, {15, 0, "stop"}
-};
-
-/* Instruction info table: defines how many operands each instruction expects,
-   and which addressing modes are allowed for source and destination operands */
-InstructionInfo instruction_info_table[] = {
-    {0, 2, {0, 1, 3, -1}, {1, 3, -1}},    /* mov */
-    {1, 2, {0, 1, 3, -1}, {0, 1, 3, -1}}, /* cmp */
-    {2, 2, {0, 1, 3, -1}, {1, 3, -1}},    /* add */
-    {2, 2, {0, 1, 3, -1}, {1, 3, -1}},    /* sub */
-    {4, 2, {1, -1}, {1, 3, -1}},          /* lea */
-    {5, 1, {-1}, {1, 3, -1}},             /* clr */
-    {5, 1, {-1}, {1, 3, -1}},             /* not */
-    {5, 1, {-1}, {1, 3, -1}},             /* inc */
-    {5, 1, {-1}, {1, 3, -1}},             /* dec */
-    {9, 1, {-1}, {1, 2, -1}},             /* jmp */
-    {9, 1, {-1}, {1, 2, -1}},             /* bne */
-    {9, 1, {-1}, {1, 2, -1}},             /* jsr */
-    {12, 1, {-1}, {1, 3, -1}},            /* red */
-    {13, 1, {-1}, {0, 1, 3, -1}},         /* prn */
-    {14, 0, {-1}, {-1}},                  /* rts */
-    {15, 0, {-1}, {-1}}                   /* stop */
-};
-
-/* Check if a given addressing mode is allowed by the current instruction */
-int is_mode_allowed(int mode, int *allowed_modes) {
-    int i;
-    for (i = 0; allowed_modes[i] != -1; i++) {
-        if (mode == allowed_modes[i]) {
-            return 1;
-        }
+/* Adds the label of a line to the symbol table; in one-pass mode, the uses
+   of a new label seen so far are filled in. Returns its symbol index. */
+static int define_label(AsmContext *ctx, const Token *label, int address) {
+    StringId name = intern_bytes(&ctx->strings, label->start, label->length);
+    int count = get_symbol_count(ctx);
+    int index = add_symbol(ctx, name, address);
+
+    if (is_one_pass(ctx) && index == count) {
+        backpatch_label(ctx, name);
     }
-    return 0;
+    return index;
 }
 
 /* Handle the .data directive:
    If there is a label, store it.
-   Then parse each number and store it in memory and update symbol if needed. */
-void handle_data_directive(const char *label, char *token, int *address, int *DC) {
-    int symbol_index;
-    int value;
-
-    if (label) {
-        add_symbol(label, *address);
-        symbol_index = get_symbol_count() - 1;
-    } else {
-        symbol_index = -1;
-    }
-
-    while ((token = strtok(NULL, " ,\t\n"))) {
-        if (is_valid_integer(token)) {
-            value = atoi(token);
-            add_object((*address)++, value);
-            if (symbol_index != -1) {
-                add_data_to_symbol(symbol_index, value);
+   The numbers were parsed by the lexer; each is range checked, and the
+   whole list is added to memory as one block, which the label's data
+   extent covers. Commas between the numbers are skipped. */
+void handle_data_directive(AsmContext *ctx, const Token *label, const Token *token, const Token *end,
+                           int *address, int *DC) {
+    int symbol_index = label ? define_label(ctx, label, *address) : -1;
+    int values[MAX_LINE_TOKENS];
+    int count = 0;
+
+    for (; token < end; token++) {
+        if (token->kind == TOKEN_NUMBER) {
+            if (token->value < DATA_MIN || token->value > DATA_MAX) {
+                fprintf(ctx->diagnostics, "Error: Value out of range in .data: %.*s\n",
+                        (int)token->length, token->start);
+            } else {
+                values[count++] = token->value;
             }
-            (*DC)++;
-        } else {
-            fprintf(stderr, "Error: Invalid Integer in .data: %s\n", token);
+        } else if (token->kind != TOKEN_COMMA) {
+            fprintf(ctx->diagnostics, "Error: Invalid Integer in .data: %.*s\n",
+                    (int)token->length, token->start);
         }
     }
+
+    add_objects(ctx, *address, values, count);
+    *address += count;
+    *DC += count;
+
+    if (symbol_index != -1) {
+        set_symbol_data(ctx, symbol_index, count);
+    }
 }
 
 /* Handle the .string directive:
    If label is present, save it.
-   Then add each character to memory followed by null terminator. */
-void handle_string_directive(const char *label, char *token, int *address, int *DC) {
-    int symbol_index;
+   Then add the characters to memory, followed by a null terminator,
+   as one block. */
+void handle_string_directive(AsmContext *ctx, const Token *label, const Token *token, const Token *end,
+                             int *address, int *DC) {
+    int symbol_index = label ? define_label(ctx, label, *address) : -1;
+    int values[MAX_LINE_LEN];
+    int count = 0;
     int i;
 
-    if (label) {
-        add_symbol(label, *address);
-        symbol_index = get_symbol_count() - 1;
-    } else {
-        symbol_index = -1;
-    }
-
-    token = strtok(NULL, "\t\n");
-    if (!token) {
-        fprintf(stderr, "Error: Missing string after .string\n");
+    if (token == end) {
+        fprintf(ctx->diagnostics, "Error: Missing string after .string\n");
         return;
     }
 
-    if (token[0] == '"' && token[strlen(token) - 1] == '"') {
-        for (i = 1; i < (int)strlen(token) - 1; i++) {
-            add_object((*address)++, token[i]);
-            if (symbol_index != -1) {
-                add_data_to_symbol(symbol_index, token[i]);
-            }
-            (*DC)++;
-        }
-        add_object((*address)++, '\0');
-        if (symbol_index != -1) {
-            add_data_to_symbol(symbol_index, '\0');
+    if (token->kind == TOKEN_STRING) {
+        for (i = 1; i < token->length - 1; i++) {
+            values[count++] = token->start[i];
         }
-        (*DC)++;
+        values[count++] = '\0';
+        add_objects(ctx, *address, values, count);
+        *address += count;
+        *DC += count;
     } else {
-        fprintf(stderr, "Error: Invalid string format in .string: %s\n", token);
+        fprintf(ctx->diagnostics, "Error: Invalid string format in .string: %.*s\n",
+                (int)token->length, token->start);
+    }
+
+    if (symbol_index != -1) {
+        set_symbol_data(ctx, symbol_index, count);
     }
 }
 
-/* First pass on the source file:
-   Reads each line, detects labels and directives,
-   and processes them or sends instructions for further handling. */
-void first_pass(const char *file_name, int *IC, int *DC) {
-    FILE *file;
-    char line[MAX_LINE_LEN];
-    char line_copy[MAX_LINE_LEN];
+/* First pass on the expanded program:
+   Goes over the tokens of each line (lexed once by the pre-processor),
+   detects labels and directives, and processes them or sends
+   instructions for further handling. */
+void first_pass(AsmContext *ctx, const ProgramLine *lines, int line_count, const Token *tokens,
+                int *IC, int *DC) {
+    const ProgramLine *line;
+    const Token *token;
+    const Token *end;
+    const Token *label;
     int address;
-    char *token;
+    int i;
 
-    file = fopen(file_name, "r");
-    if (!file) {
-        perror("Error opening file");
-        exit(EXIT_FAILURE);
+    /* A large program is split into chunks that are assembled in parallel */
+    if (ctx->threads > 1 && !is_streaming(ctx) && !is_one_pass(ctx) &&
+        line_count >= 2 * PARALLEL_CHUNK_LINES) {
+        first_pass_split(ctx, lines, line_count, tokens, IC, DC);
+        return;
     }
 
-    address = MEMORY_START;
+    /* Code and data share the location counter, so it resumes at IC + DC
+       (IC starts at MEMORY_START): the program may come in batches */
+    address = *IC + *DC;
 
-    while (fgets(line, sizeof(line), file)) {
-        if (is_comment_or_empty_line(line)) {
-            continue;
+    for (i = 0; i < line_count; i++) {
+        line = &lines[i];
+
+        /* Lines of a macro expansion were decoded once at 'mcroend':
+           replay them into the encoder */
+        if (line->macroLine != -1) {
+            const MacroLine *macro_line = get_macro_line(ctx, line->macroLine);
+
+            if (macro_line->isDecoded) {
+                encode_instruction(ctx, &macro_line->instruction, &address, IC);
+                continue;
+            }
         }
 
-        if (is_line_to_long(line)) {
-            fprintf(stderr, "Error: Line exceeds maximum length of %d\n", MAX_LINE_LEN);
+        /* Comments and empty lines have no tokens */
+        if (line->tokenCount == 0) {
             continue;
         }
 
-        strcpy(line_copy, line);
-        token = strtok(line_copy, " \t\n");
-        if (!token) {
+        if (is_line_to_long(line->text.length)) {
+            fprintf(ctx->diagnostics, "Error: Line exceeds maximum length of %d\n", MAX_LINE_LEN);
             continue;
         }
 
-        /* Check for label */
-        if (strchr(token, ':')) {
-            char *label = token;
-            label[strlen(label) - 1] = '\0';
-            add_symbol(label, address);
-            token = strtok(NULL, " \t\n");
+        token = tokens + line->firstToken;
+        end = token + line->tokenCount;
+
+        /* Check for label; a data label is added by its directive */
+        label = NULL;
+        if (token->kind == TOKEN_LABEL) {
+            label = token++;
         }
 
-        if (token && !strcmp(token, ".data")) {
-            handle_data_directive(NULL, token, &address, DC);
-        } else if (token && !strcmp(token, ".string")) {
-            handle_string_directive(NULL, token, &address, DC);
-        } else if (token && !strcmp(token, ".entry")) {
-            token = strtok(NULL, " \t\n");
-            if (token) {
-                add_entry(token, -1);
+        if (token < end && token_equals(token, ".data")) {
+            handle_data_directive(ctx, label, token + 1, end, &address, DC);
+        } else if (token < end && token_equals(token, ".string")) {
+            handle_string_directive(ctx, label, token + 1, end, &address, DC);
+        } else {
+            if (label) {
+                define_label(ctx, label, address);
             }
-        } else if (token && !strcmp(token, ".extern")) {
-            token = strtok(NULL, " \t\n");
-            if (token) {
-                add_extern(token, -1);
+            if (token < end && token_equals(token, ".entry")) {
+                if (token + 1 < end) {
+                    add_entry(ctx, intern_bytes(&ctx->strings, token[1].start, token[1].length), -1);
+                }
+            } else if (token < end && token_equals(token, ".extern")) {
+                if (token + 1 < end) {
+                    add_extern_usage(ctx, intern_bytes(&ctx->strings, token[1].start, token[1].length), -1);
+                }
+            } else if (token < end) {
+                handle_instruction(ctx, token, end, &address, IC);
             }
-        } else if (token) {
-            handle_instruction(token, &address, IC);
         }
     }
+}
 
-    fclose(file);
+/* Assembles one chunk of the parallel first pass. Its context sees the
+   macros of the file and starts with the strings interned so far (same
+   ids), so pre-decoded macro lines can be replayed as they are. */
+static void first_pass_chunk(void *arg, int index) {
+    FirstPassSplit *split = arg;
+    FirstPassChunk *chunk = &split->chunks[index];
+    AsmContext *part = asm_create();
+    int id;
+
+    part->pre = split->ctx->pre;
+    reset_tables(part);
+    for (id = 0; id < split->shared; id++) {
+        intern_string(&part->strings, string_of(&split->ctx->strings, (StringId)id));
+    }
+    chunk->diagnostics = tmpfile();
+    asm_set_diagnostics(part, chunk->diagnostics);
+
+    chunk->part = part;
+    chunk->IC = 0;
+    chunk->DC = 0;
+    first_pass(part, chunk->lines, chunk->line_count, split->tokens, &chunk->IC, &chunk->DC);
+}
+
+/* Parallel first pass: the lines are split into chunks at line boundaries,
+   and each chunk is assembled from address 0. A line's size only depends
+   on the line, so the address of every chunk is the sum of the sizes
+   before it; the chunks' labels, entries, externs, pending words and words
+   are then merged in order at that address, which gives the same tables
+   (and messages) as one pass over all lines. */
+static void first_pass_split(AsmContext *ctx, const ProgramLine *lines, int line_count,
+                             const Token *tokens, int *IC, int *DC) {
+    FirstPassSplit split;
+    FirstPassChunk *chunk;
+    int chunk_count = line_count / PARALLEL_CHUNK_LINES;
+    int base = *IC + *DC;
+    int i;
+    char buffer[BUFSIZ];
+    size_t length;
+
+    if (chunk_count > ctx->threads) {
+        chunk_count = ctx->threads;
+    }
+    split.ctx = ctx;
+    split.tokens = tokens;
+    split.shared = get_string_count(&ctx->strings);
+    split.chunks = malloc(chunk_count * sizeof(FirstPassChunk));
+    if (split.chunks == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the parallel first pass\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < chunk_count; i++) {
+        chunk = &split.chunks[i];
+        chunk->lines = lines + (long)line_count * i / chunk_count;
+        chunk->line_count = (int)((long)line_count * (i + 1) / chunk_count -
+                                  (long)line_count * i / chunk_count);
+    }
+
+    run_parallel(chunk_count, first_pass_chunk, &split);
+
+    for (i = 0; i < chunk_count; i++) {
+        chunk = &split.chunks[i];
+        if (chunk->diagnostics != NULL) {
+            rewind(chunk->diagnostics);
+            while ((length = fread(buffer, 1, sizeof(buffer), chunk->diagnostics)) > 0) {
+                fwrite(buffer, 1, length, ctx->diagnostics);
+            }
+            fclose(chunk->diagnostics);
+        }
+        merge_tables(ctx, chunk->part, split.shared, base);
+        base += chunk->IC + chunk->DC;
+        *IC += chunk->IC;
+        *DC += chunk->DC;
+
+        /* The macros belong to ctx */
+        memset(&chunk->part->pre, 0, sizeof(chunk->part->pre));
+        asm_destroy(chunk->part);
+    }
+    free(split.chunks);
 }
 
 /* Handle an instruction line:
+   - Pick the operands (up to two) out of the tokens after the mnemonic
+   - Decode and validate the instruction
+   - Encode it into memory */
+void handle_instruction(AsmContext *ctx, const Token *instruction, const Token *end,
+                        int *address, int *instruction_counter) {
+    DecodedInstruction decoded;
+    const Token *operand1 = NULL;
+    const Token *operand2 = NULL;
+    const Token *token;
+
+    for (token = instruction + 1; token < end && operand2 == NULL; token++) {
+        if (token->kind == TOKEN_COMMA) {
+            continue;
+        }
+        if (operand1 == NULL) {
+            operand1 = token;
+        } else {
+            operand2 = token;
+        }
+    }
+
+    if (decode_instruction(ctx, instruction, operand1, operand2, &decoded, 1)) {
+        encode_instruction(ctx, &decoded, address, instruction_counter);
+    }
+}
+
+/* Decode an instruction without emitting anything:
    - Check if instruction is valid
-   - Parse operands and validate their addressing modes
-   - Encode the instruction into binary and add it to memory
-   - Add extra words for operands as needed (with placeholders for labels) */
-void handle_instruction(char *instruction, int *address, int *instruction_counter) {
-    int i;
-    int opcode = -1;
-    int funct = 0;
+   - Validate the operands and their addressing modes
+   - Keep register codes, immediate values and interned labels
+   Errors are printed only if report_errors is set, so macro bodies can be
+   decoded ahead of time and left to the regular path when they fail.
+   Returns 1 if the instruction is valid, 0 otherwise. */
+int decode_instruction(AsmContext *ctx, const Token *instruction, const Token *operand1, const Token *operand2,
+                       DecodedInstruction *decoded, int report_errors) {
+    const IsaEntry *entry;
     AddressingMode source_mode = -1;
     AddressingMode destination_mode = -1;
     int source_register = 0;
     int destination_register = 0;
     int operand_count = 0;
-    char *operand1 = NULL;
-    char *operand2 = NULL;
-    CodeWord code_word;
-    unsigned int encoded_value = 0;
-    int is_valid = 0;
-
-    /* Step 1: Find the instruction's opcode and funct from the table */
-    for (i = 0; i < (int)(sizeof(instruction_table) / sizeof(Instruction)); i++) {
-        if (strcmp(instruction, instruction_table[i].name) == 0) {
-            opcode = instruction_table[i].opcode;
-            funct = instruction_table[i].funct;
-            break;
-        }
-    }
+
+    /* Step 1: Find the instruction in the generated ISA table */
+    entry = isa_lookup_bytes(instruction->start, instruction->length);
 
     /* If the instruction is unknown, print error and return */
-    if (opcode == -1) {
-        fprintf(stderr, "Error: Unknown instruction '%s'\n", instruction);
-        return;
+    if (entry == NULL) {
+        if (report_errors) {
+            fprintf(ctx->diagnostics, "Error: Unknown instruction '%.*s'\n",
+                    (int)instruction->length, instruction->start);
+        }
+        return 0;
     }
 
-    /* Step 2: Extract up to two operands (comma-separated) */
-    operand1 = strtok(NULL, ", \t\n");
-    operand2 = strtok(NULL, ", \t\n");
-
+    /* Step 2: Count the operands (up to two, comma-separated) */
     if (operand1 && operand2) {
         operand_count = 2;
     } else if (operand1) {
@@ -221,168 +350,198 @@ void handle_instruction(char *instruction, int *address, int *instruction_counte
     }
 
     /* Step 3: Validate number of operands and addressing modes */
-    for (i = 0; i < (int)(sizeof(instruction_info_table) / sizeof(InstructionInfo)); i++) {
-        if (instruction_info_table[i].opcode == opcode) {
-
-            /* Check operand count */
-            if (instruction_info_table[i].num_operands != operand_count) {
-                fprintf(stderr,
-                        "Error: Instruction '%s' expects %d operand(s), got %d\n",
-                        instruction, instruction_info_table[i].num_operands, operand_count);
-                return;
-            }
+    if (entry->num_operands != operand_count) {
+        if (report_errors) {
+            fprintf(ctx->diagnostics,
+                    "Error: Instruction '%s' expects %d operand(s), got %d\n",
+                    entry->name, entry->num_operands, operand_count);
+        }
+        return 0;
+    }
 
-            /* If two operands, check both */
-            if (operand_count == 2) {
-                source_mode = get_addressing_mode(operand1);
-                destination_mode = get_addressing_mode(operand2);
+    /* If two operands, check both */
+    if (operand_count == 2) {
+        source_mode = operand_mode(operand1);
+        destination_mode = operand_mode(operand2);
+
+        if (!is_mode_allowed(source_mode, entry->src_modes)) {
+            if (report_errors) {
+                fprintf(ctx->diagnostics,
+                        "Error: Illegal source operand addressing mode in instruction '%s'\n",
+                        entry->name);
+            }
+            return 0;
+        }
+        if (!is_mode_allowed(destination_mode, entry->dst_modes)) {
+            if (report_errors) {
+                fprintf(ctx->diagnostics,
+                        "Error: Illegal destination operand addressing mode in instruction '%s'\n",
+                        entry->name);
+            }
+            return 0;
+        }
 
-                if (!is_mode_allowed(source_mode, instruction_info_table[i].legal_src_modes)) {
-                    fprintf(stderr,
-                            "Error: Illegal source operand addressing mode in instruction '%s'\n",
-                            instruction);
-                    return;
-                }
-                if (!is_mode_allowed(destination_mode, instruction_info_table[i].legal_dst_modes)) {
-                    fprintf(stderr,
-                            "Error: Illegal destination operand addressing mode in instruction '%s'\n",
-                            instruction);
-                    return;
-                }
+        /* Get register codes if mode is REGISTER_DIRECT (the lexer parsed them) */
+        if (source_mode == REGISTER_DIRECT) {
+            source_register = operand1->value;
+        }
 
-                /* Get register codes if mode is REGISTER_DIRECT */
-                if (source_mode == REGISTER_DIRECT) {
-                    source_register = get_register_code(operand1);
-                    if (source_register == -1) {
-                        fprintf(stderr, "Error: Invalid source register '%s'\n", operand1);
-                        return;
-                    }
-                }
+        if (destination_mode == REGISTER_DIRECT) {
+            destination_register = operand2->value;
+        }
+    }
 
-                if (destination_mode == REGISTER_DIRECT) {
-                    destination_register = get_register_code(operand2);
-                    if (destination_register == -1) {
-                        fprintf(stderr, "Error: Invalid destination register '%s'\n", operand2);
-                        return;
-                    }
-                }
+    /* If one operand, check destination only */
+    else if (operand_count == 1) {
+        destination_mode = operand_mode(operand1);
+        if (!is_mode_allowed(destination_mode, entry->dst_modes)) {
+            if (report_errors) {
+                fprintf(ctx->diagnostics,
+                        "Error: Illegal operand addressing mode in instruction '%s'\n",
+                        entry->name);
             }
+            return 0;
+        }
 
-            /* If one operand, check destination only */
-            else if (operand_count == 1) {
-                destination_mode = get_addressing_mode(operand1);
-                if (!is_mode_allowed(destination_mode, instruction_info_table[i].legal_dst_modes)) {
-                    fprintf(stderr,
-                            "Error: Illegal operand addressing mode in instruction '%s'\n",
-                            instruction);
-                    return;
-                }
+        if (destination_mode == REGISTER_DIRECT) {
+            destination_register = operand1->value;
+        }
+    }
 
-                if (destination_mode == REGISTER_DIRECT) {
-                    destination_register = get_register_code(operand1);
-                    if (destination_register == -1) {
-                        fprintf(stderr, "Error: Invalid register '%s'\n", operand1);
-                        return;
-                    }
-                }
-            }
+    /* Step 4: Immediate values must fit in their operand word */
+    if ((operand_count >= 1 && !immediate_in_range(ctx, operand1, report_errors)) ||
+        (operand_count == 2 && !immediate_in_range(ctx, operand2, report_errors))) {
+        return 0;
+    }
 
-            is_valid = 1;
-            break;
-        }
+    /* Step 5: Keep everything the encoder needs */
+    decoded->first_word = entry->first_word;
+    decoded->operand_count = operand_count;
+    decoded->source_mode = source_mode;
+    decoded->destination_mode = destination_mode;
+    decoded->source_register = source_register;
+    decoded->destination_register = destination_register;
+    decoded->source_value = 0;
+    decoded->destination_value = 0;
+    decoded->source_label = NO_STRING_ID;
+    decoded->destination_label = NO_STRING_ID;
+
+    if (operand_count == 2) {
+        decode_operand_value(ctx, operand1, source_mode,
+                             &decoded->source_value, &decoded->source_label);
+        decode_operand_value(ctx, operand2, destination_mode,
+                             &decoded->destination_value, &decoded->destination_label);
+    } else if (operand_count == 1) {
+        decode_operand_value(ctx, operand1, destination_mode,
+                             &decoded->destination_value, &decoded->destination_label);
     }
 
-    /* Step 4: If instruction is invalid after checking rules, return */
-    if (!is_valid) {
-        return;
+    return 1;
+}
+
+/* Returns the addressing mode of an operand token; anything that is not
+   an immediate, a relative label or a register is a direct label */
+static AddressingMode operand_mode(const Token *operand) {
+    switch (operand->kind) {
+        case TOKEN_IMMEDIATE:
+            return IMMEDIATE;
+        case TOKEN_RELATIVE:
+            return RELATIVE;
+        case TOKEN_REGISTER:
+            return REGISTER_DIRECT;
+        default:
+            return DIRECT;
     }
+}
 
-    /* Step 5: Build the CodeWord struct with all encoded fields */
-    code_word.opcode = opcode;
-    code_word.funct = funct;
-    code_word.src_addr = (operand_count == 2) ? source_mode : 0;
-    code_word.src_reg = (operand_count == 2) ? source_register : 0;
-    code_word.dest_addr = destination_mode;
-    code_word.dest_reg = destination_register;
-    code_word.A = 1;
-    code_word.R = 0;
-    code_word.E = 0;
-    code_word.unused = 0;
-
-    /* Step 6: Encode the instruction into a 24-bit binary word */
-    encoded_value = 0;
-    encoded_value |= (code_word.unused & 0x7) << 21;
-    encoded_value |= (code_word.opcode & 0xF) << 17;
-    encoded_value |= (code_word.src_reg & 0x7) << 14;
-    encoded_value |= (code_word.src_addr & 0x3) << 12;
-    encoded_value |= (code_word.dest_reg & 0x7) << 9;
-    encoded_value |= (code_word.dest_addr & 0x3) << 7;
-    encoded_value |= (code_word.funct & 0xF) << 3;
-    encoded_value |= (code_word.A & 0x1) << 2;
-    encoded_value |= (code_word.R & 0x1) << 1;
-    encoded_value |= (code_word.E & 0x1);
-
-    add_object(*instruction_counter, encoded_value);
-    (*instruction_counter)++;
-    (*address)++;
+/* Returns 0 (with an error if asked) for an immediate that does not fit
+   in 21 bits; other operands are always in range */
+static int immediate_in_range(AsmContext *ctx, const Token *operand, int report_errors) {
+    if (operand->kind != TOKEN_IMMEDIATE ||
+        (operand->value >= IMMEDIATE_MIN && operand->value <= IMMEDIATE_MAX)) {
+        return 1;
+    }
+    if (report_errors) {
+        fprintf(ctx->diagnostics, "Error: Immediate value out of range: %.*s\n",
+                (int)operand->length, operand->start);
+    }
+    return 0;
+}
 
-    /* Step 7: Add extra memory words for non-register operands */
+/* Keeps the immediate value or the interned label of a non-register operand */
+static void decode_operand_value(AsmContext *ctx, const Token *operand, AddressingMode mode,
+                                 int *value, StringId *label) {
+    if (mode == IMMEDIATE) {
+        *value = operand->value;
+    } else if (mode != REGISTER_DIRECT) {
+        *label = intern_bytes(&ctx->strings, operand->start, operand->length);
+    }
+}
 
-    /* Case: Two operands */
-    if (operand_count == 2) {
+/* Encode a decoded instruction:
+   - Build the first word and add it to memory
+   - Add extra words for operands as needed (with placeholders for labels)
+   Words go to *address, the location counter shared with data and labels;
+   the instruction counter only counts code words. */
+void encode_instruction(AsmContext *ctx, const DecodedInstruction *decoded, int *address,
+                        int *instruction_counter) {
+    unsigned int encoded_value;
+    int two_operands = (decoded->operand_count == 2);
+
+    /* Step 1: OR the operand fields into the precomputed first word
+       (opcode, funct and A already set; see isa_gen) */
+    encoded_value = (unsigned int)decoded->first_word;
+    if (two_operands) {
+        encoded_value |= (decoded->source_register & 0x7) << 14;
+        encoded_value |= (decoded->source_mode & 0x3) << 12;
+    }
+    encoded_value |= (decoded->destination_register & 0x7) << 9;
+    encoded_value |= (decoded->destination_mode & 0x3) << 7;
 
-        /* Source operand */
-        if (source_mode != REGISTER_DIRECT) {
-            if (source_mode == IMMEDIATE) {
-                int value;
-                value = atoi(operand1 + 1);
-                if (value < 0) {
-                    value = (1 << 21) + value;
-                }
-                add_object(*instruction_counter, ((value & 0x1FFFFF) << 3) | ABSULUTE);
-            } else {
-                add_object(*instruction_counter, 0);
-                add_pending_word(operand1, *instruction_counter, source_mode);
-            }
-            (*instruction_counter)++;
-            (*address)++;
-        }
+    add_object(ctx, *address, encoded_value);
+    (*instruction_counter)++;
+    (*address)++;
 
-        /* Destination operand */
-        if (destination_mode != REGISTER_DIRECT) {
-            if (destination_mode == IMMEDIATE) {
-                int value;
-                value = atoi(operand2 + 1);
-                if (value < 0) {
-                    value = (1 << 21) + value;
-                }
-                add_object(*instruction_counter, ((value & 0x1FFFFF) << 3) | ABSULUTE);
-            } else {
-                add_object(*instruction_counter, 0);
-                add_pending_word(operand2, *instruction_counter, destination_mode);
-            }
-            (*instruction_counter)++;
-            (*address)++;
-        }
+    /* Step 2: Add extra memory words for non-register operands */
+    if (two_operands) {
+        encode_operand_word(ctx, decoded->source_mode, decoded->source_value,
+                            decoded->source_label, address, instruction_counter);
+    }
+    if (decoded->operand_count >= 1) {
+        encode_operand_word(ctx, decoded->destination_mode, decoded->destination_value,
+                            decoded->destination_label, address, instruction_counter);
+    }
+}
 
+/* Add the extra word of one operand: the immediate value itself,
+   or a placeholder that the second pass fills in for a label */
+static void encode_operand_word(AsmContext *ctx, AddressingMode mode, int value, StringId label,
+                                int *address, int *instruction_counter) {
+    if (mode == REGISTER_DIRECT) {
+        return;
     }
 
-    /* Case: One operand */
-    else if (operand_count == 1) {
-        if (destination_mode != REGISTER_DIRECT) {
-            if (destination_mode == IMMEDIATE) {
-                int value;
-                value = atoi(operand1 + 1);
-                if (value < 0) {
-                    value = (1 << 21) + value;
-                }
-                add_object(*instruction_counter, ((value & 0x1FFFFF) << 3) | ABSULUTE);
-            } else {
-                add_object(*instruction_counter, 0);
-                add_pending_word(operand1, *instruction_counter, destination_mode);
-            }
-            (*instruction_counter)++;
-            (*address)++;
+    if (mode == IMMEDIATE) {
+        if (value < 0) {
+            value = (1 << 21) + value;
+        }
+        add_object(ctx, *address, ((value & 0x1FFFFF) << 3) | ABSULUTE);
+    } else if (is_streaming(ctx) && is_label_known(ctx, label, mode)) {
+        /* Streaming: a label already seen is encoded now, not kept pending */
+        add_object(ctx, *address, resolve_label_word(ctx, label, *address, mode));
+    } else if (is_one_pass(ctx)) {
+        /* One-pass: a defined label is encoded now, a later one is backpatched
+           when defined; extern uses wait for the end (see resolve_open_uses) */
+        if (resolve_symbol_id(ctx, label) != -1 && !is_external_id(ctx, label)) {
+            add_object(ctx, *address, resolve_label_word(ctx, label, *address, mode));
+        } else {
+            add_object(ctx, *address, 0);
         }
+        add_pending_id(ctx, label, *address, mode);
+    } else {
+        add_object(ctx, *address, 0);
+        add_pending_id(ctx, label, *address, mode);
     }
+    (*instruction_counter)++;
+    (*address)++;
 }
@@ -3,24 +3,40 @@
 #define FIRST_PASS_H
 
 #include "util.h"
+#include "intern.h"
+#include "lexer.h"
+#include "asm.h"
 
-typedef struct {
-    int opcode;
-    int funct;
-    char* name;
-} Instruction;
+/* A .data value must fit in a 24-bit word, read as signed or unsigned */
+#define DATA_MIN (-(1L << 23))
+#define DATA_MAX ((1L << 24) - 1)
+
+/* An immediate operand must fit in the 21-bit field of its word */
+#define IMMEDIATE_MIN (-(1L << 20))
+#define IMMEDIATE_MAX ((1L << 21) - 1)
 
-/* Define legal addressing modes per instruction */
+/* An instruction decoded once and ready to be encoded any number of times.
+   For a single operand only the destination fields are used. */
 typedef struct {
-    int opcode;
-    int num_operands;
-    int legal_src_modes[4];
-    int legal_dst_modes[4];
-} InstructionInfo;
+    unsigned long first_word;         /* First-word template from the ISA table */
+    int operand_count;
+    AddressingMode source_mode;
+    AddressingMode destination_mode;
+    int source_register;
+    int destination_register;
+    int source_value;                 /* Immediate value (IMMEDIATE mode) */
+    int destination_value;
+    StringId source_label;            /* Label (DIRECT/RELATIVE mode) */
+    StringId destination_label;
+} DecodedInstruction;
 
-void handle_instruction(char *instruction, int *address, int *IC);
-void first_pass(const char *filename, int *IC, int *DC);
+void handle_instruction(AsmContext *ctx, const Token *instruction, const Token *end,
+                        int *address, int *IC);
+int decode_instruction(AsmContext *ctx, const Token *instruction, const Token *operand1,
+                       const Token *operand2, DecodedInstruction *decoded, int report_errors);
+void encode_instruction(AsmContext *ctx, const DecodedInstruction *decoded, int *address, int *IC);
 int get_opcode(const char *mnemonic);
+int is_mode_allowed(int mode, unsigned int allowed_modes);
 void handle_operand_word(char *operand, AddressingMode mode, int *IC, int *address);
 
 #endif
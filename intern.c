@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "intern.h"
+
+#define INITIAL_POOL_SIZE 1024
+#define INITIAL_STRINGS 64
+
+/* Rebuilds the hash index with twice the number of slots */
+static void grow_string_index(StringPool *pool) {
+    StringId id;
+    unsigned long slot;
+    int i;
+
+    pool->index_size = pool->index_size ? pool->index_size * 2 : INITIAL_STRINGS * 2;
+    pool->index = arena_alloc(pool->arena, pool->index_size * sizeof(StringId));
+    for (i = 0; i < pool->index_size; i++) {
+        pool->index[i] = NO_STRING_ID;
+    }
+
+    for (id = 0; id < (StringId)pool->count; id++) {
+        slot = hash_string(pool->chars + pool->offsets[id]) & (pool->index_size - 1);
+        while (pool->index[slot] != NO_STRING_ID) {
+            slot = (slot + 1) & (pool->index_size - 1);
+        }
+        pool->index[slot] = id;
+    }
+}
+
+/* Returns 1 if the pooled string equals the given bytes */
+static int pooled_equals(const StringPool *pool, StringId id, const char *str, long length) {
+    const char *pooled = pool->chars + pool->offsets[id];
+
+    return memcmp(pooled, str, length) == 0 && pooled[length] == '\0';
+}
+
+/* Returns the index slot holding str, or the empty slot where it belongs */
+static unsigned long find_slot(const StringPool *pool, const char *str, long length) {
+    unsigned long slot = hash_bytes(str, length) & (pool->index_size - 1);
+
+    while (pool->index[slot] != NO_STRING_ID &&
+           !pooled_equals(pool, pool->index[slot], str, length)) {
+        slot = (slot + 1) & (pool->index_size - 1);
+    }
+    return slot;
+}
+
+/* Returns the id of str, adding it to the pool if it is new */
+StringId intern_string(StringPool *pool, const char *str) {
+    return intern_bytes(pool, str, strlen(str));
+}
+
+/* Returns the id of length bytes at str, adding them to the pool if new */
+StringId intern_bytes(StringPool *pool, const char *str, long length) {
+    unsigned long slot;
+    unsigned long len = length + 1;
+
+    if ((pool->count + 1) * 2 > pool->index_size) {
+        grow_string_index(pool);
+    }
+
+    slot = find_slot(pool, str, length);
+    if (pool->index[slot] != NO_STRING_ID) {
+        return pool->index[slot];
+    }
+
+    /* Grow the character buffer geometrically */
+    if (pool->used + len > pool->size) {
+        unsigned long new_size = pool->size ? pool->size : INITIAL_POOL_SIZE;
+        while (pool->used + len > new_size) {
+            new_size *= 2;
+        }
+        pool->chars = arena_grow(pool->arena, pool->chars, pool->used, new_size);
+        pool->size = new_size;
+    }
+
+    if (pool->count == pool->offsets_size) {
+        int new_size = pool->offsets_size ? pool->offsets_size * 2 : INITIAL_STRINGS;
+        pool->offsets = arena_grow(pool->arena, pool->offsets, pool->offsets_size * sizeof(unsigned long),
+                             new_size * sizeof(unsigned long));
+        pool->offsets_size = new_size;
+    }
+
+    memcpy(pool->chars + pool->used, str, length);
+    pool->chars[pool->used + length] = '\0';
+    pool->offsets[pool->count] = pool->used;
+    pool->used += len;
+
+    pool->index[slot] = (StringId)pool->count;
+    return (StringId)pool->count++;
+}
+
+/* Looks a string up without adding it */
+StringId find_string(const StringPool *pool, const char *str) {
+    if (pool->index == NULL) {
+        return NO_STRING_ID;
+    }
+    return pool->index[find_slot(pool, str, strlen(str))];
+}
+
+/* Returns the text of an interned string */
+const char* string_of(const StringPool *pool, StringId id) {
+    if (id >= (StringId)pool->count) {
+        return "";
+    }
+    return pool->chars + pool->offsets[id];
+}
+
+int get_string_count(const StringPool *pool) {
+    return pool->count;
+}
+
+/* Forgets every string; the old memory is reclaimed with the arena */
+void reset_string_pool(StringPool *pool, Arena *arena) {
+    pool->arena = arena;
+    pool->chars = NULL;
+    pool->offsets = NULL;
+    pool->index = NULL;
+    pool->used = pool->size = 0;
+    pool->count = pool->offsets_size = pool->index_size = 0;
+}
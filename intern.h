@@ -0,0 +1,47 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include "arena.h"
+
+/* Compact 32-bit identifier of an interned string */
+typedef unsigned int StringId;
+
+/* Returned by find_string when the string was never interned */
+#define NO_STRING_ID ((StringId)0xFFFFFFFFu)
+
+/* A pool of interned strings. Each assembly context owns one; a pool is
+   only ever used by one thread at a time. */
+typedef struct {
+    Arena *arena;                     /* Arena holding the pool, set by reset_string_pool */
+    char *chars;                      /* All strings, back to back and null-terminated */
+    unsigned long used;
+    unsigned long size;
+    unsigned long *offsets;           /* Start of every string in chars, indexed by id */
+    int count;
+    int offsets_size;
+    StringId *index;                  /* Open-addressing index from hash to id (power-of-two size) */
+    int index_size;
+} StringPool;
+
+/* Interns a string into the pool and returns its id.
+   Equal strings always get the same id, so ids can be compared directly. */
+StringId intern_string(StringPool *pool, const char *str);
+
+/* Same as intern_string, for length bytes that are not null-terminated */
+StringId intern_bytes(StringPool *pool, const char *str, long length);
+
+/* Returns the id of an already interned string, or NO_STRING_ID */
+StringId find_string(const StringPool *pool, const char *str);
+
+/* Returns the text of an interned string.
+   The pointer stays valid until the pool is reset. */
+const char* string_of(const StringPool *pool, StringId id);
+
+/* Returns the number of distinct strings in the pool */
+int get_string_count(const StringPool *pool);
+
+/* Empties the pool; its memory will be taken from the given arena.
+   Must be called before the first string is interned. */
+void reset_string_pool(StringPool *pool, Arena *arena);
+
+#endif /* INTERN_H */
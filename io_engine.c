@@ -0,0 +1,463 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "io_engine.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && !defined(NO_IO_URING)
+#define IO_URING 1
+#endif
+#endif
+
+/* Submission queue size of the ring */
+#define IO_RING_ENTRIES 64
+
+/* Most bytes moved by one read or write (the length field is 32 bits) */
+#define IO_CHUNK (1L << 30)
+
+#ifdef IO_URING
+/* An io_uring instance, set up with raw system calls */
+typedef struct {
+    int fd;
+    unsigned int entries;             /* Submission queue size */
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned int in_flight;           /* Requests with an entry in the ring */
+    unsigned int unsubmitted;         /* Entries the kernel has not taken yet */
+} Ring;
+#endif
+
+struct IoEngine {
+    pthread_mutex_t lock;
+    pthread_cond_t work;              /* Requests were queued, or the engine stops */
+    pthread_cond_t finished;          /* A request is done */
+    IoRequest *head;                  /* Queued requests, not started yet */
+    IoRequest *tail;
+    int stopping;
+    pthread_t *threads;
+    int thread_count;
+    int uses_ring;
+#ifdef IO_URING
+    Ring ring;
+#endif
+};
+
+/* Opens the file of a request; a read also gets its buffer.
+   Returns 0 or the errno value of the failure. */
+static int start_request(IoRequest *request) {
+    struct stat info;
+
+    if (request->kind == IO_WRITE) {
+        /* Replaced, not rewritten: a hardlinked copy keeps its contents */
+        unlink(request->path);
+        request->fd = open(request->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        return request->fd < 0 ? errno : 0;
+    }
+
+    request->fd = open(request->path, O_RDONLY);
+    if (request->fd < 0) {
+        return errno;
+    }
+    if (fstat(request->fd, &info) != 0) {
+        return errno;
+    }
+    request->length = (long)info.st_size;
+    request->data = malloc(request->length + 1);
+    if (request->data == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the source file\n");
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
+
+/* Moves the rest of a request with blocking calls; returns 0 or an errno value */
+static int transfer_blocking(IoRequest *request) {
+    long count;
+
+    while (request->offset < request->length) {
+        if (request->kind == IO_READ) {
+            count = (long)pread(request->fd, request->data + request->offset,
+                                request->length - request->offset, request->offset);
+        } else {
+            count = (long)pwrite(request->fd, request->data + request->offset,
+                                 request->length - request->offset, request->offset);
+        }
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0) {
+            return errno;
+        }
+        if (count == 0) {
+            /* The file got shorter since it was opened */
+            request->length = request->offset;
+            break;
+        }
+        request->offset += count;
+    }
+    return 0;
+}
+
+/* Closes a request's file and hands the result to its waiters */
+static void finish_request(IoEngine *engine, IoRequest *request, int status) {
+    if (request->fd >= 0) {
+        close(request->fd);
+        request->fd = -1;
+    }
+    if (request->kind == IO_WRITE && request->free_data) {
+        free(request->data);
+        request->data = NULL;
+    }
+    if (request->kind == IO_READ && status != 0) {
+        free(request->data);
+        request->data = NULL;
+        request->length = 0;
+    }
+
+    pthread_mutex_lock(&engine->lock);
+    request->status = status;
+    request->done = 1;
+    pthread_cond_broadcast(&engine->finished);
+    pthread_mutex_unlock(&engine->lock);
+}
+
+/* Backend without io_uring: each thread runs one request at a time */
+static void *pool_main(void *arg) {
+    IoEngine *engine = arg;
+    IoRequest *request;
+    int status;
+
+    for (;;) {
+        pthread_mutex_lock(&engine->lock);
+        while (engine->head == NULL && !engine->stopping) {
+            pthread_cond_wait(&engine->work, &engine->lock);
+        }
+        request = engine->head;
+        if (request == NULL) {
+            pthread_mutex_unlock(&engine->lock);
+            return NULL;
+        }
+        engine->head = request->next;
+        if (engine->head == NULL) {
+            engine->tail = NULL;
+        }
+        pthread_mutex_unlock(&engine->lock);
+
+        status = start_request(request);
+        if (status == 0) {
+            status = transfer_blocking(request);
+        }
+        finish_request(engine, request, status);
+    }
+}
+
+#ifdef IO_URING
+
+static int ring_init(Ring *ring) {
+    struct io_uring_params params;
+    char *sq;
+    char *cq;
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &params);
+    if (ring->fd < 0) {
+        return 0;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = ring->sq_ring;
+    if (ring->sq_ring != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                             ring->fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+        (void *)ring->sqes == MAP_FAILED) {
+        close(ring->fd);
+        return 0;
+    }
+
+    sq = ring->sq_ring;
+    cq = ring->cq_ring;
+    ring->entries = params.sq_entries;
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->in_flight = 0;
+    ring->unsubmitted = 0;
+    return 1;
+}
+
+static void ring_free(Ring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+/* Puts the next chunk of a request in the submission queue */
+static void ring_queue(Ring *ring, IoRequest *request) {
+    unsigned int tail = *ring->sq_tail;
+    unsigned int index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    long count = request->length - request->offset;
+
+    if (count > IO_CHUNK) {
+        count = IO_CHUNK;
+    }
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = request->kind == IO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+    sqe->fd = request->fd;
+    sqe->off = (unsigned long)request->offset;
+    sqe->addr = (unsigned long)(request->data + request->offset);
+    sqe->len = (unsigned int)count;
+    sqe->user_data = (unsigned long)request;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    ring->in_flight++;
+    ring->unsubmitted++;
+}
+
+/* Submits the queued entries and, if any are in flight, waits for one */
+static void ring_enter(Ring *ring) {
+    long taken;
+    unsigned int wait = ring->in_flight > ring->unsubmitted ? 1 : 0;
+
+    if (ring->unsubmitted == 0 && wait == 0) {
+        return;
+    }
+    taken = syscall(__NR_io_uring_enter, ring->fd, ring->unsubmitted, wait,
+                    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (taken < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+            return;
+        }
+        perror("Error submitting file I/O");
+        exit(EXIT_FAILURE);
+    }
+    ring->unsubmitted -= (unsigned int)taken;
+}
+
+/* io_uring backend: one thread opens the files, submits every request
+   queued since its last round as one batch, and reaps the completions */
+static void *ring_main(void *arg) {
+    IoEngine *engine = arg;
+    Ring *ring = &engine->ring;
+    IoRequest *batch;
+    IoRequest *ready = NULL;          /* Started requests waiting for a ring entry */
+    IoRequest *request;
+    struct io_uring_cqe *cqe;
+    unsigned int head;
+    int status;
+    int result;
+
+    pthread_mutex_lock(&engine->lock);
+    for (;;) {
+        while (engine->head == NULL && ready == NULL && ring->in_flight == 0 && !engine->stopping) {
+            pthread_cond_wait(&engine->work, &engine->lock);
+        }
+        if (engine->head == NULL && ready == NULL && ring->in_flight == 0) {
+            break;
+        }
+        batch = engine->head;
+        engine->head = NULL;
+        engine->tail = NULL;
+        pthread_mutex_unlock(&engine->lock);
+
+        /* Open the files of the new requests */
+        while (batch != NULL) {
+            request = batch;
+            batch = batch->next;
+            status = start_request(request);
+            if (status != 0 || request->length == 0) {
+                finish_request(engine, request, status);
+            } else {
+                request->next = ready;
+                ready = request;
+            }
+        }
+
+        /* Fill the ring, submit the batch and wait for a completion */
+        while (ready != NULL && ring->in_flight < ring->entries) {
+            request = ready;
+            ready = ready->next;
+            ring_queue(ring, request);
+        }
+        ring_enter(ring);
+
+        head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &ring->cqes[head & *ring->cq_mask];
+            request = (IoRequest *)(unsigned long)cqe->user_data;
+            result = cqe->res;
+            head++;
+            __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+            ring->in_flight--;
+
+            if (result == -EINTR || result == -EAGAIN) {
+                request->next = ready;
+                ready = request;
+            } else if (result == -EINVAL || result == -EOPNOTSUPP) {
+                /* Kernel without these operations: finish it the slow way */
+                finish_request(engine, request, transfer_blocking(request));
+            } else if (result < 0) {
+                finish_request(engine, request, -result);
+            } else if (result == 0) {
+                request->length = request->offset;
+                finish_request(engine, request, 0);
+            } else if ((request->offset += result) < request->length) {
+                request->next = ready;
+                ready = request;
+            } else {
+                finish_request(engine, request, 0);
+            }
+        }
+
+        pthread_mutex_lock(&engine->lock);
+    }
+    pthread_mutex_unlock(&engine->lock);
+    return NULL;
+}
+
+#endif /* IO_URING */
+
+IoEngine *io_create(int thread_count) {
+    IoEngine *engine = calloc(1, sizeof(IoEngine));
+    void *(*run)(void *) = pool_main;
+    int i;
+
+    if (engine == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the I/O engine\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&engine->lock, NULL);
+    pthread_cond_init(&engine->work, NULL);
+    pthread_cond_init(&engine->finished, NULL);
+
+    engine->thread_count = thread_count < 1 ? 1 : thread_count;
+#ifdef IO_URING
+    if (ring_init(&engine->ring)) {
+        engine->uses_ring = 1;
+        engine->thread_count = 1;
+        run = ring_main;
+    }
+#endif
+
+    engine->threads = malloc(engine->thread_count * sizeof(pthread_t));
+    if (engine->threads == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the I/O engine\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < engine->thread_count; i++) {
+        if (pthread_create(&engine->threads[i], NULL, run, engine) != 0) {
+            fprintf(stderr, "Error: Cannot start I/O thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return engine;
+}
+
+void io_destroy(IoEngine *engine) {
+    int i;
+
+    pthread_mutex_lock(&engine->lock);
+    engine->stopping = 1;
+    pthread_cond_broadcast(&engine->work);
+    pthread_mutex_unlock(&engine->lock);
+
+    for (i = 0; i < engine->thread_count; i++) {
+        pthread_join(engine->threads[i], NULL);
+    }
+#ifdef IO_URING
+    if (engine->uses_ring) {
+        ring_free(&engine->ring);
+    }
+#endif
+    pthread_mutex_destroy(&engine->lock);
+    pthread_cond_destroy(&engine->work);
+    pthread_cond_destroy(&engine->finished);
+    free(engine->threads);
+    free(engine);
+}
+
+const char *io_backend(const IoEngine *engine) {
+    return engine->uses_ring ? "io_uring" : "threads";
+}
+
+void io_prepare(IoRequest *request, IoKind kind, const char *path, char *data, long length) {
+    request->kind = kind;
+    request->path = path;
+    request->data = data;
+    request->length = length;
+    request->free_data = 0;
+    request->status = 0;
+    request->done = 0;
+    request->next = NULL;
+    request->fd = -1;
+    request->offset = 0;
+}
+
+void io_submit(IoEngine *engine, IoRequest *request) {
+    pthread_mutex_lock(&engine->lock);
+    request->next = NULL;
+    if (engine->tail != NULL) {
+        engine->tail->next = request;
+    } else {
+        engine->head = request;
+    }
+    engine->tail = request;
+    pthread_cond_signal(&engine->work);
+    pthread_mutex_unlock(&engine->lock);
+}
+
+void io_wait(IoEngine *engine, IoRequest *request) {
+    pthread_mutex_lock(&engine->lock);
+    while (!request->done) {
+        pthread_cond_wait(&engine->finished, &engine->lock);
+    }
+    pthread_mutex_unlock(&engine->lock);
+}
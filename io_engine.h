@@ -0,0 +1,53 @@
+#ifndef IO_ENGINE_H
+#define IO_ENGINE_H
+
+/* Batched file I/O for builds with many inputs (-j). Whole-file reads and
+   writes are queued by any thread and carried out in the background, so
+   assembling one file overlaps with reading and writing the others.
+   On Linux the requests are submitted in batches through io_uring; where
+   io_uring is missing or refused, a small pool of threads does blocking
+   reads and writes instead. */
+
+/* What a request does */
+typedef enum {
+    IO_READ,                          /* Read a whole file into data */
+    IO_WRITE                          /* Create a file holding data */
+} IoKind;
+
+/* One file read or written by the engine. The fields below next are the
+   engine's own; the request must stay in place until it is done. */
+typedef struct IoRequest {
+    IoKind kind;
+    const char *path;
+    char *data;                       /* Read: allocated by the engine. Write: the bytes */
+    long length;                      /* Bytes in data */
+    int free_data;                    /* Write: free data once written */
+    int status;                       /* 0 once done successfully, else an errno value */
+    int done;
+    struct IoRequest *next;           /* Link in the engine's queues */
+    int fd;
+    long offset;                      /* Bytes transferred so far */
+} IoRequest;
+
+typedef struct IoEngine IoEngine;
+
+/* Starts an engine: io_uring if it can be set up, otherwise thread_count
+   blocking threads */
+IoEngine *io_create(int thread_count);
+
+/* Waits for all queued requests and stops the engine */
+void io_destroy(IoEngine *engine);
+
+/* Returns the backend in use ("io_uring" or "threads") */
+const char *io_backend(const IoEngine *engine);
+
+/* Prepares a request (not queued yet) */
+void io_prepare(IoRequest *request, IoKind kind, const char *path, char *data, long length);
+
+/* Queues a request; requests queued close together are submitted as one batch */
+void io_submit(IoEngine *engine, IoRequest *request);
+
+/* Waits until a queued request is done */
+void io_wait(IoEngine *engine, IoRequest *request);
+
+#endif /* IO_ENGINE_H */
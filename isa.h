@@ -0,0 +1,31 @@
+#ifndef ISA_H
+#define ISA_H
+
+#include <stddef.h>
+
+/* Bit of an addressing mode (IMMEDIATE..REGISTER_DIRECT) in a legal-mode mask */
+#define ISA_MODE_BIT(mode) (1u << (mode))
+
+/* One instruction of the ISA, generated from isa.def by isa_gen */
+typedef struct {
+    const char *name;                 /* Mnemonic */
+    int opcode;                       /* Operation code */
+    int funct;                        /* Function code */
+    int num_operands;                 /* Number of operands expected */
+    unsigned int src_modes;           /* Legal source addressing modes (mask) */
+    unsigned int dst_modes;           /* Legal destination addressing modes (mask) */
+    unsigned long first_word;         /* First word with opcode, funct and A=1 set */
+} IsaEntry;
+
+/* Generated instruction table and its size */
+extern const IsaEntry isa_table[];
+extern const int isa_count;
+
+/* Finds a mnemonic through the generated perfect hash (one compare).
+   Returns NULL if it is not an instruction. */
+const IsaEntry* isa_lookup(const char *mnemonic);
+
+/* Same as isa_lookup, for a mnemonic of len characters (not null-terminated) */
+const IsaEntry* isa_lookup_bytes(const char *mnemonic, size_t len);
+
+#endif /* ISA_H */
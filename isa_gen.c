@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "isa.h"
+
+/* Build-time generator: reads the ISA from isa.def and writes isa_table.c
+   with the instruction table, first-word templates and a collision-free
+   hash of the mnemonics. Usage: isa_gen <output file> */
+
+#define M_IMM ISA_MODE_BIT(IMMEDIATE)
+#define M_DIR ISA_MODE_BIT(DIRECT)
+#define M_REL ISA_MODE_BIT(RELATIVE)
+#define M_REG ISA_MODE_BIT(REGISTER_DIRECT)
+
+typedef struct {
+    const char *name;
+    int opcode;
+    int funct;
+    int num_operands;
+    unsigned int src_modes;
+    unsigned int dst_modes;
+} IsaDescription;
+
+static const IsaDescription isa[] = {
+#define ISA(name, opcode, funct, operands, src, dst) {#name, opcode, funct, operands, src, dst},
+#include "isa.def"
+#undef ISA
+};
+
+#define ISA_SIZE ((int)(sizeof(isa) / sizeof(isa[0])))
+
+/* Largest hash table and multiplier the search will try */
+#define MAX_HASH_SIZE 256
+#define MAX_MULTIPLIER 64
+
+/* The hash used at run time: first, second and last character, and the length */
+static unsigned int mnemonic_hash(const char *name, unsigned int a, unsigned int b,
+                                  unsigned int c, unsigned int size) {
+    unsigned int len = strlen(name);
+    return ((unsigned char)name[0] * a + (unsigned char)name[1] * b +
+            (unsigned char)name[len - 1] * c + len) & (size - 1);
+}
+
+/* Looks for the smallest table and multipliers without collisions */
+static int find_perfect_hash(unsigned int *a, unsigned int *b, unsigned int *c,
+                             unsigned int *size, int *slots) {
+    int i, collision;
+
+    for (*size = 16; *size <= MAX_HASH_SIZE; *size *= 2) {
+        for (*a = 1; *a < MAX_MULTIPLIER; (*a)++) {
+            for (*b = 0; *b < MAX_MULTIPLIER; (*b)++) {
+                for (*c = 0; *c < MAX_MULTIPLIER; (*c)++) {
+                    for (i = 0; i < (int)*size; i++) {
+                        slots[i] = -1;
+                    }
+                    collision = 0;
+                    for (i = 0; i < ISA_SIZE && !collision; i++) {
+                        unsigned int h = mnemonic_hash(isa[i].name, *a, *b, *c, *size);
+                        collision = (slots[h] != -1);
+                        slots[h] = i;
+                    }
+                    if (!collision) {
+                        return 1;
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    FILE *out;
+    unsigned int a, b, c, size;
+    int slots[MAX_HASH_SIZE];
+    int min_length = 1000, max_length = 0;
+    int i, len;
+    unsigned long first_word;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <output file>\n", argv[0]);
+        return 1;
+    }
+
+    for (i = 0; i < ISA_SIZE; i++) {
+        len = strlen(isa[i].name);
+        if (len < 2) {
+            fprintf(stderr, "Error: mnemonic '%s' is too short to hash\n", isa[i].name);
+            return 1;
+        }
+        if (len < min_length) min_length = len;
+        if (len > max_length) max_length = len;
+    }
+
+    if (!find_perfect_hash(&a, &b, &c, &size, slots)) {
+        fprintf(stderr, "Error: no collision-free hash found for the mnemonics\n");
+        return 1;
+    }
+
+    out = fopen(argv[1], "w");
+    if (!out) {
+        perror("Error opening output file");
+        return 1;
+    }
+
+    fprintf(out, "/* Generated by isa_gen from isa.def - do not edit */\n");
+    fprintf(out, "#include <string.h>\n#include \"isa.h\"\n\n");
+
+    /* Instruction table with precomputed first words (A=1) */
+    fprintf(out, "const IsaEntry isa_table[] = {\n");
+    for (i = 0; i < ISA_SIZE; i++) {
+        first_word = ((unsigned long)isa[i].opcode << 17) |
+                     ((unsigned long)isa[i].funct << 3) | ABSULUTE;
+        fprintf(out, "    {\"%s\", %d, %d, %d, 0x%X, 0x%X, 0x%06lXUL},\n",
+                isa[i].name, isa[i].opcode, isa[i].funct, isa[i].num_operands,
+                isa[i].src_modes, isa[i].dst_modes, first_word);
+    }
+    fprintf(out, "};\n\nconst int isa_count = %d;\n\n", ISA_SIZE);
+
+    /* Hash slots: index into isa_table, or -1 */
+    fprintf(out, "static const signed char isa_slots[%u] = {", size);
+    for (i = 0; i < (int)size; i++) {
+        fprintf(out, "%s%s%d", i ? "," : "", (i % 16) ? " " : "\n    ", slots[i]);
+    }
+    fprintf(out, "\n};\n\n");
+
+    fprintf(out, "const IsaEntry* isa_lookup(const char *mnemonic) {\n");
+    fprintf(out, "    return isa_lookup_bytes(mnemonic, strlen(mnemonic));\n}\n\n");
+
+    fprintf(out, "const IsaEntry* isa_lookup_bytes(const char *mnemonic, size_t len) {\n");
+    fprintf(out, "    int i;\n\n");
+    fprintf(out, "    if (len < %d || len > %d) {\n        return NULL;\n    }\n", min_length, max_length);
+    fprintf(out, "    i = isa_slots[((unsigned char)mnemonic[0] * %uu + (unsigned char)mnemonic[1] * %uu +\n", a, b);
+    fprintf(out, "                   (unsigned char)mnemonic[len - 1] * %uu + (unsigned int)len) & %uu];\n", c, size - 1);
+    fprintf(out, "    if (i < 0 || strncmp(isa_table[i].name, mnemonic, len) != 0 ||\n"
+                 "        isa_table[i].name[len] != '\\0') {\n        return NULL;\n    }\n");
+    fprintf(out, "    return &isa_table[i];\n}\n");
+
+    fclose(out);
+    return 0;
+}
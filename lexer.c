@@ -0,0 +1,103 @@
+#include <string.h>
+#include "lexer.h"
+#include "util.h"
+
+/* Sets the kind and value of a word from its characters */
+static void classify_word(Token *token) {
+    const char *text = token->start;
+    long length = token->length;
+
+    if (text[length - 1] == ':') {
+        token->kind = TOKEN_LABEL;
+        token->length--;
+    } else if (text[0] == '.') {
+        token->kind = TOKEN_DIRECTIVE;
+    } else if (parse_integer(text, length, &token->value)) {
+        token->kind = TOKEN_NUMBER;
+    } else {
+        switch (get_addressing_mode(text, length)) {
+            case IMMEDIATE:
+                token->kind = TOKEN_IMMEDIATE;
+                token->value = text_to_int(text + 1, length - 1);
+                break;
+            case RELATIVE:
+                token->kind = TOKEN_RELATIVE;
+                break;
+            case REGISTER_DIRECT:
+                token->kind = TOKEN_REGISTER;
+                token->value = get_register_code(text, length);
+                break;
+            default:
+                token->kind = TOKEN_WORD;
+                break;
+        }
+    }
+}
+
+/* Returns the offset of the last quote in (from, end), or -1 */
+static long closing_quote(Scanner *scanner, long from, long end) {
+    long last = -1;
+    long quote = scan_find(scanner, from + 1, end, SCAN_QUOTE);
+
+    while (quote < end) {
+        last = quote;
+        quote = scan_find(scanner, quote + 1, end, SCAN_QUOTE);
+    }
+    return last;
+}
+
+int lex_line(Scanner *scanner, TextView line, Token *tokens, int max_tokens) {
+    const char *data = scanner->data;
+    long text = line.start - data;
+    long end = text + line.length;
+    long quote;
+    int count = 0;
+
+    text = scan_skip(scanner, text, end, SCAN_SPACE);
+    if (text < end && data[text] == ';') {
+        return 0;
+    }
+
+    while (count < max_tokens) {
+        Token *token = &tokens[count];
+
+        text = scan_skip(scanner, text, end, SCAN_SPACE);
+        if (text == end) {
+            break;
+        }
+
+        token->start = data + text;
+        token->value = 0;
+
+        if (data[text] == ',') {
+            token->kind = TOKEN_COMMA;
+            token->length = 1;
+            text++;
+        } else if (data[text] == '"' && (quote = closing_quote(scanner, text, end)) != -1) {
+            /* A string runs to the last quote of the line, spaces included */
+            token->kind = TOKEN_STRING;
+            token->length = (unsigned short)(quote - text + 1);
+            text = quote + 1;
+        } else {
+            long word_end = scan_find(scanner, text, end, SCAN_SPACE | SCAN_COMMA);
+
+            token->length = (unsigned short)(word_end - text);
+            text = word_end;
+            classify_word(token);
+        }
+        count++;
+    }
+    return count;
+}
+
+int token_equals(const Token *token, const char *str) {
+    return strncmp(token->start, str, token->length) == 0 && str[token->length] == '\0';
+}
+
+TextView token_text(const Token *token) {
+    TextView view;
+
+    view.start = token->start;
+    view.length = token->length;
+    return view;
+}
@@ -0,0 +1,48 @@
+#ifndef LEXER_H
+#define LEXER_H
+
+#include "source.h"
+#include "scan.h"
+
+/* Kinds of tokens */
+typedef enum {
+    TOKEN_WORD,                       /* Mnemonic, label reference, macro name, ... */
+    TOKEN_LABEL,                      /* Label definition; the span excludes the ':' */
+    TOKEN_DIRECTIVE,                  /* .data, .string, .entry, .extern, .include */
+    TOKEN_REGISTER,                   /* r0-r7; value is the register number */
+    TOKEN_IMMEDIATE,                  /* #number; value is the number */
+    TOKEN_RELATIVE,                   /* &label; the span keeps the '&' */
+    TOKEN_NUMBER,                     /* Signed integer; value is the number */
+    TOKEN_STRING,                     /* "text"; the span keeps the quotes */
+    TOKEN_COMMA
+} TokenKind;
+
+/* One token of a source line: a view into the text plus what the lexer
+   already worked out about it, so no later stage scans the bytes again */
+typedef struct {
+    const char *start;                /* First character (not null-terminated) */
+    unsigned short length;            /* Number of characters */
+    unsigned char kind;               /* TokenKind */
+    int value;                        /* Register number or parsed integer */
+} Token;
+
+/* Most tokens a line can produce: every character of a line can be one
+   (commas are tokens of their own), and longer lines are rejected before
+   they are lexed (MAX_LINE_LEN, pre_prossecor.h) */
+#define MAX_LINE_TOKENS MAX_LINE_LEN
+
+/* Splits one line into tokens. Words are separated by white space and
+   commas; a line whose first character (after white space) is ';' is a
+   comment and has no tokens. The line must lie in the scanner's buffer:
+   separators are found through its class masks (see scan.h).
+   Returns the number of tokens written, at most max_tokens; with
+   MAX_LINE_TOKENS every line shorter than MAX_LINE_LEN fits. */
+int lex_line(Scanner *scanner, TextView line, Token *tokens, int max_tokens);
+
+/* Returns 1 if the token's text is exactly the given string */
+int token_equals(const Token *token, const char *str);
+
+/* Returns the text of a token as a view */
+TextView token_text(const Token *token);
+
+#endif /* LEXER_H */
@@ -1,13 +1,139 @@
 #include "pre_prossecor.h"
+#include "asm.h"
+#include "scheduler.h"
+#include "cache.h"
 
 /*Maor Massas
  * 314801887*/
 
 
+/* Build cache (-cache DIR), NULL if none */
+static BuildCache *cache = NULL;
+
+/* Keys of the -j jobs looked up in the cache, by job index */
+static AsmJob *cache_jobs = NULL;
+static CacheKey *cache_keys = NULL;
+
+/* Returns 1 if an argument is one of the whole-run options read first,
+   and how many arguments it takes */
+static int run_option(const char *arg, int *length) {
+    *length = 2;
+    if (strcmp(arg, "-j") == 0 || strcmp(arg, "-threads") == 0 || strcmp(arg, "-cache") == 0 ||
+        strcmp(arg, "-cache-limit") == 0) {
+        return 1;
+    }
+    *length = 1;
+    return strcmp(arg, "-cache-stats") == 0;
+}
+
+/* Stores the outputs of an assembly without errors in the cache */
+static void store_outputs(const char *path, unsigned int options, const CacheKey *key,
+                          char *const *includes, int include_count, const Output *messages) {
+    if (cache != NULL) {
+        cache_store(cache, path, options, key, (const char *const *)includes, include_count,
+                    messages->data, messages->length);
+    }
+}
+
+/* Assembles one file with diagnostics captured, so that they can be
+   stored in the cache with its outputs. Returns asm_assemble_file's result. */
+static int assemble_cached(AsmContext *ctx, const char *path, unsigned int options) {
+    Output messages = OUTPUT_INIT;
+    CacheKey key;
+    char **includes;
+    char buffer[4096];
+    size_t length;
+    FILE *stream;
+    int errors;
+    int i;
+
+    output_open(&messages, NULL);
+    if (cache_fetch(cache, path, options, &key, &messages)) {
+        fwrite(messages.data, 1, messages.length, stderr);
+        output_free(&messages);
+        return 0;
+    }
+
+    stream = tmpfile();
+    asm_set_diagnostics(ctx, stream != NULL ? stream : stderr);
+    errors = asm_assemble_file(ctx, path);
+    if (stream != NULL) {
+        rewind(stream);
+        while ((length = fread(buffer, 1, sizeof(buffer), stream)) > 0) {
+            output_bytes(&messages, buffer, (long)length);
+        }
+        fclose(stream);
+        asm_set_diagnostics(ctx, stderr);
+        fwrite(messages.data, 1, messages.length, stderr);
+
+        if (errors == 0) {
+            includes = malloc((asm_include_count(ctx) + 1) * sizeof(char *));
+            if (includes == NULL) {
+                fprintf(stderr, "Failed to allocate memory for the include list\n");
+                exit(EXIT_FAILURE);
+            }
+            for (i = 0; i < asm_include_count(ctx); i++) {
+                includes[i] = (char *)asm_include_path(ctx, i);
+            }
+            store_outputs(path, options, &key, includes, asm_include_count(ctx), &messages);
+            free(includes);
+        }
+    }
+    output_free(&messages);
+    return errors;
+}
+
+/* Returns the input file name for an argument, adding .as if it has none */
+static char *input_name(const char *arg) {
+    char *name = malloc(strlen(arg) + 4);
+
+    if (name == NULL) {
+        fprintf(stderr, "Failed to allocate memory for file name\n");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(name, arg);
+    if (strstr(arg, ".as") == NULL) {
+        strcat(name, ".as");
+    }
+    return name;
+}
+
+/* Prints what the assembly of one file (-j) produced, in argument order */
+static void report_job(AsmJob *job) {
+    CacheKey *key = cache_keys != NULL ? &cache_keys[job - cache_jobs] : NULL;
+    int i;
+
+    printf("Trying to open file: %s\n", job->path);
+    fwrite(job->messages.data, 1, job->messages.length, stderr);
+    if (job->errors == 0 && !job->cached && key != NULL) {
+        store_outputs(job->path, job->options, key, job->includes, job->include_count, &job->messages);
+    }
+    output_free(&job->messages);
+    for (i = 0; i < job->include_count; i++) {
+        free(job->includes[i]);
+    }
+    free(job->includes);
+
+    if (job->errors < 0) {
+        fprintf(stderr, "Error: File '%s' not found\n", job->path);
+        return;
+    }
+    fprintf(stdout, "Finished processing file: %s\n", job->path);
+}
+
 int main(int args, char *argv[]) {
-    FILE *fp;                              /* File pointer for reading source file */
+    AsmContext *ctx;                       /* Assembler state, reused for every file */
+    unsigned int options = 0;              /* ASM_* options given so far */
+    int threads = 0;                       /* Files assembled at once (-j), 0 = one by one */
+    int file_threads = 1;                  /* Threads within one file (-threads) */
+    AsmJob *jobs;                          /* Files to assemble with -j */
+    int job_count = 0;
+    const char *cache_dir = NULL;          /* -cache DIR */
+    long cache_limit = CACHE_DEFAULT_LIMIT;
+    int cache_stats = 0;                   /* -cache-stats */
+    int skip;                              /* Arguments of a whole-run option */
     int i;                                 /* Loop index */
-    char name_of_file[MAX_NAME_FILE];     /* Buffer to store file name */
+    char *name_of_file;                    /* Input file name, with .as */
 
     /* Check if at least one file was provided */
     if (args < 2) {
@@ -15,37 +141,169 @@ int main(int args, char *argv[]) {
         return 1;
     }
 
+    /* -j N: assemble up to N files at once, with batched file I/O.
+       -threads N: split the work on a large file across N threads.
+       -cache DIR: reuse the outputs of files assembled before (cache.h);
+       -cache-limit MB sets its size limit, -cache-stats prints its counts.
+       All apply to the whole run. */
+    for (i = 1; i < args; i++) {
+        if (strcmp(argv[i], "-j") == 0) {
+            if (i + 1 >= args || (threads = atoi(argv[i + 1])) < 1) {
+                fprintf(stderr, "Error: -j expects a number of threads\n");
+                return 1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "-threads") == 0) {
+            if (i + 1 >= args || (file_threads = atoi(argv[i + 1])) < 1) {
+                fprintf(stderr, "Error: -threads expects a number of threads\n");
+                return 1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "-cache") == 0) {
+            if (i + 1 >= args) {
+                fprintf(stderr, "Error: -cache expects a directory\n");
+                return 1;
+            }
+            cache_dir = argv[++i];
+        } else if (strcmp(argv[i], "-cache-limit") == 0) {
+            if (i + 1 >= args || (cache_limit = atol(argv[i + 1])) < 1) {
+                fprintf(stderr, "Error: -cache-limit expects a size in megabytes\n");
+                return 1;
+            }
+            cache_limit *= 1024L * 1024;
+            i++;
+        } else if (strcmp(argv[i], "-cache-stats") == 0) {
+            cache_stats = 1;
+        }
+    }
+
+    if (cache_dir != NULL && (cache = cache_open(cache_dir, cache_limit)) == NULL) {
+        return 1;
+    }
+
+    if (threads > 0) {
+        jobs = calloc(args, sizeof(AsmJob));
+        if (jobs == NULL) {
+            fprintf(stderr, "Failed to allocate memory for the file list\n");
+            return 1;
+        }
+        for (i = 1; i < args; i++) {
+            if (run_option(argv[i], &skip)) {
+                i += skip - 1;
+            } else if (strcmp(argv[i], "-am") == 0) {
+                options |= ASM_WRITE_EXPANDED;
+            } else if (strcmp(argv[i], "-stream") == 0) {
+                options |= ASM_STREAM;
+            } else if (strcmp(argv[i], "-onepass") == 0) {
+                options |= ASM_ONE_PASS;
+            } else if (strcmp(argv[i], "-obx") == 0) {
+                options |= ASM_WRITE_BINARY;
+            } else if (strcmp(argv[i], "-obz") == 0) {
+                options |= ASM_WRITE_COMPRESSED;
+            } else {
+                jobs[job_count].path = input_name(argv[i]);
+                jobs[job_count].options = options;
+                jobs[job_count].threads = file_threads;
+                job_count++;
+            }
+        }
+
+        /* Files found in the cache are only reported */
+        if (cache != NULL) {
+            cache_jobs = jobs;
+            cache_keys = malloc((job_count + 1) * sizeof(CacheKey));
+            if (cache_keys == NULL) {
+                fprintf(stderr, "Failed to allocate memory for the file list\n");
+                return 1;
+            }
+            for (i = 0; i < job_count; i++) {
+                output_open(&jobs[i].messages, NULL);
+                jobs[i].cached = cache_fetch(cache, jobs[i].path, jobs[i].options, &cache_keys[i],
+                                             &jobs[i].messages);
+                if (!jobs[i].cached) {
+                    output_free(&jobs[i].messages);
+                }
+            }
+        }
+
+        run_jobs(jobs, job_count, threads, report_job);
+
+        for (i = 0; i < job_count; i++) {
+            free((char *)jobs[i].path);
+        }
+        free(jobs);
+        free(cache_keys);
+        if (cache != NULL) {
+            cache_close(cache, cache_stats);
+        }
+        return 0;
+    }
+
+    ctx = asm_create();
+    asm_set_threads(ctx, file_threads);
+
     /* Loop through all input file arguments */
     for (i = 1; i < args; i++) {
 
-        /* If file name already ends with .as, copy it directly */
-        if (strstr(argv[i], ".as") != NULL) {
-            strcpy(name_of_file, argv[i]);
-        } else {
-            /* Otherwise, add .as extension to the file name */
-            strcpy(name_of_file, argv[i]);
-            strcat(name_of_file, ".as");
+        /* -threads N and the -cache options were read above */
+        if (run_option(argv[i], &skip)) {
+            i += skip - 1;
+            continue;
+        }
+
+        /* -am: also write the macro-expanded source of the next files */
+        if (strcmp(argv[i], "-am") == 0) {
+            options |= ASM_WRITE_EXPANDED;
+            continue;
         }
 
+        /* -stream: write output as it is encoded, keeping only unresolved label uses */
+        if (strcmp(argv[i], "-stream") == 0) {
+            options |= ASM_STREAM;
+            continue;
+        }
+
+        /* -onepass: fill in label uses as labels are defined, not in a second traversal */
+        if (strcmp(argv[i], "-onepass") == 0) {
+            options |= ASM_ONE_PASS;
+            continue;
+        }
+
+        /* -obx: also write the binary object file of the next files */
+        if (strcmp(argv[i], "-obx") == 0) {
+            options |= ASM_WRITE_BINARY;
+            continue;
+        }
+
+        /* -obz: write the object file of the next files compressed (.obz) */
+        if (strcmp(argv[i], "-obz") == 0) {
+            options |= ASM_WRITE_COMPRESSED;
+            continue;
+        }
+
+        /* Add the .as extension if the name has none */
+        name_of_file = input_name(argv[i]);
+
         /* Print message for debugging */
         printf("Trying to open file: %s\n", name_of_file);
 
-        /* Try to open the file */
-        fp = fopen(name_of_file, "r");
-        if (!fp) {
+        /* Assemble the file, writing its outputs next to it */
+        asm_set_options(ctx, options);
+        if ((cache != NULL ? assemble_cached(ctx, name_of_file, options)
+                           : asm_assemble_file(ctx, name_of_file)) < 0) {
             fprintf(stderr, "Error: File '%s' not found\n", name_of_file);
+            free(name_of_file);
             continue;
         }
 
-        /* Call macro handler to preprocess macros in the file */
-        macro_handle(fp, name_of_file);
-
-        /* Close the file after processing */
-        fclose(fp);
-
         /* Notify that processing of the file has finished */
         fprintf(stdout, "Finished processing file: %s\n", name_of_file);
+        free(name_of_file);
     }
 
+    asm_destroy(ctx);
+    if (cache != NULL) {
+        cache_close(cache, cache_stats);
+    }
     return 0;
 }
@@ -0,0 +1,91 @@
+#include <string.h>
+#include "obx.h"
+
+/* Rounds a size up to a multiple of 4 bytes */
+static unsigned long align4(unsigned long size) {
+    return (size + 3) & ~3UL;
+}
+
+void obx_layout(ObxHeader *header) {
+    header->run_offset = OBX_HEADER_SIZE;
+    header->entry_offset = header->run_offset + header->run_count * OBX_RECORD_SIZE;
+    header->extern_offset = header->entry_offset + header->entry_count * OBX_RECORD_SIZE;
+    header->image_offset = header->extern_offset + header->extern_count * OBX_RECORD_SIZE;
+    header->strings_offset = align4(header->image_offset + header->word_count * OBX_WORD_SIZE);
+}
+
+unsigned long obx_file_size(const ObxHeader *header) {
+    return header->strings_offset + header->strings_size;
+}
+
+void obx_put_u32(unsigned char *dst, unsigned long value) {
+    dst[0] = (unsigned char)(value & 0xFF);
+    dst[1] = (unsigned char)((value >> 8) & 0xFF);
+    dst[2] = (unsigned char)((value >> 16) & 0xFF);
+    dst[3] = (unsigned char)((value >> 24) & 0xFF);
+}
+
+unsigned long obx_get_u32(const unsigned char *src) {
+    return (unsigned long)src[0] | ((unsigned long)src[1] << 8) |
+           ((unsigned long)src[2] << 16) | ((unsigned long)src[3] << 24);
+}
+
+void obx_put_word(unsigned char *dst, unsigned int word) {
+    dst[0] = (unsigned char)(word & 0xFF);
+    dst[1] = (unsigned char)((word >> 8) & 0xFF);
+    dst[2] = (unsigned char)((word >> 16) & 0xFF);
+}
+
+unsigned int obx_get_word(const unsigned char *src) {
+    return (unsigned int)src[0] | ((unsigned int)src[1] << 8) | ((unsigned int)src[2] << 16);
+}
+
+void obx_put_header(unsigned char *dst, const ObxHeader *header) {
+    memcpy(dst, OBX_MAGIC, 4);
+    obx_put_u32(dst + 4, header->ic);
+    obx_put_u32(dst + 8, header->dc);
+    obx_put_u32(dst + 12, header->base);
+    obx_put_u32(dst + 16, header->run_count);
+    obx_put_u32(dst + 20, header->run_offset);
+    obx_put_u32(dst + 24, header->word_count);
+    obx_put_u32(dst + 28, header->image_offset);
+    obx_put_u32(dst + 32, header->entry_count);
+    obx_put_u32(dst + 36, header->entry_offset);
+    obx_put_u32(dst + 40, header->extern_count);
+    obx_put_u32(dst + 44, header->extern_offset);
+    obx_put_u32(dst + 48, header->strings_size);
+    obx_put_u32(dst + 52, header->strings_offset);
+}
+
+/* Returns 1 if count records of size bytes at offset fit in the file */
+static int table_fits(unsigned long offset, unsigned long count, unsigned long size,
+                      unsigned long file_size) {
+    return offset <= file_size && count <= (file_size - offset) / size;
+}
+
+int obx_get_header(const unsigned char *data, unsigned long size, ObxHeader *header) {
+    if (size < OBX_HEADER_SIZE || memcmp(data, OBX_MAGIC, 4) != 0) {
+        return 0;
+    }
+    header->ic = obx_get_u32(data + 4);
+    header->dc = obx_get_u32(data + 8);
+    header->base = obx_get_u32(data + 12);
+    header->run_count = obx_get_u32(data + 16);
+    header->run_offset = obx_get_u32(data + 20);
+    header->word_count = obx_get_u32(data + 24);
+    header->image_offset = obx_get_u32(data + 28);
+    header->entry_count = obx_get_u32(data + 32);
+    header->entry_offset = obx_get_u32(data + 36);
+    header->extern_count = obx_get_u32(data + 40);
+    header->extern_offset = obx_get_u32(data + 44);
+    header->strings_size = obx_get_u32(data + 48);
+    header->strings_offset = obx_get_u32(data + 52);
+
+    /* The names must end inside the string table */
+    return table_fits(header->run_offset, header->run_count, OBX_RECORD_SIZE, size) &&
+           table_fits(header->entry_offset, header->entry_count, OBX_RECORD_SIZE, size) &&
+           table_fits(header->extern_offset, header->extern_count, OBX_RECORD_SIZE, size) &&
+           table_fits(header->image_offset, header->word_count, OBX_WORD_SIZE, size) &&
+           table_fits(header->strings_offset, header->strings_size, 1, size) &&
+           (header->strings_size == 0 || data[header->strings_offset + header->strings_size - 1] == '\0');
+}
@@ -0,0 +1,69 @@
+#ifndef OBX_H
+#define OBX_H
+
+/* Binary object format (.obx), the packed form of .ob, .ent and .ext.
+   All numbers are little-endian and every table starts at a multiple of
+   4 bytes, so a loader can mmap the file and read it in place:
+
+     header   OBX_HEADER_SIZE bytes (ObxHeader, 32-bit fields)
+     runs     run_count x {address, count}: the image as runs of
+              consecutive words, stored one after another in the image
+     entries  entry_count x {name, address}
+     externs  extern_count x {name, address}: one record per use
+     image    word_count x 3 bytes, one 24-bit word each
+     strings  strings_size bytes of null-terminated names; a name field
+              is an offset into this table
+
+   ic and dc are the two numbers of the .ob header line. */
+
+/* Magic number at the start of the file (includes the version) */
+#define OBX_MAGIC "OBX1"
+
+/* Sizes of the header, a table record and an image word in bytes */
+#define OBX_HEADER_SIZE 56
+#define OBX_RECORD_SIZE 8
+#define OBX_WORD_SIZE 3
+
+/* The header, with the place of every table */
+typedef struct {
+    unsigned long ic;
+    unsigned long dc;
+    unsigned long base;               /* Address of the first word */
+    unsigned long run_count;
+    unsigned long run_offset;
+    unsigned long word_count;
+    unsigned long image_offset;
+    unsigned long entry_count;
+    unsigned long entry_offset;
+    unsigned long extern_count;
+    unsigned long extern_offset;
+    unsigned long strings_size;
+    unsigned long strings_offset;
+} ObxHeader;
+
+/* Sets the offsets of a header from its counts and strings_size */
+void obx_layout(ObxHeader *header);
+
+/* Returns the file size that a laid out header describes */
+unsigned long obx_file_size(const ObxHeader *header);
+
+/* Writes the header into its OBX_HEADER_SIZE bytes at dst */
+void obx_put_header(unsigned char *dst, const ObxHeader *header);
+
+/* Reads the header of a file of size bytes and checks that every table
+   is inside the file. Returns 0 if it is not a valid .obx file. */
+int obx_get_header(const unsigned char *data, unsigned long size, ObxHeader *header);
+
+/* Stores a 32-bit number at dst */
+void obx_put_u32(unsigned char *dst, unsigned long value);
+
+/* Reads a 32-bit number at src */
+unsigned long obx_get_u32(const unsigned char *src);
+
+/* Stores a 24-bit word at dst */
+void obx_put_word(unsigned char *dst, unsigned int word);
+
+/* Reads the 24-bit word at src */
+unsigned int obx_get_word(const unsigned char *src);
+
+#endif /* OBX_H */
@@ -0,0 +1,447 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "obx.h"
+#include "obz.h"
+#include "intern.h"
+#include "arena.h"
+#include "source.h"
+
+/* Converts between the text object files (.ob, .ent, .ext) and the binary
+   object file (.obx):
+     obxconv X.ob    reads X.ob, X.ent and X.ext, writes X.obx
+     obxconv X.obx   reads X.obx, writes X.ob, X.ent and X.ext
+     obxconv X.obz   reads the compressed X.obz, writes X.ob
+   Every direction gives the same bytes as the assembler itself. */
+
+/* Longest label read from a .ent or .ext line */
+#define NAME_LENGTH 80
+
+/* Addresses are 24-bit; a record past this is damaged */
+#define MAX_ADDRESS 0xFFFFFFUL
+
+/* One "LABEL ADDRESS" line of a .ent or .ext file */
+typedef struct {
+    StringId name;
+    unsigned long address;
+} NamedAddress;
+
+/* Everything in one object: the text files, or the .obx file */
+typedef struct {
+    unsigned long ic;
+    unsigned long dc;
+    unsigned long *addresses;         /* Address of each word, in file order */
+    unsigned int *words;
+    long word_count;
+    long word_capacity;
+    NamedAddress *entries;
+    long entry_count;
+    long entry_capacity;
+    NamedAddress *externs;
+    long extern_count;
+    long extern_capacity;
+    Arena arena;
+    StringPool names;                 /* Labels; ids follow first appearance */
+} ObjectData;
+
+/* Makes room for one more element in a growing array */
+static void *reserve(void *array, long count, long *capacity, size_t element_size) {
+    if (count < *capacity) {
+        return array;
+    }
+    *capacity = *capacity ? *capacity * 2 : 64;
+    array = realloc(array, *capacity * element_size);
+    if (array == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the object\n");
+        exit(EXIT_FAILURE);
+    }
+    return array;
+}
+
+/* Builds a file name from a base name and an extension */
+static char *file_name(const char *base, const char *extension) {
+    char *name = malloc(strlen(base) + strlen(extension) + 1);
+
+    if (name == NULL) {
+        fprintf(stderr, "Failed to allocate memory for file name\n");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(name, base);
+    strcat(name, extension);
+    return name;
+}
+
+/* Reads the "LABEL ADDRESS" lines of a .ent or .ext file, if it exists */
+static void read_labels(ObjectData *object, const char *path, NamedAddress **table,
+                        long *count, long *capacity) {
+    FILE *file = fopen(path, "r");
+    char name[NAME_LENGTH + 1];
+    unsigned long address;
+
+    if (file == NULL) {
+        return;
+    }
+    while (fscanf(file, "%80s %lu", name, &address) == 2) {
+        *table = reserve(*table, *count, capacity, sizeof(NamedAddress));
+        (*table)[*count].name = intern_string(&object->names, name);
+        (*table)[*count].address = address;
+        (*count)++;
+    }
+    fclose(file);
+}
+
+/* Reads X.ob, X.ent and X.ext. Returns 0 if X.ob cannot be read. */
+static int read_text(ObjectData *object, const char *base) {
+    char *path = file_name(base, ".ob");
+    FILE *file = fopen(path, "r");
+    unsigned long address, word;
+    long capacity;
+
+    if (file == NULL || fscanf(file, "%lu %lu", &object->ic, &object->dc) != 2) {
+        fprintf(stderr, "Error: Cannot read %s\n", path);
+        if (file != NULL) {
+            fclose(file);
+        }
+        free(path);
+        return 0;
+    }
+    while (fscanf(file, "%lu %lx", &address, &word) == 2) {
+        capacity = object->word_capacity;
+        object->addresses = reserve(object->addresses, object->word_count, &object->word_capacity,
+                                    sizeof(unsigned long));
+        if (object->word_capacity != capacity) {
+            object->words = realloc(object->words, object->word_capacity * sizeof(unsigned int));
+            if (object->words == NULL) {
+                fprintf(stderr, "Failed to allocate memory for the object\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        object->addresses[object->word_count] = address;
+        object->words[object->word_count] = (unsigned int)word & 0xFFFFFF;
+        object->word_count++;
+    }
+    fclose(file);
+    free(path);
+
+    /* Entries first, so names get the same ids as in the assembler */
+    path = file_name(base, ".ent");
+    read_labels(object, path, &object->entries, &object->entry_count, &object->entry_capacity);
+    free(path);
+    path = file_name(base, ".ext");
+    read_labels(object, path, &object->externs, &object->extern_count, &object->extern_capacity);
+    free(path);
+    return 1;
+}
+
+/* Writes the label records of a table; names are offsets of the strings */
+static void write_records(FILE *file, const NamedAddress *table, long count,
+                          const unsigned long *name_offsets) {
+    unsigned char record[OBX_RECORD_SIZE];
+    long i;
+
+    for (i = 0; i < count; i++) {
+        obx_put_u32(record, name_offsets[table[i].name]);
+        obx_put_u32(record + 4, table[i].address);
+        fwrite(record, 1, OBX_RECORD_SIZE, file);
+    }
+}
+
+/* Writes X.obx. Returns 0 if it cannot be created. */
+static int write_binary(const ObjectData *object, const char *base) {
+    char *path = file_name(base, ".obx");
+    FILE *file = fopen(path, "wb");
+    int name_count = get_string_count(&object->names);
+    unsigned long *name_offsets = malloc((name_count + 1) * sizeof(unsigned long));
+    unsigned char bytes[OBX_HEADER_SIZE];
+    ObxHeader header;
+    const char *name;
+    long i, start;
+    int id;
+
+    if (name_offsets == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the object\n");
+        exit(EXIT_FAILURE);
+    }
+    if (file == NULL) {
+        fprintf(stderr, "Error: Cannot create %s\n", path);
+        free(path);
+        free(name_offsets);
+        return 0;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.ic = object->ic;
+    header.dc = object->dc;
+    header.base = object->word_count > 0 ? object->addresses[0] : 100;
+    for (i = 0; i < object->word_count; i++) {
+        if (i == 0 || object->addresses[i] != object->addresses[i - 1] + 1) {
+            header.run_count++;
+        }
+    }
+    header.word_count = (unsigned long)object->word_count;
+    header.entry_count = (unsigned long)object->entry_count;
+    header.extern_count = (unsigned long)object->extern_count;
+    for (id = 0; id < name_count; id++) {
+        name_offsets[id] = header.strings_size;
+        header.strings_size += (unsigned long)strlen(string_of(&object->names, (StringId)id)) + 1;
+    }
+    obx_layout(&header);
+    obx_put_header(bytes, &header);
+    fwrite(bytes, 1, OBX_HEADER_SIZE, file);
+
+    /* Runs of consecutive addresses */
+    for (start = 0; start < object->word_count; start = i) {
+        for (i = start + 1; i < object->word_count &&
+                            object->addresses[i] == object->addresses[i - 1] + 1; i++) {
+        }
+        obx_put_u32(bytes, object->addresses[start]);
+        obx_put_u32(bytes + 4, (unsigned long)(i - start));
+        fwrite(bytes, 1, OBX_RECORD_SIZE, file);
+    }
+    write_records(file, object->entries, object->entry_count, name_offsets);
+    write_records(file, object->externs, object->extern_count, name_offsets);
+
+    for (i = 0; i < object->word_count; i++) {
+        obx_put_word(bytes, object->words[i]);
+        fwrite(bytes, 1, OBX_WORD_SIZE, file);
+    }
+    memset(bytes, 0, 4);
+    fwrite(bytes, 1, header.strings_offset - header.image_offset - header.word_count * OBX_WORD_SIZE,
+           file);
+    for (id = 0; id < name_count; id++) {
+        name = string_of(&object->names, (StringId)id);
+        fwrite(name, 1, strlen(name) + 1, file);
+    }
+
+    fclose(file);
+    free(path);
+    free(name_offsets);
+    return 1;
+}
+
+/* Writes the label records of a .obx table as "LABEL ADDRESS" lines */
+static int write_labels(const unsigned char *data, const ObxHeader *header, unsigned long offset,
+                        unsigned long count, const char *path) {
+    FILE *file = fopen(path, "w");
+    const unsigned char *record;
+    unsigned long i, name;
+
+    if (file == NULL) {
+        fprintf(stderr, "Error: Cannot create %s\n", path);
+        return 0;
+    }
+    for (i = 0; i < count; i++) {
+        record = data + offset + i * OBX_RECORD_SIZE;
+        name = obx_get_u32(record);
+        if (name >= header->strings_size) {
+            fprintf(stderr, "Error: Bad name in %s\n", path);
+            fclose(file);
+            return 0;
+        }
+        fprintf(file, "%s %04lu\n", (const char *)data + header->strings_offset + name,
+                obx_get_u32(record + 4));
+    }
+    fclose(file);
+    return 1;
+}
+
+/* Reads X.obx in place (mapped) and writes X.ob, X.ent and X.ext.
+   Returns 0 on failure. */
+static int binary_to_text(const char *base) {
+    char *path = file_name(base, ".obx");
+    const unsigned char *data;
+    const unsigned char *image;
+    SourceFile source;
+    ObxHeader header;
+    FILE *file;
+    unsigned long run, i, address, count;
+    int ok;
+
+    if (!open_source(path, &source)) {
+        fprintf(stderr, "Error: Cannot read %s\n", path);
+        free(path);
+        return 0;
+    }
+    data = (const unsigned char *)source.data;
+    if (!obx_get_header(data, (unsigned long)source.size, &header)) {
+        fprintf(stderr, "Error: %s is not a binary object file\n", path);
+        close_source(&source);
+        free(path);
+        return 0;
+    }
+    free(path);
+
+    path = file_name(base, ".ob");
+    file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Cannot create %s\n", path);
+        close_source(&source);
+        free(path);
+        return 0;
+    }
+    fprintf(file, "%lu %lu\n", header.ic, header.dc);
+    image = data + header.image_offset;
+    for (run = 0; run < header.run_count; run++) {
+        address = obx_get_u32(data + header.run_offset + run * OBX_RECORD_SIZE);
+        count = obx_get_u32(data + header.run_offset + run * OBX_RECORD_SIZE + 4);
+        for (i = 0; i < count && image < data + header.image_offset + header.word_count * OBX_WORD_SIZE;
+             i++, image += OBX_WORD_SIZE) {
+            fprintf(file, "%04lu %06X\n", address + i, obx_get_word(image));
+        }
+    }
+    fclose(file);
+    free(path);
+
+    path = file_name(base, ".ent");
+    ok = write_labels(data, &header, header.entry_offset, header.entry_count, path);
+    free(path);
+    path = file_name(base, ".ext");
+    ok = write_labels(data, &header, header.extern_offset, header.extern_count, path) && ok;
+    free(path);
+
+    close_source(&source);
+    return ok;
+}
+
+/* Writes the .ob lines of the records of one unpacked .obz block.
+   Returns 0 if the records are damaged. */
+static int write_records_text(FILE *file, const unsigned char *pos, const unsigned char *end,
+                              unsigned long *address) {
+    unsigned long gap, header, count, i;
+    int repeat;
+
+    while (pos < end) {
+        if (!obz_get_varint(&pos, end, &gap) || !obz_get_varint(&pos, end, &header)) {
+            return 0;
+        }
+        count = header >> 1;
+        repeat = (int)(header & 1);
+        if (gap > MAX_ADDRESS || count > MAX_ADDRESS || *address + gap + count > MAX_ADDRESS ||
+            (unsigned long)(end - pos) < (repeat ? 1 : count) * 3) {
+            return 0;
+        }
+        *address += gap;
+        for (i = 0; i < count; i++) {
+            fprintf(file, "%04lu %06X\n", *address + i, obx_get_word(pos + (repeat ? 0 : i * 3)));
+        }
+        pos += (repeat ? 1 : count) * 3;
+        *address += count;
+    }
+    return 1;
+}
+
+/* Reads X.obz a block at a time and writes X.ob. Returns 0 on failure. */
+static int compressed_to_text(const char *base) {
+    static unsigned char packed[OBZ_PACKED_SIZE];
+    static unsigned char raw[OBZ_BLOCK_SIZE];
+    char *path = file_name(base, ".obz");
+    FILE *in = fopen(path, "rb");
+    FILE *out;
+    unsigned char header[12];
+    unsigned long raw_length, packed_length;
+    unsigned long address = 0;
+    long length;
+    int ok = 0;
+
+    if (in == NULL || fread(header, 1, 12, in) != 12 || memcmp(header, OBZ_MAGIC, 4) != 0) {
+        fprintf(stderr, "Error: %s is not a compressed object file\n", path);
+        if (in != NULL) {
+            fclose(in);
+        }
+        free(path);
+        return 0;
+    }
+    free(path);
+
+    path = file_name(base, ".ob");
+    out = fopen(path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Error: Cannot create %s\n", path);
+        fclose(in);
+        free(path);
+        return 0;
+    }
+    fprintf(out, "%lu %lu\n", obx_get_u32(header + 4), obx_get_u32(header + 8));
+
+    for (;;) {
+        if (fread(header, 1, 4, in) != 4) {
+            break;
+        }
+        raw_length = obx_get_u32(header);
+        if (raw_length == 0) {
+            ok = 1;
+            break;
+        }
+        if (fread(header + 4, 1, 4, in) != 4 || raw_length > OBZ_BLOCK_SIZE ||
+            (packed_length = obx_get_u32(header + 4)) > OBZ_PACKED_SIZE ||
+            fread(packed, 1, packed_length, in) != packed_length) {
+            break;
+        }
+        if (packed_length == raw_length) {
+            length = (long)raw_length;
+            memcpy(raw, packed, raw_length);
+        } else {
+            length = obz_unpack(packed, (long)packed_length, raw, OBZ_BLOCK_SIZE);
+        }
+        if (length != (long)raw_length || !write_records_text(out, raw, raw + length, &address)) {
+            break;
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: %s.obz is damaged\n", base);
+    }
+
+    fclose(in);
+    fclose(out);
+    free(path);
+    return ok;
+}
+
+/* Converts one .ob file to .obx. Returns 0 on failure. */
+static int text_to_binary(const char *base) {
+    ObjectData object;
+    int ok;
+
+    memset(&object, 0, sizeof(object));
+    reset_string_pool(&object.names, &object.arena);
+    ok = read_text(&object, base) && write_binary(&object, base);
+
+    free(object.addresses);
+    free(object.words);
+    free(object.entries);
+    free(object.externs);
+    arena_free(&object.arena);
+    return ok;
+}
+
+int main(int args, char *argv[]) {
+    char *base;
+    size_t length;
+    int failures = 0;
+    int i;
+
+    if (args < 2) {
+        fprintf(stderr, "Usage: obxconv X.ob | X.obx | X.obz ...\n");
+        return 1;
+    }
+
+    for (i = 1; i < args; i++) {
+        length = strlen(argv[i]);
+        base = file_name(argv[i], "");
+        if (length > 4 && strcmp(argv[i] + length - 4, ".obx") == 0) {
+            base[length - 4] = '\0';
+            failures += !binary_to_text(base);
+        } else if (length > 4 && strcmp(argv[i] + length - 4, ".obz") == 0) {
+            base[length - 4] = '\0';
+            failures += !compressed_to_text(base);
+        } else if (length > 3 && strcmp(argv[i] + length - 3, ".ob") == 0) {
+            base[length - 3] = '\0';
+            failures += !text_to_binary(base);
+        } else {
+            fprintf(stderr, "Error: %s is not a .ob, .obx or .obz file\n", argv[i]);
+            failures++;
+        }
+        free(base);
+    }
+    return failures > 0;
+}
@@ -0,0 +1,269 @@
+#include <string.h>
+#include "obz.h"
+#include "obx.h"
+
+/* Entries of the match finder's hash table (a power of two) */
+#define HASH_BITS 12
+#define HASH_SIZE (1 << HASH_BITS)
+
+/* Shortest match the codec stores, and the farthest one back */
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+
+/* Stores a varint (7 bits per byte, low bits first); returns its length */
+static int put_varint(unsigned char *dst, unsigned long value) {
+    int length = 0;
+
+    while (value >= 0x80) {
+        dst[length++] = (unsigned char)((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    dst[length++] = (unsigned char)value;
+    return length;
+}
+
+int obz_get_varint(const unsigned char **pos, const unsigned char *end, unsigned long *value) {
+    const unsigned char *p = *pos;
+    int shift = 0;
+
+    *value = 0;
+    while (p < end && shift < 35) {
+        *value |= (unsigned long)(*p & 0x7F) << shift;
+        if (!(*p++ & 0x80)) {
+            *pos = p;
+            return 1;
+        }
+        shift += 7;
+    }
+    return 0;
+}
+
+/* Hash of the 4 bytes at src (Knuth multiplicative hashing) */
+static unsigned int hash4(const unsigned char *src) {
+    unsigned long value = (unsigned long)src[0] | ((unsigned long)src[1] << 8) |
+                          ((unsigned long)src[2] << 16) | ((unsigned long)src[3] << 24);
+
+    return (unsigned int)(((value * 2654435761UL) & 0xFFFFFFFFUL) >> (32 - HASH_BITS));
+}
+
+/* Stores a length above 14 as a run of 255s and a last byte */
+static long put_length(unsigned char *dst, long length) {
+    long n = 0;
+
+    while (length >= 255) {
+        dst[n++] = 255;
+        length -= 255;
+    }
+    dst[n++] = (unsigned char)length;
+    return n;
+}
+
+/* Stores literals and a match as one sequence: a token (literal count
+   and match length, 4 bits each), the literals, the match offset */
+static long put_sequence(unsigned char *dst, const unsigned char *literals, long literal_count,
+                         long offset, long match_length) {
+    long n = 1;
+    long extra = match_length - MIN_MATCH;
+
+    dst[0] = (unsigned char)((literal_count < 15 ? literal_count : 15) << 4);
+    if (literal_count >= 15) {
+        n += put_length(dst + n, literal_count - 15);
+    }
+    memcpy(dst + n, literals, literal_count);
+    n += literal_count;
+    if (match_length == 0) {
+        return n;
+    }
+
+    dst[0] |= (unsigned char)(extra < 15 ? extra : 15);
+    dst[n++] = (unsigned char)(offset & 0xFF);
+    dst[n++] = (unsigned char)(offset >> 8);
+    if (extra >= 15) {
+        n += put_length(dst + n, extra - 15);
+    }
+    return n;
+}
+
+/* Greedy LZ77: each position is looked up by the hash of its next 4 bytes;
+   the last sequence holds only literals */
+long obz_pack(const unsigned char *src, long length, unsigned char *dst) {
+    long table[HASH_SIZE];
+    long packed = 0;
+    long anchor = 0;
+    long ip = 0;
+    long candidate, match;
+    unsigned int hash;
+    int i;
+
+    for (i = 0; i < HASH_SIZE; i++) {
+        table[i] = -1;
+    }
+
+    while (ip + MIN_MATCH <= length) {
+        hash = hash4(src + ip);
+        candidate = table[hash];
+        table[hash] = ip;
+        if (candidate < 0 || ip - candidate > MAX_OFFSET || memcmp(src + candidate, src + ip, MIN_MATCH) != 0) {
+            ip++;
+            continue;
+        }
+        for (match = MIN_MATCH; ip + match < length && src[candidate + match] == src[ip + match]; match++) {
+        }
+        packed += put_sequence(dst + packed, src + anchor, ip - anchor, ip - candidate, match);
+        ip += match;
+        anchor = ip;
+    }
+    return packed + put_sequence(dst + packed, src + anchor, length - anchor, 0, 0);
+}
+
+/* Reads a length stored by put_length and adds it to *length */
+static int get_length(const unsigned char **src, const unsigned char *end, long *length) {
+    unsigned char byte;
+
+    do {
+        if (*src >= end) {
+            return 0;
+        }
+        byte = *(*src)++;
+        *length += byte;
+    } while (byte == 255);
+    return 1;
+}
+
+long obz_unpack(const unsigned char *src, long length, unsigned char *dst, long capacity) {
+    const unsigned char *end = src + length;
+    long out = 0;
+    long literal_count, match, offset;
+    unsigned char token;
+
+    while (src < end) {
+        token = *src++;
+        literal_count = token >> 4;
+        if (literal_count == 15 && !get_length(&src, end, &literal_count)) {
+            return -1;
+        }
+        if (literal_count > end - src || literal_count > capacity - out) {
+            return -1;
+        }
+        memcpy(dst + out, src, literal_count);
+        src += literal_count;
+        out += literal_count;
+        if (src == end) {
+            break;
+        }
+
+        if (end - src < 2) {
+            return -1;
+        }
+        offset = (long)src[0] | ((long)src[1] << 8);
+        src += 2;
+        match = (token & 0xF) + MIN_MATCH;
+        if ((token & 0xF) == 15 && !get_length(&src, end, &match)) {
+            return -1;
+        }
+        if (offset == 0 || offset > out || match > capacity - out) {
+            return -1;
+        }
+
+        /* Byte by byte: a match may overlap the bytes it produces */
+        for (; match > 0; match--, out++) {
+            dst[out] = dst[out - offset];
+        }
+    }
+    return out;
+}
+
+/* Packs the records collected so far and writes them as one block */
+static void flush_block(ObzWriter *writer) {
+    unsigned char sizes[8];
+    long packed;
+
+    if (writer->raw_length == 0) {
+        return;
+    }
+    packed = obz_pack(writer->raw, writer->raw_length, writer->packed);
+    obx_put_u32(sizes, (unsigned long)writer->raw_length);
+    if (packed < writer->raw_length) {
+        obx_put_u32(sizes + 4, (unsigned long)packed);
+        output_bytes(writer->out, (const char *)sizes, 8);
+        output_bytes(writer->out, (const char *)writer->packed, packed);
+    } else {
+        obx_put_u32(sizes + 4, (unsigned long)writer->raw_length);
+        output_bytes(writer->out, (const char *)sizes, 8);
+        output_bytes(writer->out, (const char *)writer->raw, writer->raw_length);
+    }
+    writer->raw_length = 0;
+}
+
+/* Adds one record: count words, or one word repeated count times */
+static void add_record(ObzWriter *writer, unsigned long address, const unsigned int *words,
+                       long count, int repeat) {
+    long stored = repeat ? 1 : count;
+    unsigned char *pos;
+    long i;
+
+    if (writer->raw_length + 20 + stored * 3 > OBZ_BLOCK_SIZE) {
+        flush_block(writer);
+    }
+    pos = writer->raw + writer->raw_length;
+    pos += put_varint(pos, address - writer->next_address);
+    pos += put_varint(pos, ((unsigned long)count << 1) | (unsigned long)repeat);
+    for (i = 0; i < stored; i++, pos += 3) {
+        obx_put_word(pos, words[i] & 0xFFFFFF);
+    }
+    writer->raw_length = pos - writer->raw;
+    writer->next_address = address + (unsigned long)count;
+}
+
+void obz_start(ObzWriter *writer, Output *out, unsigned long ic, unsigned long dc) {
+    unsigned char header[12];
+
+    writer->out = out;
+    writer->next_address = 0;
+    writer->raw_length = 0;
+    memcpy(header, OBZ_MAGIC, 4);
+    obx_put_u32(header + 4, ic);
+    obx_put_u32(header + 8, dc);
+    output_bytes(out, (const char *)header, 12);
+}
+
+/* Number of words equal to words[0] at its start, up to limit */
+static long repeat_length(const unsigned int *words, long limit) {
+    long n = 1;
+
+    while (n < limit && ((words[n] ^ words[0]) & 0xFFFFFF) == 0) {
+        n++;
+    }
+    return n;
+}
+
+void obz_add_words(ObzWriter *writer, unsigned long address, const unsigned int *words, long count) {
+    long k = 0;
+    long start, run;
+
+    while (k < count) {
+        run = repeat_length(words + k, count - k);
+        if (run >= OBZ_MIN_REPEAT) {
+            add_record(writer, address + k, words + k, run, 1);
+            k += run;
+            continue;
+        }
+
+        /* Different words, up to the next repeat */
+        start = k;
+        while (k < count && k - start < OBZ_LITERAL_WORDS &&
+               repeat_length(words + k, count - k < OBZ_MIN_REPEAT ? count - k : OBZ_MIN_REPEAT) <
+                   OBZ_MIN_REPEAT) {
+            k++;
+        }
+        add_record(writer, address + start, words + start, k - start, 0);
+    }
+}
+
+void obz_finish(ObzWriter *writer) {
+    unsigned char end[4];
+
+    flush_block(writer);
+    obx_put_u32(end, 0);
+    output_bytes(writer->out, (const char *)end, 4);
+}
@@ -0,0 +1,70 @@
+#ifndef OBZ_H
+#define OBZ_H
+
+#include "output.h"
+
+/* Compressed object format (.obz), written instead of the .ob with -obz.
+   It holds the same words, so the .ob can be restored exactly:
+
+     "OBZ1", u32 ic, u32 dc           the two numbers of the .ob header line
+     blocks                           u32 raw_length, u32 packed_length, bytes
+     u32 0                            end of the blocks
+
+   Numbers are little-endian (obx.h). A block holds at most OBZ_BLOCK_SIZE
+   bytes of records and is packed with an LZ77 codec (obz_pack); when
+   packing does not make it smaller it is stored as it is (packed_length
+   equals raw_length). No record crosses a block, so a reader can decode
+   the file one block at a time. A record is
+
+     varint gap                       addresses skipped since the last record
+     varint (count << 1) | repeat     repeat: one word used count times,
+     words                            else count words; 3 bytes per word
+
+   and the first record counts its gap from address 0. */
+
+/* Magic number at the start of the file (includes the version) */
+#define OBZ_MAGIC "OBZ1"
+
+/* Bytes of records in one block, before packing */
+#define OBZ_BLOCK_SIZE 65536
+
+/* Room a packed block may need (incompressible data grows a little) */
+#define OBZ_PACKED_SIZE (OBZ_BLOCK_SIZE + OBZ_BLOCK_SIZE / 255 + 16)
+
+/* Longest run of different words in one record */
+#define OBZ_LITERAL_WORDS 4096
+
+/* Shortest run of equal words stored as a repeat */
+#define OBZ_MIN_REPEAT 3
+
+/* Builds a .obz output block by block */
+typedef struct {
+    Output *out;
+    unsigned long next_address;       /* Address right after the last record */
+    long raw_length;                  /* Bytes of records in raw */
+    unsigned char raw[OBZ_BLOCK_SIZE];
+    unsigned char packed[OBZ_PACKED_SIZE];
+} ObzWriter;
+
+/* Starts a .obz output with the .ob header numbers */
+void obz_start(ObzWriter *writer, Output *out, unsigned long ic, unsigned long dc);
+
+/* Adds count words at consecutive addresses, above the words added so far */
+void obz_add_words(ObzWriter *writer, unsigned long address, const unsigned int *words, long count);
+
+/* Writes the last block and the end mark */
+void obz_finish(ObzWriter *writer);
+
+/* Packs length bytes (at most OBZ_BLOCK_SIZE) into dst, which has room
+   for OBZ_PACKED_SIZE bytes. Returns the packed length. */
+long obz_pack(const unsigned char *src, long length, unsigned char *dst);
+
+/* Unpacks a block into dst (capacity bytes). Returns the unpacked length,
+   or -1 if the block is damaged. */
+long obz_unpack(const unsigned char *src, long length, unsigned char *dst, long capacity);
+
+/* Reads a varint at *pos (before end) and moves past it. Returns 0 if it
+   is cut off. */
+int obz_get_varint(const unsigned char **pos, const unsigned char *end, unsigned long *value);
+
+#endif /* OBZ_H */
@@ -0,0 +1,106 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "output.h"
+
+/* Memory buffers start at this many bytes and double when full */
+#define INITIAL_OUTPUT_SIZE 4096
+
+int output_open(Output *out, const char *path) {
+    out->length = 0;
+    out->opened = 1;
+    if (path == NULL) {
+        out->file = NULL;
+        return 1;
+    }
+    /* An existing file is replaced rather than rewritten, so a copy
+       hardlinked elsewhere (the build cache) keeps its contents */
+    remove(path);
+    out->file = fopen(path, "w");
+    return out->file != NULL;
+}
+
+/* Makes room for length more bytes in a memory buffer */
+static void reserve_memory(Output *out, long length) {
+    long capacity;
+
+    if (out->length + length > out->capacity) {
+        capacity = out->capacity ? out->capacity : INITIAL_OUTPUT_SIZE;
+        while (out->length + length > capacity) {
+            capacity *= 2;
+        }
+        out->data = realloc(out->data, capacity);
+        if (out->data == NULL) {
+            fprintf(stderr, "Failed to allocate memory for assembler output\n");
+            exit(EXIT_FAILURE);
+        }
+        out->capacity = capacity;
+    }
+}
+
+void output_bytes(Output *out, const char *bytes, long length) {
+    if (out->file != NULL) {
+        fwrite(bytes, 1, length, out->file);
+        return;
+    }
+
+    reserve_memory(out, length);
+    memcpy(out->data + out->length, bytes, length);
+    out->length += length;
+}
+
+long output_reserve(Output *out, long length) {
+    long start;
+
+    if (out->file != NULL) {
+        /* Later writes go past the range; it is filled in with pwrite */
+        fflush(out->file);
+        start = ftell(out->file);
+        fseek(out->file, start + length, SEEK_SET);
+        return start;
+    }
+
+    reserve_memory(out, length);
+    start = out->length;
+    out->length += length;
+    return start;
+}
+
+void output_write_at(Output *out, long offset, const char *bytes, long length) {
+    long written;
+
+    if (out->file == NULL) {
+        memcpy(out->data + offset, bytes, length);
+        return;
+    }
+    while (length > 0) {
+        written = (long)pwrite(fileno(out->file), bytes, length, offset);
+        if (written <= 0) {
+            perror("Error writing output file");
+            return;
+        }
+        bytes += written;
+        offset += written;
+        length -= written;
+    }
+}
+
+void output_string(Output *out, const char *str) {
+    output_bytes(out, str, (long)strlen(str));
+}
+
+void output_close(Output *out) {
+    if (out->file != NULL) {
+        fclose(out->file);
+        out->file = NULL;
+    }
+}
+
+void output_free(Output *out) {
+    output_close(out);
+    free(out->data);
+    out->data = NULL;
+    out->length = out->capacity = 0;
+}
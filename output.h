@@ -0,0 +1,44 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdio.h>
+
+/* Where one output file (.ob, .ent, .ext or .am) goes: a file on disk, or
+   a buffer in memory that grows as it is written. A memory buffer keeps its
+   allocation between assemblies and is reused. */
+typedef struct {
+    FILE *file;                       /* Written here while open, if set */
+    char *data;                       /* Otherwise collected here */
+    long length;                      /* Bytes in data */
+    long capacity;                    /* Bytes allocated for data */
+    int opened;                       /* Set once started by output_open */
+} Output;
+
+/* Initial value for an unused output */
+#define OUTPUT_INIT {NULL, NULL, 0, 0, 0}
+
+/* Starts an output: creates the file at path, or empties the memory buffer
+   if path is NULL. Returns 0 if the file cannot be created. */
+int output_open(Output *out, const char *path);
+
+/* Appends bytes to an output */
+void output_bytes(Output *out, const char *bytes, long length);
+
+/* Appends a null-terminated string to an output */
+void output_string(Output *out, const char *str);
+
+/* Reserves length bytes at the end of an output and returns the offset of
+   the first. The range is filled in with output_write_at, which different
+   threads may call at once for different parts of it. */
+long output_reserve(Output *out, long length);
+
+/* Writes bytes at an offset inside a reserved range (pwrite for a file) */
+void output_write_at(Output *out, long offset, const char *bytes, long length);
+
+/* Finishes an output; a file is closed, a memory buffer stays readable */
+void output_close(Output *out);
+
+/* Releases the memory buffer of an output */
+void output_free(Output *out);
+
+#endif /* OUTPUT_H */
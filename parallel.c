@@ -0,0 +1,55 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "parallel.h"
+
+/* What one thread of run_parallel is given */
+typedef struct {
+    ParallelTask task;
+    void *arg;
+    int index;
+    int started;                      /* Set if it runs on its own thread */
+    pthread_t thread;
+} Piece;
+
+static void *piece_main(void *arg) {
+    Piece *piece = arg;
+    piece->task(piece->arg, piece->index);
+    return NULL;
+}
+
+void run_parallel(int count, ParallelTask task, void *arg) {
+    Piece *pieces;
+    int i;
+
+    if (count <= 1) {
+        if (count == 1) {
+            task(arg, 0);
+        }
+        return;
+    }
+
+    pieces = malloc(count * sizeof(Piece));
+    if (pieces == NULL) {
+        fprintf(stderr, "Failed to allocate memory for worker threads\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 1; i < count; i++) {
+        pieces[i].task = task;
+        pieces[i].arg = arg;
+        pieces[i].index = i;
+        pieces[i].started = pthread_create(&pieces[i].thread, NULL, piece_main, &pieces[i]) == 0;
+    }
+
+    task(arg, 0);
+    for (i = 1; i < count; i++) {
+        if (pieces[i].started) {
+            pthread_join(pieces[i].thread, NULL);
+        } else {
+            task(arg, i);
+        }
+    }
+    free(pieces);
+}
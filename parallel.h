@@ -0,0 +1,12 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+/* One piece of work split across threads; index tells the pieces apart */
+typedef void (*ParallelTask)(void *arg, int index);
+
+/* Runs task(arg, i) for every i in [0, count) on count threads, the first
+   on the calling thread, and returns once all are done. A piece whose
+   thread cannot be started runs on the calling thread instead. */
+void run_parallel(int count, ParallelTask task, void *arg);
+
+#endif /* PARALLEL_H */
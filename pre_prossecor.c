@@ -1,146 +1,621 @@
 #include "pre_prossecor.h"
 #include "second_pass.h"
+#include "arena.h"
+#include "util.h"
+#include "table.h"
+#include "precompiled.h"
+#include "isa.h"
+#include "source.h"
+#include "lexer.h"
+#include "scan.h"
+#include "context.h"
 
-/* Global macro table to store defined macros */
-Macro macroTable[MAX_MACROS];
-int macroCount = 0;
+/* Initial sizes of the macro table, its name index and the line arrays */
+#define INITIAL_MACROS 16
+#define INITIAL_LINES 256
 
-/* List of valid instructions — macro names cannot be one of these */
-const char *validInstructions[] = {
-    "mov", "cmp", "add", "sub", "lea",
-    "clr", "not", "inc", "dec", "jmp", "bne", "jsr", "red", "prn",
-    "rts", "stop"
-};
+/* In streaming mode the program goes to the first pass in batches of this many lines */
+#define STREAM_BATCH_LINES 4096
 
-#define NUM_INSTRUCTIONS (sizeof(validInstructions) / sizeof(validInstructions[0]))
+/* Check if a given macro name is valid (not an instruction of the ISA table) */
+int isValidMacroName(TextView name) {
+    return isa_lookup_bytes(name.start, name.length) == NULL;
+}
+
+/* Forgets all macros of the previous file */
+static void resetMacros(Preprocessor *pre) {
+    arena_reset(&pre->arena);
+    pre->macroTable = NULL;
+    pre->macroCount = pre->macroCapacity = 0;
+    pre->macroIndex = NULL;
+    pre->macroIndexSize = 0;
+    pre->macroLines = NULL;
+    pre->macroLineCount = pre->macroLineCapacity = 0;
+    pre->tokens = NULL;
+    pre->tokenCount = pre->tokenCapacity = 0;
+    pre->programLines = NULL;
+    pre->programLineCount = pre->programLineCapacity = 0;
+    pre->includes = NULL;
+    pre->includeCount = pre->includeCapacity = 0;
+}
+
+/* Grows an array of the macro arena so it holds at least needed elements */
+static void *reserveLines(Preprocessor *pre, void *array, int needed, int *capacity, size_t elementSize) {
+    int newCapacity;
+
+    if (needed <= *capacity) {
+        return array;
+    }
+    newCapacity = *capacity ? *capacity : INITIAL_LINES;
+    while (needed > newCapacity) {
+        newCapacity *= 2;
+    }
+    array = arena_grow(&pre->arena, array, *capacity * elementSize, newCapacity * elementSize);
+    *capacity = newCapacity;
+    return array;
+}
+
+/* Gives the next line of the scanned text starting at *cursor, with its
+   '\n' if any, and moves the cursor past it. Like fgets, a line longer
+   than maxLength is handed out in pieces. Returns 0 at the end of text. */
+static int nextLine(Scanner *scanner, long *cursor, long maxLength, TextView *line) {
+    long lineEnd;
+
+    if (*cursor >= scanner->size) {
+        return 0;
+    }
+    lineEnd = scan_line_end(scanner, *cursor, maxLength);
+    line->start = scanner->data + *cursor;
+    line->length = lineEnd - *cursor;
+    *cursor = lineEnd;
+    return 1;
+}
+
+/* Lexes a line onto the end of the token array; returns how many tokens it has.
+   The tokens are kept only if the caller adds their count to tokenCount. */
+static int lexLine(Preprocessor *pre, Scanner *scanner, TextView line) {
+    pre->tokens = reserveLines(pre, pre->tokens, pre->tokenCount + MAX_LINE_TOKENS,
+                               &pre->tokenCapacity, sizeof(Token));
+    return lex_line(scanner, line, pre->tokens + pre->tokenCount, MAX_LINE_TOKENS);
+}
+
+/* Appends a line to the expanded program */
+static void addProgramLine(Preprocessor *pre, TextView text, int firstToken, int count, int macroLine) {
+    ProgramLine *line;
+
+    pre->programLines = reserveLines(pre, pre->programLines, pre->programLineCount + 1,
+                                     &pre->programLineCapacity, sizeof(ProgramLine));
+    line = &pre->programLines[pre->programLineCount++];
+    line->text = text;
+    line->firstToken = firstToken;
+    line->tokenCount = count;
+    line->macroLine = macroLine;
+}
+
+/* Appends a body line (already lexed at firstToken) to the macro line array */
+static MacroLine *addMacroLine(Preprocessor *pre, TextView text, int firstToken, int count) {
+    MacroLine *line;
+
+    pre->macroLines = reserveLines(pre, pre->macroLines, pre->macroLineCount + 1,
+                                   &pre->macroLineCapacity, sizeof(MacroLine));
+    line = &pre->macroLines[pre->macroLineCount++];
+    line->text = text;
+    line->firstToken = firstToken;
+    line->tokenCount = count;
+    line->isDecoded = 0;
+    return line;
+}
+
+/* Returns the position of a macro in the table, or -1 if no such macro */
+static int findMacro(const Preprocessor *pre, TextView name) {
+    unsigned long slot;
+
+    if (pre->macroIndex == NULL) {
+        return -1;
+    }
+
+    slot = hash_bytes(name.start, name.length) & (pre->macroIndexSize - 1);
+    while (pre->macroIndex[slot] != -1) {
+        if (view_equals(name, pre->macroTable[pre->macroIndex[slot]].name)) {
+            return pre->macroIndex[slot];
+        }
+        slot = (slot + 1) & (pre->macroIndexSize - 1);
+    }
+    return -1;
+}
+
+/* Places a macro in the first free slot of its probe sequence */
+static void placeMacro(Preprocessor *pre, int position) {
+    unsigned long slot = hash_string(pre->macroTable[position].name) & (pre->macroIndexSize - 1);
+
+    while (pre->macroIndex[slot] != -1) {
+        slot = (slot + 1) & (pre->macroIndexSize - 1);
+    }
+    pre->macroIndex[slot] = position;
+}
+
+/* Puts a macro into the name index, rebuilding it at 50% load */
+static void indexMacro(Preprocessor *pre, int position) {
+    int i;
+
+    if ((position + 1) * 2 > pre->macroIndexSize) {
+        pre->macroIndexSize = pre->macroIndexSize ? pre->macroIndexSize * 2 : INITIAL_MACROS * 2;
+        pre->macroIndex = arena_alloc(&pre->arena, pre->macroIndexSize * sizeof(int));
+        for (i = 0; i < pre->macroIndexSize; i++) {
+            pre->macroIndex[i] = -1;
+        }
+        for (i = 0; i < position; i++) {
+            placeMacro(pre, i);
+        }
+    }
+    placeMacro(pre, position);
+}
+
+/* Decodes one body line the way the first pass would, without reporting errors */
+static void decodeMacroLine(AsmContext *ctx, const Token *token, int count, MacroLine *macroLine) {
+    const Token *end = token + count;
+    const Token *mnemonic = token;
+    const Token *operand1 = NULL;
+    const Token *operand2 = NULL;
+
+    macroLine->isDecoded = 0;
+
+    /* Comments, labels and directives are left to the first pass */
+    if (count == 0 || token->kind == TOKEN_LABEL || token->kind == TOKEN_DIRECTIVE) {
+        return;
+    }
+
+    for (token++; token < end && operand2 == NULL; token++) {
+        if (token->kind == TOKEN_COMMA) {
+            continue;
+        }
+        if (operand1 == NULL) {
+            operand1 = token;
+        } else {
+            operand2 = token;
+        }
+    }
+    macroLine->isDecoded = decode_instruction(ctx, mnemonic, operand1, operand2,
+                                              &macroLine->instruction, 0);
+}
+
+/* Copies a name out of the source into the macro arena */
+static char *copyName(Preprocessor *pre, TextView name) {
+    char *copy = arena_alloc(&pre->arena, name.length + 1);
+
+    memcpy(copy, name.start, name.length);
+    copy[name.length] = '\0';
+    return copy;
+}
+
+/* Adds a finished macro whose body lines start at firstLine in the
+   MacroLine array. If decode is set, the lines are decoded now.
+   If a macro with the same name exists, the first definition is kept. */
+static void addMacro(AsmContext *ctx, TextView name, int firstLine, int lineCount, int decode) {
+    Preprocessor *pre = &ctx->pre;
+    Macro *macro;
+    int i;
+
+    if (findMacro(pre, name) != -1) {
+        return;
+    }
+
+    if (pre->macroCount == pre->macroCapacity) {
+        int newCapacity = pre->macroCapacity ? pre->macroCapacity * 2 : INITIAL_MACROS;
+        pre->macroTable = arena_grow(&pre->arena, pre->macroTable,
+                                     pre->macroCapacity * sizeof(Macro),
+                                     newCapacity * sizeof(Macro));
+        pre->macroCapacity = newCapacity;
+    }
+
+    macro = &pre->macroTable[pre->macroCount];
+    macro->name = copyName(pre, name);
+    macro->firstLine = firstLine;
+    macro->lineCount = lineCount;
+    for (i = firstLine; decode && i < firstLine + lineCount; i++) {
+        decodeMacroLine(ctx, pre->tokens + pre->macroLines[i].firstToken,
+                        pre->macroLines[i].tokenCount, &pre->macroLines[i]);
+    }
+
+    indexMacro(pre, pre->macroCount);
+    pre->macroCount++;
+}
+
+/* Returns a macro body line of the current file */
+const MacroLine* get_macro_line(const AsmContext *ctx, int index) {
+    return &ctx->pre.macroLines[index];
+}
+
+/* Parses an included header on its own: only macro definitions, .extern
+   declarations, comments and empty lines are allowed at its top level.
+   The result does not depend on the including file, so it can be cached.
+   Returns the number of errors found. */
+static int parseHeader(AsmContext *ctx, const char *text, long size, const char *path, HeaderImage *image) {
+    Scanner scanner;
+    long cursor = 0;
+    TextView line;
+    Token word[MAX_LINE_TOKENS];
+    int count;
+    HeaderMacro *macro = NULL;
+    MacroLine *lines = NULL;
+    int lineCapacity = 0;
+    int macroCapacity = 0;
+    int externCapacity = 0;
+    int errors = 0;
+
+    image->externCount = image->macroCount = 0;
+    image->externs = NULL;
+    image->macros = NULL;
+
+    scanner_init(&scanner, text, size);
+    while (nextLine(&scanner, &cursor, size, &line)) {
+        /* Check for line too long */
+        if (line.length >= MAX_LINE_LEN - 1) {
+            fprintf(ctx->diagnostics, "Error: Line exceeds %d characters in file %s\n", MAX_LINE_LEN, path);
+            errors++;
+            continue;
+        }
+        count = lex_line(&scanner, line, word, MAX_LINE_TOKENS);
+
+        /* Body lines are kept in the header text and decoded as they come */
+        if (macro != NULL && !(count > 0 && token_equals(word, "mcroend"))) {
+            if (macro->lineCount == lineCapacity) {
+                int newCapacity = lineCapacity ? lineCapacity * 2 : INITIAL_MACROS;
+                lines = arena_grow(&ctx->pre.arena, lines, lineCapacity * sizeof(MacroLine),
+                                   newCapacity * sizeof(MacroLine));
+                lineCapacity = newCapacity;
+            }
+            decodeMacroLine(ctx, word, count, &lines[macro->lineCount++]);
+            macro->bodyLength += line.length;
+            continue;
+        }
+
+        /* Comments and empty lines have no tokens */
+        if (count == 0) {
+            continue;
+        }
 
-/* Check if a given macro name is valid (not an instruction) */
-int isValidMacroName(char *name) {
+        if (token_equals(word, "mcro")) {
+            if (count < 2 || !isValidMacroName(token_text(word + 1))) {
+                fprintf(ctx->diagnostics, "Error: Invalid macro name '%.*s' in file %s\n",
+                        count > 1 ? (int)word[1].length : 0, count > 1 ? word[1].start : "",
+                        path);
+                errors++;
+                continue;
+            }
+            if (image->macroCount == macroCapacity) {
+                int newCapacity = macroCapacity ? macroCapacity * 2 : INITIAL_MACROS;
+                image->macros = arena_grow(&ctx->pre.arena, image->macros,
+                                           macroCapacity * sizeof(HeaderMacro),
+                                           newCapacity * sizeof(HeaderMacro));
+                macroCapacity = newCapacity;
+            }
+            macro = &image->macros[image->macroCount++];
+            macro->name = copyName(&ctx->pre, token_text(word + 1));
+            macro->body = text + cursor;       /* The body starts on the next line */
+            macro->bodyLength = 0;
+            macro->lineCount = 0;
+            lines = NULL;
+            lineCapacity = 0;
+        } else if (token_equals(word, "mcroend")) {
+            if (count != 1 || macro == NULL) {
+                fprintf(ctx->diagnostics, "Error: 'mcroend' must close a macro and be the only word in the line (file %s)\n", path);
+                errors++;
+                continue;
+            }
+            macro->lines = lines;
+            macro = NULL;
+        } else if (token_equals(word, ".extern") && count == 2) {
+            if (image->externCount == externCapacity) {
+                int newCapacity = externCapacity ? externCapacity * 2 : INITIAL_MACROS;
+                image->externs = arena_grow(&ctx->pre.arena, image->externs,
+                                            externCapacity * sizeof(StringId),
+                                            newCapacity * sizeof(StringId));
+                externCapacity = newCapacity;
+            }
+            image->externs[image->externCount++] = intern_bytes(&ctx->strings, word[1].start, word[1].length);
+        } else {
+            fprintf(ctx->diagnostics, "Error: Only macros and .extern declarations are allowed in included file %s\n", path);
+            errors++;
+        }
+    }
+
+    if (macro != NULL) {
+        fprintf(ctx->diagnostics, "Error: macro '%s' was not closed with 'mcroend' in file %s\n", macro->name, path);
+        errors++;
+    }
+    return errors;
+}
+
+/* Builds the path of an included file, relative to the including file */
+static int includePath(const char *includer, TextView quoted, char *path) {
+    const char *slash = strrchr(includer, '/');
+    long dirLength = slash ? (slash - includer) + 1 : 0;
+    long nameLength = quoted.length;
+
+    if (nameLength < 3 || quoted.start[0] != '"' || quoted.start[nameLength - 1] != '"' ||
+        dirLength + nameLength - 2 >= FILENAME_MAX) {
+        return 0;
+    }
+    memcpy(path, includer, dirLength);
+    memcpy(path + dirLength, quoted.start + 1, nameLength - 2);
+    path[dirLength + nameLength - 2] = '\0';
+    return 1;
+}
+
+/* Defines a macro of an included header. Its body is copied into the arena,
+   since the header is closed afterwards, and lexed there; the decoded
+   lines come from the header image. */
+static void addHeaderMacro(AsmContext *ctx, const HeaderMacro *macro) {
+    Preprocessor *pre = &ctx->pre;
+    char *body = arena_alloc(&pre->arena, macro->bodyLength + 1);
+    Scanner scanner;
+    long cursor = 0;
+    int firstLine = pre->macroLineCount;
+    MacroLine *line;
+    TextView text;
+    TextView name;
+    int count;
+    int i;
+
+    memcpy(body, macro->body, macro->bodyLength);
+    scanner_init(&scanner, body, macro->bodyLength);
+    for (i = 0; i < macro->lineCount && nextLine(&scanner, &cursor, macro->bodyLength, &text); i++) {
+        count = lexLine(pre, &scanner, text);
+        line = addMacroLine(pre, text, pre->tokenCount, count);
+        pre->tokenCount += count;
+        line->isDecoded = macro->lines[i].isDecoded;
+        line->instruction = macro->lines[i].instruction;
+    }
+
+    name.start = macro->name;
+    name.length = strlen(macro->name);
+    addMacro(ctx, name, firstLine, pre->macroLineCount - firstLine, 0);
+}
+
+/* Handles '.include "file"': loads the header's macros and extern
+   declarations from its precompiled form, or parses the header and
+   writes the precompiled form for next time. Returns the number of errors. */
+static int includeHeader(AsmContext *ctx, const char *includer, TextView quoted) {
+    char path[FILENAME_MAX];
+    SourceFile header;
+    unsigned long hash;
+    HeaderImage image;
     int i;
-    for (i = 0; i < NUM_INSTRUCTIONS; i++) {
-        if (strcmp(name, validInstructions[i]) == 0) {
-            return 0;
+
+    if (!includePath(includer, quoted, path)) {
+        fprintf(ctx->diagnostics, "Error: Invalid file name %.*s in .include (file %s)\n",
+                (int)quoted.length, quoted.start, includer);
+        return 1;
+    }
+
+    /* The header content is needed for its hash either way */
+    if (!open_source(path, &header)) {
+        fprintf(ctx->diagnostics, "Error: Cannot open included file %s (file %s)\n", path, includer);
+        return 1;
+    }
+    hash = hash_bytes(header.data, header.size);
+
+    /* Remember the file, for tools that track what the output depends on */
+    ctx->pre.includes = reserveLines(&ctx->pre, ctx->pre.includes, ctx->pre.includeCount + 1,
+                                     &ctx->pre.includeCapacity, sizeof(char *));
+    ctx->pre.includes[ctx->pre.includeCount] = arena_alloc(&ctx->pre.arena, strlen(path) + 1);
+    strcpy(ctx->pre.includes[ctx->pre.includeCount++], path);
+
+    if (!load_precompiled_header(path, hash, header.size, &ctx->pre.arena, &ctx->strings, &image)) {
+        if (parseHeader(ctx, header.data, header.size, path, &image) > 0) {
+            close_source(&header);
+            return 1;
         }
+        save_precompiled_header(path, hash, header.size, &ctx->strings, &image);
+    }
+
+    /* Declare the externs and define the macros as if the text were here */
+    for (i = 0; i < image.externCount; i++) {
+        add_extern_usage(ctx, image.externs[i], -1);
+    }
+    for (i = 0; i < image.macroCount; i++) {
+        addHeaderMacro(ctx, &image.macros[i]);
+    }
+    close_source(&header);
+    return 0;
+}
+
+/* Writes the expanded program to the .am output; returns 0 with an
+   error if it cannot be created */
+static int writeExpandedSource(AsmContext *ctx) {
+    Preprocessor *pre = &ctx->pre;
+    int i;
+
+    if (!open_context_output(ctx, &ctx->expanded, ".am")) {
+        fprintf(ctx->diagnostics, "Error: Cannot create %s.am\n", ctx->baseName);
+        return 0;
     }
+    for (i = 0; i < pre->programLineCount; i++) {
+        output_bytes(&ctx->expanded, pre->programLines[i].text.start, pre->programLines[i].text.length);
+    }
+    output_close(&ctx->expanded);
     return 1;
 }
 
+/* Frees the memory used for macro storage */
+void free_macros(AsmContext *ctx) {
+    arena_free(&ctx->pre.arena);
+    resetMacros(&ctx->pre);
+}
+
+/* Copies the held pass-1 diagnostics of the streamed batches to out */
+static void releaseHeldMessages(FILE *held, FILE *out) {
+    char buffer[4096];
+    size_t length;
+
+    rewind(held);
+    while ((length = fread(buffer, 1, sizeof(buffer), held)) > 0) {
+        fwrite(buffer, 1, length, out);
+    }
+    fclose(held);
+}
+
 /* Handle macro expansion and run first and second pass if no macro errors are found */
-void macro_handle(FILE *fp, char *filename) {
+int macro_handle(AsmContext *ctx, const SourceFile *source, const char *filename) {
+    Preprocessor *pre = &ctx->pre;
     int IC = MEMORY_START;                  /* Instruction counter */
     int DC = 0;                             /* Data counter */
-    char line[MAX_LINE_LEN];               /* Buffer to read lines */
+    Scanner scanner;                       /* Class masks of the mapped input */
+    long cursor = 0;                       /* Offset of its next line */
+    TextView line;                         /* Current line (view into the input) */
     int insideMacro = 0;                   /* Flag for being inside a macro */
-    char macroName[MAX_MACRO_NAME];        /* Name of the current macro */
-    int lineCount = 0;                     /* Number of lines inside a macro */
+    TextView macroName;                    /* Name of the current macro */
+    int firstLine = 0;                     /* First body line of the current macro */
     int i, j;
-    FILE *fp_am;                           /* Output file for macro-expanded code */
-    char new_filename[MAX_NAME_FILE];      /* Name for output .am file */
-    char *dot;
     int errors = 0;                        /* Counter for macro-related errors */
+    int outputErrors = 0;                  /* Outputs that could not be created */
+    int keptTokens = 0;                    /* Tokens of all macros read so far end here */
+    int writeAm = (ctx->options & ASM_WRITE_EXPANDED) != 0;
+    int batched = is_streaming(ctx) && !writeAm;
+    FILE *diagnostics = ctx->diagnostics;  /* Where messages finally go */
+    FILE *held = NULL;                     /* Pass-1 messages of the batches sent so far */
 
-    /* Create new file name with .am extension */
-    strcpy(new_filename, filename);
-    dot = strstr(new_filename, ".as");
-    if (dot) {
-        *dot = '\0';
-    }
-    strcat(new_filename, ".am");
+    /* Macros are local to the file being assembled */
+    resetMacros(pre);
 
-    /* Open .am file for writing the output after macro expansion */
-    fp_am = fopen(new_filename, "w");
-    if (!fp_am) {
-        fprintf(stderr, "Error: Cannot create %s\n", new_filename);
-        return;
-    }
+    macroName.start = NULL;
+    macroName.length = 0;
+
+    /* Read input file line by line; each line is lexed once */
+    scanner_init(&scanner, source->data, source->size);
+    while (nextLine(&scanner, &cursor, MAX_LINE_LEN - 1, &line)) {
+        const Token *word;
+        int count;
 
-    /* Read input file line by line */
-    while (fgets(line, MAX_LINE_LEN, fp)) {
-        char firstWord[MAX_MACRO_NAME], secondWord[MAX_MACRO_NAME];
-        int numWords;
+        /* Streaming: pass the lines read so far on and drop them with
+           their tokens; macro tokens (all before keptTokens) stay. Pass-1
+           messages are held until the file is known to have no macro
+           errors, so an aborted file prints the same as without batches
+           (its segments are temporary files and are simply discarded). */
+        if (batched && !insideMacro && pre->programLineCount >= STREAM_BATCH_LINES &&
+            (held != NULL || (held = tmpfile()) != NULL)) {
+            ctx->diagnostics = held;
+            first_pass(ctx, pre->programLines, pre->programLineCount, pre->tokens, &IC, &DC);
+            ctx->diagnostics = diagnostics;
+            pre->programLineCount = 0;
+            pre->tokenCount = keptTokens;
+        }
 
         /* Check for line too long */
-        if (strlen(line) >= MAX_LINE_LEN - 1) {
-            fprintf(stderr, "Error: Line exceeds %d characters in file %s\n", MAX_LINE_LEN, filename);
+        if (line.length >= MAX_LINE_LEN - 1) {
+            fprintf(ctx->diagnostics, "Error: Line exceeds %d characters in file %s\n", MAX_LINE_LEN, filename);
             errors++;
             continue;
         }
 
-        /* Try to read the first two words from the line */
-        numWords = sscanf(line, "%s %s", firstWord, secondWord);
+        count = lexLine(pre, &scanner, line);
+        word = pre->tokens + pre->tokenCount;
 
         /* Check if the line matches a macro name — if so, expand it */
-        for (i = 0; i < macroCount; i++) {
-            if (strcmp(firstWord, macroTable[i].name) == 0) {
-                for (j = 0; j < macroTable[i].lineCount; j++) {
-                    fprintf(fp_am, "%s", macroTable[i].lines[j]);
-                }
-                goto next_line;
+        i = count > 0 ? findMacro(pre, token_text(word)) : -1;
+        if (i != -1) {
+            for (j = pre->macroTable[i].firstLine; j < pre->macroTable[i].firstLine + pre->macroTable[i].lineCount; j++) {
+                addProgramLine(pre, pre->macroLines[j].text, pre->macroLines[j].firstToken,
+                               pre->macroLines[j].tokenCount, j);
             }
+            continue;
         }
 
         /* Check if line starts a new macro */
-        if (strcmp(firstWord, "mcro") == 0) {
-            if (numWords != 2 || !isValidMacroName(secondWord)) {
-                fprintf(stderr, "Error: Invalid macro name '%s' in file %s\n", secondWord, filename);
+        if (count > 0 && token_equals(word, "mcro")) {
+            if (count < 2 || !isValidMacroName(token_text(word + 1))) {
+                fprintf(ctx->diagnostics, "Error: Invalid macro name '%.*s' in file %s\n",
+                        count > 1 ? (int)word[1].length : 0, count > 1 ? word[1].start : "",
+                        filename);
                 errors++;
                 continue;
             }
             insideMacro = 1;
-            strcpy(macroName, secondWord);
-            lineCount = 0;
+            macroName = token_text(word + 1);
+            firstLine = pre->macroLineCount;
             continue;
         }
 
         /* Check if line ends a macro definition */
-        if (strcmp(firstWord, "mcroend") == 0) {
-            if (numWords != 1) {
-                fprintf(stderr, "Error: 'mcroend' must be the only word in the line (file %s)\n", filename);
+        if (count > 0 && token_equals(word, "mcroend")) {
+            if (count != 1) {
+                fprintf(ctx->diagnostics, "Error: 'mcroend' must be the only word in the line (file %s)\n", filename);
                 errors++;
                 continue;
             }
             insideMacro = 0;
-            macroTable[macroCount].lineCount = lineCount;
-            strcpy(macroTable[macroCount].name, macroName);
-            macroCount++;
+            addMacro(ctx, macroName, firstLine, pre->macroLineCount - firstLine, 1);
+            keptTokens = pre->tokenCount;
             continue;
         }
 
-        /* If inside macro definition, save the line */
+        /* If inside macro definition, save the line with its tokens */
         if (insideMacro) {
-            if (lineCount >= MAX_MACRO_LINES) {
-                fprintf(stderr, "Error: Too many lines in macro %s\n", macroName);
+            addMacroLine(pre, line, pre->tokenCount, count);
+            pre->tokenCount += count;
+            continue;
+        }
+
+        /* Include a header; the line stays in the program as a comment */
+        if (count > 0 && token_equals(word, ".include")) {
+            char *comment;
+
+            if (count != 2) {
+                fprintf(ctx->diagnostics, "Error: .include expects one file name (file %s)\n", filename);
                 errors++;
                 continue;
             }
-            strcpy(macroTable[macroCount].lines[lineCount], line);
-            lineCount++;
+            errors += includeHeader(ctx, filename, token_text(word + 1));
+            keptTokens = pre->tokenCount;
+            comment = arena_alloc(&pre->arena, line.length + 2);
+            comment[0] = ';';
+            comment[1] = ' ';
+            memcpy(comment + 2, line.start, line.length);
+            line.start = comment;
+            line.length += 2;
+            addProgramLine(pre, line, pre->tokenCount, 0, -1);
             continue;
         }
 
-        /* Regular line — write as-is to the output .am file */
-        fprintf(fp_am, "%s", line);
-
-    next_line:;
+        /* Regular line — keep it with its tokens in the expanded program */
+        addProgramLine(pre, line, pre->tokenCount, count, -1);
+        pre->tokenCount += count;
     }
 
-    /* Close the .am file */
-    fclose(fp_am);
-
     /* Check if macro was opened but not closed */
     if (insideMacro) {
-        fprintf(stderr, "Error: macro '%s' was not closed with 'mcroend' in file %s\n", macroName, filename);
+        fprintf(ctx->diagnostics, "Error: macro '%.*s' was not closed with 'mcroend' in file %s\n",
+                (int)macroName.length, macroName.start, filename);
         errors++;
     }
 
-    /* If there were errors during macro processing, stop and delete the output file */
+    /* If there were errors during macro processing, stop here */
     if (errors > 0) {
-        fprintf(stderr, "Total %d errors found. Aborting assembly for file %s\n", errors, filename);
-        remove(new_filename);
-        return;
+        if (held != NULL) {
+            fclose(held);
+        }
+        fprintf(ctx->diagnostics, "Total %d errors found. Aborting assembly for file %s\n", errors, filename);
+        return errors;
+    }
+    if (held != NULL) {
+        releaseHeldMessages(held, diagnostics);
     }
 
-    /* If no macro errors, continue to first and second pass */
-    first_pass(new_filename, &IC, &DC);
-    second_pass(new_filename, IC, DC);
+    if (writeAm && !writeExpandedSource(ctx)) {
+        outputErrors++;
+    }
+
+    /* If no macro errors, continue to first and second pass
+       (in streaming mode, with the last batch) */
+    first_pass(ctx, pre->programLines, pre->programLineCount, pre->tokens, &IC, &DC);
+
+    /* Words past the memory limit, or label uses streaming had no room
+       for, were dropped: no usable output */
+    errors = get_fatal_errors(ctx);
+    if (errors > 0) {
+        fprintf(ctx->diagnostics, "Total %d errors found. Aborting assembly for file %s\n", errors, filename);
+        return errors;
+    }
+    return outputErrors + second_pass(ctx, IC, DC);
 }
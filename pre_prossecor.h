@@ -5,9 +5,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
-
-/* Maximum number of data items */
-#define SIZE_DATA 100
+#include "first_pass.h"
+#include "source.h"
+#include "lexer.h"
+#include "arena.h"
+#include "asm.h"
 
 /* Memory starting address for the assembler */
 #define MEMORY_START 100
@@ -18,15 +20,9 @@
 /* Maximum allowed length for a macro name */
 #define MAX_MACRO_NAME 31
 
-/* Maximum number of lines that can be stored in a macro definition */
-#define MAX_MACRO_LINES 100
-
 /* Maximum length of a line in the input file */
 #define MAX_LINE_LEN 80
 
-/* Maximum number of macros that can be defined in one file */
-#define MAX_MACROS 100
-
 /* Maximum number of memory words (2^21 = 2097152) */
 #define MAX_MEMORY 2097152
 
@@ -35,25 +31,84 @@
 
 /* Structure to hold a macro definition:
    - name: the macro name
-   - lines: the lines that make up the macro body
-   - lineCount: how many lines the macro contains */
+   - firstLine: index of its first body line in the shared MacroLine array
+   - lineCount: how many lines the macro contains
+   Body lines are views into the source they were read from (see MacroLine),
+   so a macro costs no copy of its text. */
 typedef struct {
-    char name[MAX_MACRO_NAME];
-    char lines[MAX_MACRO_LINES][MAX_LINE_LEN];
+    char *name;
+    int firstLine;
     int lineCount;
 } Macro;
 
+/* One line of a macro body: its text and tokens, and the instruction it
+   holds, decoded once when the macro is closed. Lines that are not plain
+   instructions (labels, directives, comments, errors) are left undecoded
+   and go through the regular first pass. */
+typedef struct {
+    TextView text;                    /* Line text, with its '\n' */
+    int firstToken;                   /* Tokens of the line in the token array */
+    int tokenCount;
+    int isDecoded;
+    DecodedInstruction instruction;
+} MacroLine;
+
+/* One line of the expanded program, as the first pass reads it */
+typedef struct {
+    TextView text;                    /* Line text, with its '\n' */
+    int firstToken;                   /* Tokens of the line in the token array */
+    int tokenCount;
+    int macroLine;                    /* Index of the macro line it expands, or -1 */
+} ProgramLine;
+
+/* Pre-processor state of one context: the macros, tokens and expanded
+   program of the file being assembled, all in one arena */
+typedef struct {
+    Arena arena;
+    Macro *macroTable;
+    int macroCount;
+    int macroCapacity;
+    int *macroIndex;                  /* Open-addressing index from name hash to macro (-1 = empty) */
+    int macroIndexSize;
+    MacroLine *macroLines;            /* Body lines of all macros */
+    int macroLineCount;
+    int macroLineCapacity;
+    Token *tokens;                    /* Tokens of every line lexed for the file */
+    int tokenCount;
+    int tokenCapacity;
+    ProgramLine *programLines;        /* The expanded program, handed to the first pass */
+    int programLineCount;
+    int programLineCapacity;
+    char **includes;                  /* Paths of the files read through .include */
+    int includeCount;
+    int includeCapacity;
+} Preprocessor;
+
 /* Handles macro expansion in the first preprocessing step.
-   - fp: pointer to the opened input file (.as)
-   - filename: name of the input file (used to generate .am)
-   This function extracts all macros and replaces their usage. */
-void macro_handle(FILE *fp, char *filename);
+   - source: contents of the input file (.as), see source.h
+   - filename: name of the input file (for messages and .include paths)
+   This function extracts all macros and replaces their usage. Every line is
+   lexed once; the expanded program is kept in memory as lines of tokens
+   and passed straight to the first and second pass, which produce the
+   context's outputs (the expanded program too with ASM_WRITE_EXPANDED).
+   Returns the number of errors that stopped the assembly. */
+int macro_handle(AsmContext *ctx, const SourceFile *source, const char *filename);
+
+/* Frees the memory used for macro storage (call once, after the last file) */
+void free_macros(AsmContext *ctx);
+
+/* Returns a macro body line of the current file (see ProgramLine) */
+const MacroLine* get_macro_line(const AsmContext *ctx, int index);
 
 /* Performs the first pass of the assembler.
-   - filename: the name of the preprocessed file (.am)
+   - lines, lineCount: the expanded program
+   - tokens: the token array the lines refer to (see lexer.h)
    - IC: pointer to instruction counter (initially MEMORY_START)
    - DC: pointer to data counter
-   This pass handles labels, directives, and validates instruction syntax. */
-void first_pass(const char *filename, int *IC, int *DC);
+   This pass handles labels, directives, and validates instruction syntax.
+   It may be called again with the next lines of the program (streaming
+   mode); it carries on at address IC + DC. */
+void first_pass(AsmContext *ctx, const ProgramLine *lines, int lineCount, const Token *tokens,
+                int *IC, int *DC);
 
 #endif
@@ -0,0 +1,277 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "precompiled.h"
+
+/* Identifies the file format; bump it whenever the layout or MacroLine changes */
+static const char precompiled_magic[4] = {'P', 'C', 'H', '3'};
+
+/* Read position inside a loaded precompiled file */
+typedef struct {
+    const char *pos;
+    const char *end;
+    int ok;                           /* Cleared on the first malformed field */
+} Reader;
+
+/* Builds the path of the precompiled form; returns 0 if it does not fit */
+static int precompiled_path(const char *headerPath, char *path) {
+    if (strlen(headerPath) + strlen(PRECOMPILED_EXTENSION) >= FILENAME_MAX) {
+        return 0;
+    }
+    strcpy(path, headerPath);
+    strcat(path, PRECOMPILED_EXTENSION);
+    return 1;
+}
+
+/* Copies the next length bytes out of the file */
+static void read_bytes(Reader *reader, void *out, long length) {
+    if (!reader->ok || length < 0 || reader->end - reader->pos < length) {
+        reader->ok = 0;
+        return;
+    }
+    memcpy(out, reader->pos, length);
+    reader->pos += length;
+}
+
+static int read_int(Reader *reader) {
+    int value = 0;
+    read_bytes(reader, &value, sizeof(int));
+    return value;
+}
+
+static long read_long(Reader *reader) {
+    long value = 0;
+    read_bytes(reader, &value, sizeof(long));
+    return value;
+}
+
+/* Reads a length-prefixed string into the arena; a length of -1 means none */
+static char *read_string(Reader *reader, Arena *arena) {
+    int length = read_int(reader);
+    char *str;
+
+    if (!reader->ok || length == -1) {
+        return NULL;
+    }
+    if (length < 0 || reader->end - reader->pos < length) {
+        reader->ok = 0;
+        return NULL;
+    }
+    str = arena_alloc(arena, length + 1);
+    read_bytes(reader, str, length);
+    str[length] = '\0';
+    return str;
+}
+
+/* Reads an optional label and interns it */
+static StringId read_label(Reader *reader, Arena *arena, StringPool *pool) {
+    char *label = read_string(reader, arena);
+    return label ? intern_string(pool, label) : NO_STRING_ID;
+}
+
+/* Reads one pre-decoded macro line */
+static void read_macro_line(Reader *reader, Arena *arena, StringPool *pool, MacroLine *line) {
+    DecodedInstruction *decoded = &line->instruction;
+
+    line->isDecoded = read_int(reader);
+    if (!line->isDecoded) {
+        return;
+    }
+    decoded->first_word = (unsigned long)read_long(reader);
+    decoded->operand_count = read_int(reader);
+    decoded->source_mode = (AddressingMode)read_int(reader);
+    decoded->destination_mode = (AddressingMode)read_int(reader);
+    decoded->source_register = read_int(reader);
+    decoded->destination_register = read_int(reader);
+    decoded->source_value = read_int(reader);
+    decoded->destination_value = read_int(reader);
+    decoded->source_label = read_label(reader, arena, pool);
+    decoded->destination_label = read_label(reader, arena, pool);
+}
+
+/* Loads the whole file into the arena; returns its size or -1 */
+static long load_file(const char *path, Arena *arena, char **data) {
+    FILE *file;
+    long size;
+
+    file = fopen(path, "rb");
+    if (!file) {
+        return -1;
+    }
+    if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) < 0 ||
+        fseek(file, 0, SEEK_SET) != 0) {
+        fclose(file);
+        return -1;
+    }
+    *data = arena_alloc(arena, size + 1);
+    if ((long)fread(*data, 1, size, file) != size) {
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+    return size;
+}
+
+/* Loads a precompiled header built from the same header content */
+int load_precompiled_header(const char *headerPath, unsigned long hash, long size,
+                            Arena *arena, StringPool *pool, HeaderImage *image) {
+    char path[FILENAME_MAX];
+    char magic[4];
+    char *data;
+    long length;
+    Reader reader;
+    HeaderMacro *macro;
+    MacroLine *lines;
+    int i, j;
+
+    if (!precompiled_path(headerPath, path) || (length = load_file(path, arena, &data)) < 0) {
+        return 0;
+    }
+
+    reader.pos = data;
+    reader.end = data + length;
+    reader.ok = 1;
+
+    /* Header: format, and the header content it was built from */
+    read_bytes(&reader, magic, sizeof(magic));
+    if (!reader.ok || memcmp(magic, precompiled_magic, sizeof(magic)) != 0 ||
+        (unsigned long)read_long(&reader) != hash || read_long(&reader) != size) {
+        return 0;
+    }
+
+    /* Extern declarations */
+    image->externCount = read_int(&reader);
+    if (!reader.ok || image->externCount < 0 || image->externCount > length) {
+        return 0;
+    }
+    image->externs = arena_alloc(arena, (image->externCount + 1) * sizeof(StringId));
+    for (i = 0; i < image->externCount && reader.ok; i++) {
+        image->externs[i] = read_label(&reader, arena, pool);
+    }
+
+    /* Macro definitions with their pre-decoded lines */
+    image->macroCount = read_int(&reader);
+    if (!reader.ok || image->macroCount < 0 || image->macroCount > length) {
+        return 0;
+    }
+    image->macros = arena_alloc(arena, (image->macroCount + 1) * sizeof(HeaderMacro));
+    for (i = 0; i < image->macroCount && reader.ok; i++) {
+        macro = &image->macros[i];
+        macro->name = read_string(&reader, arena);
+        macro->body = read_string(&reader, arena);
+        macro->bodyLength = macro->body ? (long)strlen(macro->body) : 0;
+        macro->lineCount = read_int(&reader);
+        if (!reader.ok || macro->name == NULL || macro->lineCount < 0 ||
+            macro->lineCount > length) {
+            return 0;
+        }
+        lines = arena_alloc(arena, (macro->lineCount + 1) * sizeof(MacroLine));
+        for (j = 0; j < macro->lineCount; j++) {
+            read_macro_line(&reader, arena, pool, &lines[j]);
+        }
+        macro->lines = lines;
+    }
+
+    return reader.ok && reader.pos == reader.end;
+}
+
+static void write_int(FILE *file, int value) {
+    fwrite(&value, sizeof(int), 1, file);
+}
+
+static void write_long(FILE *file, long value) {
+    fwrite(&value, sizeof(long), 1, file);
+}
+
+/* Writes a length-prefixed string; NULL is written as length -1 */
+static void write_string(FILE *file, const char *str, long length) {
+    if (str == NULL) {
+        write_int(file, -1);
+        return;
+    }
+    write_int(file, (int)length);
+    fwrite(str, 1, length, file);
+}
+
+static void write_label(FILE *file, const StringPool *pool, StringId label) {
+    const char *str = (label == NO_STRING_ID) ? NULL : string_of(pool, label);
+    write_string(file, str, str ? (long)strlen(str) : 0);
+}
+
+/* Writes one pre-decoded macro line */
+static void write_macro_line(FILE *file, const StringPool *pool, const MacroLine *line) {
+    const DecodedInstruction *decoded = &line->instruction;
+
+    write_int(file, line->isDecoded);
+    if (!line->isDecoded) {
+        return;
+    }
+    write_long(file, (long)decoded->first_word);
+    write_int(file, decoded->operand_count);
+    write_int(file, decoded->source_mode);
+    write_int(file, decoded->destination_mode);
+    write_int(file, decoded->source_register);
+    write_int(file, decoded->destination_register);
+    write_int(file, decoded->source_value);
+    write_int(file, decoded->destination_value);
+    write_label(file, pool, decoded->source_label);
+    write_label(file, pool, decoded->destination_label);
+}
+
+/* Writes the precompiled form of a header next to it */
+void save_precompiled_header(const char *headerPath, unsigned long hash, long size,
+                             const StringPool *pool, const HeaderImage *image) {
+    char path[FILENAME_MAX];
+    char temp_path[FILENAME_MAX];
+    FILE *file;
+    const HeaderMacro *macro;
+    int i, j;
+
+    if (!precompiled_path(headerPath, path) || strlen(path) + 48 >= FILENAME_MAX) {
+        return;
+    }
+
+    /* Written under a temporary name and renamed, so readers never see half a file.
+       The name is told apart by the process and the image, so builds and
+       contexts saving the same header at the same time do not write into
+       one file. */
+    strcpy(temp_path, path);
+    sprintf(temp_path + strlen(temp_path), ".%ld.%lx.tmp", (long)getpid(), (unsigned long)image);
+    file = fopen(temp_path, "wb");
+    if (!file) {
+        return;
+    }
+
+    fwrite(precompiled_magic, 1, sizeof(precompiled_magic), file);
+    write_long(file, (long)hash);
+    write_long(file, size);
+
+    write_int(file, image->externCount);
+    for (i = 0; i < image->externCount; i++) {
+        write_label(file, pool, image->externs[i]);
+    }
+
+    write_int(file, image->macroCount);
+    for (i = 0; i < image->macroCount; i++) {
+        macro = &image->macros[i];
+        write_string(file, macro->name, (long)strlen(macro->name));
+        write_string(file, macro->body, macro->bodyLength);
+        write_int(file, macro->lineCount);
+        for (j = 0; j < macro->lineCount; j++) {
+            write_macro_line(file, pool, &macro->lines[j]);
+        }
+    }
+
+    /* A partly written file would only be rejected on load; drop it now */
+    if (ferror(file)) {
+        fclose(file);
+        remove(temp_path);
+        return;
+    }
+    if (fclose(file) != 0 || rename(temp_path, path) != 0) {
+        remove(temp_path);
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef PRECOMPILED_H
+#define PRECOMPILED_H
+
+#include "arena.h"
+#include "intern.h"
+#include "pre_prossecor.h"
+
+/* Extension of the precompiled form, written next to the included file */
+#define PRECOMPILED_EXTENSION ".pch"
+
+/* A macro defined by an included header */
+typedef struct {
+    const char *name;                 /* Macro name */
+    const char *body;                 /* Body text, lines kept with '\n' */
+    long bodyLength;                  /* Number of characters in the body */
+    int lineCount;                    /* Number of body lines */
+    const MacroLine *lines;           /* Pre-decoded body lines */
+} HeaderMacro;
+
+/* An included header after pre-processing: what it declares, nothing to expand */
+typedef struct {
+    int externCount;
+    StringId *externs;                /* Names declared with .extern */
+    int macroCount;
+    HeaderMacro *macros;              /* Macros defined with mcro/mcroend */
+} HeaderImage;
+
+/* Loads the precompiled form of a header if it was built from content with
+   the same hash and size. Memory comes from the arena and labels are interned
+   in the pool.
+   Returns 1 on a hit, 0 if the header has to be parsed. */
+int load_precompiled_header(const char *headerPath, unsigned long hash, long size,
+                            Arena *arena, StringPool *pool, HeaderImage *image);
+
+/* Writes the precompiled form of a parsed header.
+   Failing to write it is not an error: the header is parsed again next time. */
+void save_precompiled_header(const char *headerPath, unsigned long hash, long size,
+                             const StringPool *pool, const HeaderImage *image);
+
+#endif /* PRECOMPILED_H */
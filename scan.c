@@ -0,0 +1,219 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <string.h>
+#include <pthread.h>
+#include "scan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+/* All bits of a block mask */
+#define BLOCK_BITS 0xFFFFFFFFUL
+
+/* Portable classifier, one byte at a time */
+static void classify_scalar(const unsigned char *text, unsigned long *masks) {
+    int i;
+
+    memset(masks, 0, SCAN_CLASSES * sizeof(unsigned long));
+    for (i = 0; i < SCAN_BLOCK; i++) {
+        unsigned long bit = 1UL << i;
+
+        switch (text[i]) {
+            case '\n':
+                masks[0] |= bit;
+                masks[1] |= bit;
+                break;
+            case ' ': case '\t': case '\v': case '\f': case '\r':
+                masks[1] |= bit;
+                break;
+            case ',':
+                masks[2] |= bit;
+                break;
+            case ':':
+                masks[3] |= bit;
+                break;
+            case ';':
+                masks[4] |= bit;
+                break;
+            case '#':
+                masks[5] |= bit;
+                break;
+            case '&':
+                masks[6] |= bit;
+                break;
+            case '"':
+                masks[7] |= bit;
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+#ifdef SCAN_X86
+
+/* Same classes with SSE2, 16 bytes per compare */
+__attribute__((target("sse2")))
+static void classify_sse2(const unsigned char *text, unsigned long *masks) {
+    static const char marks[SCAN_CLASSES] = {'\n', 0, ',', ':', ';', '#', '&', '"'};
+    int half, c;
+
+    memset(masks, 0, SCAN_CLASSES * sizeof(unsigned long));
+    for (half = 0; half < 2; half++) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(text + half * 16));
+        /* White space is ' ' or '\t'..'\r': (byte - '\t') <= 4 unsigned */
+        __m128i shifted = _mm_sub_epi8(bytes, _mm_set1_epi8('\t'));
+        __m128i control = _mm_cmpeq_epi8(_mm_min_epu8(shifted, _mm_set1_epi8(4)), shifted);
+        __m128i space = _mm_or_si128(control, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')));
+
+        masks[1] |= (unsigned long)(_mm_movemask_epi8(space) & 0xFFFF) << (half * 16);
+        for (c = 0; c < SCAN_CLASSES; c++) {
+            if (c != 1) {
+                __m128i hit = _mm_cmpeq_epi8(bytes, _mm_set1_epi8(marks[c]));
+                masks[c] |= (unsigned long)(_mm_movemask_epi8(hit) & 0xFFFF) << (half * 16);
+            }
+        }
+    }
+}
+
+/* Same classes with AVX2, the whole block per compare */
+__attribute__((target("avx2")))
+static void classify_avx2(const unsigned char *text, unsigned long *masks) {
+    static const char marks[SCAN_CLASSES] = {'\n', 0, ',', ':', ';', '#', '&', '"'};
+    __m256i bytes = _mm256_loadu_si256((const __m256i *)text);
+    __m256i shifted = _mm256_sub_epi8(bytes, _mm256_set1_epi8('\t'));
+    __m256i control = _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, _mm256_set1_epi8(4)), shifted);
+    __m256i space = _mm256_or_si256(control, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' ')));
+    int c;
+
+    masks[1] = (unsigned long)(unsigned int)_mm256_movemask_epi8(space);
+    for (c = 0; c < SCAN_CLASSES; c++) {
+        if (c != 1) {
+            __m256i hit = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(marks[c]));
+            masks[c] = (unsigned long)(unsigned int)_mm256_movemask_epi8(hit);
+        }
+    }
+}
+
+#endif /* SCAN_X86 */
+
+/* The classifier for this CPU and its name, picked once (pthread_once,
+   so scanners of different threads may start at the same time) */
+static BlockClassifier chosen_classifier = classify_scalar;
+static const char *chosen_name = "scalar";
+static pthread_once_t classifier_once = PTHREAD_ONCE_INIT;
+
+static void choose_classifier(void) {
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        chosen_name = "avx2";
+        chosen_classifier = classify_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        chosen_name = "sse2";
+        chosen_classifier = classify_sse2;
+    }
+#endif
+}
+
+const char *scan_backend(void) {
+    pthread_once(&classifier_once, choose_classifier);
+    return chosen_name;
+}
+
+void scanner_init(Scanner *scanner, const char *data, long size) {
+    pthread_once(&classifier_once, choose_classifier);
+    scanner->classify = chosen_classifier;
+    scanner->data = data;
+    scanner->size = size;
+    scanner->block = -1;
+}
+
+/* Makes the block holding offset the cached one */
+static void load_block(Scanner *scanner, long offset) {
+    long start = offset - offset % SCAN_BLOCK;
+    unsigned char tail[SCAN_BLOCK];
+
+    if (scanner->block == start) {
+        return;
+    }
+    if (start + SCAN_BLOCK <= scanner->size) {
+        scanner->classify((const unsigned char *)scanner->data + start, scanner->masks);
+    } else {
+        /* The last block is padded with bytes of no class, so nothing is
+           read past the end of the buffer (which may end a mapped page) */
+        memset(tail, 0, SCAN_BLOCK);
+        memcpy(tail, scanner->data + start, scanner->size - start);
+        scanner->classify(tail, scanner->masks);
+    }
+    scanner->block = start;
+}
+
+/* Returns the union of the selected class masks of the cached block */
+static unsigned long block_mask(const Scanner *scanner, unsigned int classes) {
+    unsigned long mask = 0;
+    int c;
+
+    for (c = 0; c < SCAN_CLASSES; c++) {
+        if (classes & (1u << c)) {
+            mask |= scanner->masks[c];
+        }
+    }
+    return mask;
+}
+
+/* Index of the lowest set bit of a non-zero mask */
+static int lowest_bit(unsigned long mask) {
+#ifdef __GNUC__
+    return __builtin_ctzl(mask);
+#else
+    int i = 0;
+
+    while (!(mask & 1UL)) {
+        mask >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+/* Shared walk of scan_find and scan_skip; invert selects the bytes outside the classes */
+static long scan(Scanner *scanner, long from, long to, unsigned int classes, int invert) {
+    unsigned long mask;
+    long offset;
+
+    if (to > scanner->size) {
+        to = scanner->size;
+    }
+    while (from < to) {
+        load_block(scanner, from);
+        mask = block_mask(scanner, classes);
+        if (invert) {
+            mask = ~mask & BLOCK_BITS;
+        }
+        mask >>= from - scanner->block;
+        if (mask != 0) {
+            offset = from + lowest_bit(mask);
+            return offset < to ? offset : to;
+        }
+        from = scanner->block + SCAN_BLOCK;
+    }
+    return to;
+}
+
+long scan_find(Scanner *scanner, long from, long to, unsigned int classes) {
+    return scan(scanner, from, to, classes, 0);
+}
+
+long scan_skip(Scanner *scanner, long from, long to, unsigned int classes) {
+    return scan(scanner, from, to, classes, 1);
+}
+
+long scan_line_end(Scanner *scanner, long from, long max_length) {
+    long limit = (max_length < scanner->size - from) ? from + max_length : scanner->size;
+    long newline = scan_find(scanner, from, limit, SCAN_NEWLINE);
+
+    return newline < limit ? newline + 1 : limit;
+}
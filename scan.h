@@ -0,0 +1,51 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+/* Character classes the scanner marks, one bit per class */
+#define SCAN_NEWLINE   0x01           /* '\n' */
+#define SCAN_SPACE     0x02           /* White space, '\n' included */
+#define SCAN_COMMA     0x04
+#define SCAN_COLON     0x08
+#define SCAN_SEMICOLON 0x10
+#define SCAN_HASH      0x20
+#define SCAN_AMPERSAND 0x40
+#define SCAN_QUOTE     0x80
+#define SCAN_CLASSES   8
+
+/* Bytes classified at a time; bit i of a mask stands for byte i of a block */
+#define SCAN_BLOCK 32
+
+/* Classifies SCAN_BLOCK bytes into one mask per class */
+typedef void (*BlockClassifier)(const unsigned char *text, unsigned long *masks);
+
+/* Walks a buffer block by block, keeping the class masks of the current
+   block. The masks are computed with AVX2 or SSE2 when the CPU has them
+   (chosen once, at run time) and byte by byte otherwise. A scanner holds
+   all of its state, so any number of them can run at once. */
+typedef struct {
+    const char *data;                 /* Scanned buffer */
+    long size;                        /* Its size in bytes */
+    long block;                       /* Start offset of the cached block, or -1 */
+    unsigned long masks[SCAN_CLASSES];/* Class masks of the cached block */
+    BlockClassifier classify;         /* Classifier picked for this CPU */
+} Scanner;
+
+/* Starts scanning a buffer (nothing is classified until asked for) */
+void scanner_init(Scanner *scanner, const char *data, long size);
+
+/* Returns the offset of the first byte in [from, to) that belongs to one
+   of the classes, or to if there is none */
+long scan_find(Scanner *scanner, long from, long to, unsigned int classes);
+
+/* Returns the offset of the first byte in [from, to) that belongs to none
+   of the classes, or to if there is none */
+long scan_skip(Scanner *scanner, long from, long to, unsigned int classes);
+
+/* Returns the end of the line starting at from: just past its '\n', or at
+   most max_length bytes on (like fgets) */
+long scan_line_end(Scanner *scanner, long from, long max_length);
+
+/* Returns the name of the block classifier in use ("avx2", "sse2", "scalar") */
+const char *scan_backend(void);
+
+#endif /* SCAN_H */
@@ -0,0 +1,347 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "scheduler.h"
+
+/* Sources read ahead of each worker's queue head */
+#define READ_AHEAD 2
+
+/* Files waiting for one worker, largest first. The owner and thieves
+   both take from the head, so the largest file left is always next. */
+typedef struct {
+    AsmJob **items;
+    int head;
+    int tail;
+    pthread_mutex_t lock;
+} JobQueue;
+
+/* State shared by the workers of one run */
+typedef struct {
+    JobQueue *queues;
+    int queue_count;
+    IoEngine *io;
+    pthread_mutex_t done_lock;        /* Guards AsmJob.done */
+    pthread_cond_t done_changed;
+} Scheduler;
+
+/* What one worker thread is given */
+typedef struct {
+    Scheduler *scheduler;
+    int index;                        /* Its own queue */
+} Worker;
+
+/* Size of a file, or 0 if it cannot be read (reported when assembled) */
+static long file_size(const char *path) {
+    struct stat info;
+    return stat(path, &info) == 0 ? (long)info.st_size : 0;
+}
+
+/* Largest first; equal sizes keep argument order */
+static int compare_jobs(const void *a, const void *b) {
+    const AsmJob *left = *(AsmJob * const *)a;
+    const AsmJob *right = *(AsmJob * const *)b;
+
+    if (left->size != right->size) {
+        return left->size > right->size ? -1 : 1;
+    }
+    return left < right ? -1 : (left > right);
+}
+
+/* Queues the read of a job's source unless it is queued already
+   (called with the lock of the job's queue held) */
+static void queue_read(IoEngine *io, AsmJob *job) {
+    if (job->input_queued || (job->options & ASM_STREAM)) {
+        return;
+    }
+    io_prepare(&job->input, IO_READ, job->path, NULL, 0);
+    io_submit(io, &job->input);
+    job->input_queued = 1;
+}
+
+/* Queues the reads of the next files of a queue (lock held) */
+static void read_ahead(IoEngine *io, JobQueue *queue) {
+    int i;
+
+    for (i = queue->head; i < queue->tail && i < queue->head + READ_AHEAD; i++) {
+        queue_read(io, queue->items[i]);
+    }
+}
+
+/* Takes the next file of a queue, or NULL if it is empty */
+static AsmJob *take_job(IoEngine *io, JobQueue *queue) {
+    AsmJob *job = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->head < queue->tail) {
+        job = queue->items[queue->head++];
+        queue_read(io, job);
+        read_ahead(io, queue);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return job;
+}
+
+/* Takes a file from the worker's own queue, or steals one from the others.
+   No files are added during a run, so NULL means all are taken. */
+static AsmJob *next_job(Scheduler *scheduler, int self) {
+    AsmJob *job = take_job(scheduler->io, &scheduler->queues[self]);
+    int i;
+
+    for (i = 1; job == NULL && i < scheduler->queue_count; i++) {
+        job = take_job(scheduler->io, &scheduler->queues[(self + i) % scheduler->queue_count]);
+    }
+    return job;
+}
+
+/* Moves what a file's diagnostics stream holds into its job */
+static void keep_messages(FILE *stream, AsmJob *job) {
+    char buffer[4096];
+    size_t length;
+
+    rewind(stream);
+    while ((length = fread(buffer, 1, sizeof(buffer), stream)) > 0) {
+        output_bytes(&job->messages, buffer, (long)length);
+    }
+    fclose(stream);
+}
+
+/* Queues the writes of the outputs an assembly produced. The outputs are
+   named like asm_assemble_file names them; the engine frees the copies. */
+static void queue_writes(IoEngine *io, AsmJob *job, const AsmResult *result) {
+    const AsmBuffer *buffers[JOB_OUTPUTS];
+    static const char *const extensions[JOB_OUTPUTS] = {".am", ".ob", ".ent", ".ext", ".obx", ".obz"};
+    const char *dot = strstr(job->path, ".as");
+    size_t base = dot ? (size_t)(dot - job->path) : strlen(job->path);
+    char *path;
+    char *copy;
+    int k;
+
+    buffers[0] = &result->expanded;
+    buffers[1] = &result->object;
+    buffers[2] = &result->entries;
+    buffers[3] = &result->externals;
+    buffers[4] = &result->binary;
+    buffers[5] = &result->compressed;
+
+    job->output_count = 0;
+    for (k = 0; k < JOB_OUTPUTS; k++) {
+        if (buffers[k]->data == NULL) {
+            continue;
+        }
+        path = malloc(base + strlen(extensions[k]) + 1);
+        copy = malloc(buffers[k]->length + 1);
+        if (path == NULL || copy == NULL) {
+            fprintf(stderr, "Failed to allocate memory for assembler output\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(path, job->path, base);
+        strcpy(path + base, extensions[k]);
+        memcpy(copy, buffers[k]->data, buffers[k]->length);
+
+        job->output_paths[job->output_count] = path;
+        io_prepare(&job->outputs[job->output_count], IO_WRITE, path, copy, buffers[k]->length);
+        job->outputs[job->output_count].free_data = 1;
+        io_submit(io, &job->outputs[job->output_count]);
+        job->output_count++;
+    }
+}
+
+/* Assembles one file: from memory through the I/O engine, or straight
+   from and to files in streaming mode */
+static void assemble_job(AsmContext *ctx, IoEngine *io, AsmJob *job) {
+    AsmResult result;
+
+    if (job->options & ASM_STREAM) {
+        job->errors = asm_assemble_file(ctx, job->path);
+        return;
+    }
+
+    io_wait(io, &job->input);
+    if (job->input.status != 0) {
+        job->errors = -1;
+        return;
+    }
+    job->errors = asm_assemble(ctx, job->path, job->input.data, job->input.length, &result);
+    free(job->input.data);
+    job->input.data = NULL;
+    queue_writes(io, job, &result);
+}
+
+/* Copies the paths of the files the assembly read through .include */
+static void keep_includes(AsmContext *ctx, AsmJob *job) {
+    int i;
+
+    job->include_count = asm_include_count(ctx);
+    job->includes = malloc((job->include_count + 1) * sizeof(char *));
+    if (job->includes == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the include list\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < job->include_count; i++) {
+        job->includes[i] = malloc(strlen(asm_include_path(ctx, i)) + 1);
+        if (job->includes[i] == NULL) {
+            fprintf(stderr, "Failed to allocate memory for the include list\n");
+            exit(EXIT_FAILURE);
+        }
+        strcpy(job->includes[i], asm_include_path(ctx, i));
+    }
+}
+
+/* Waits for the writes of a job, adding a message and an error for each
+   that failed */
+static void wait_writes(IoEngine *io, AsmJob *job) {
+    char message[FILENAME_MAX + 100];
+    int k;
+
+    for (k = 0; k < job->output_count; k++) {
+        io_wait(io, &job->outputs[k]);
+        if (job->outputs[k].status != 0) {
+            sprintf(message, "Error: Cannot write %.*s: %.40s\n", FILENAME_MAX,
+                    job->output_paths[k], strerror(job->outputs[k].status));
+            output_string(&job->messages, message);
+            job->errors++;
+        }
+        free(job->output_paths[k]);
+    }
+    job->output_count = 0;
+}
+
+static void *worker_main(void *arg) {
+    Worker *worker = arg;
+    Scheduler *scheduler = worker->scheduler;
+    AsmContext *ctx = asm_create();
+    AsmJob *job;
+    FILE *stream;
+
+    while ((job = next_job(scheduler, worker->index)) != NULL) {
+        /* Messages go to a temporary file while the file is assembled */
+        output_open(&job->messages, NULL);
+        stream = tmpfile();
+        asm_set_diagnostics(ctx, stream);
+        asm_set_options(ctx, job->options);
+        asm_set_threads(ctx, job->threads);
+        assemble_job(ctx, scheduler->io, job);
+        keep_includes(ctx, job);
+        if (stream != NULL) {
+            keep_messages(stream, job);
+        }
+
+        pthread_mutex_lock(&scheduler->done_lock);
+        job->done = 1;
+        pthread_cond_broadcast(&scheduler->done_changed);
+        pthread_mutex_unlock(&scheduler->done_lock);
+    }
+
+    asm_destroy(ctx);
+    return NULL;
+}
+
+void run_jobs(AsmJob *jobs, int job_count, int thread_count, JobReport report) {
+    Scheduler scheduler;
+    Worker *workers;
+    pthread_t *threads;
+    AsmJob **order;
+    int order_count = 0;
+    int i;
+
+    for (i = 0; i < job_count; i++) {
+        jobs[i].done = jobs[i].cached;
+        jobs[i].input_queued = 0;
+        jobs[i].output_count = 0;
+        jobs[i].includes = NULL;
+        jobs[i].include_count = 0;
+        if (!jobs[i].cached) {
+            jobs[i].size = file_size(jobs[i].path);
+            order_count++;
+        }
+    }
+
+    if (thread_count > order_count) {
+        thread_count = order_count;
+    }
+    if (thread_count < 1) {
+        thread_count = 1;
+    }
+
+    order = malloc((job_count + 1) * sizeof(AsmJob *));
+    scheduler.queues = malloc(thread_count * sizeof(JobQueue));
+    workers = malloc(thread_count * sizeof(Worker));
+    threads = malloc(thread_count * sizeof(pthread_t));
+    if (order == NULL || scheduler.queues == NULL || workers == NULL || threads == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the job scheduler\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Deal the files out largest first, so every queue starts with a big one */
+    for (i = 0, order_count = 0; i < job_count; i++) {
+        if (!jobs[i].cached) {
+            order[order_count++] = &jobs[i];
+        }
+    }
+    qsort(order, order_count, sizeof(AsmJob *), compare_jobs);
+
+    scheduler.queue_count = thread_count;
+    for (i = 0; i < thread_count; i++) {
+        scheduler.queues[i].items = malloc((order_count / thread_count + 1) * sizeof(AsmJob *));
+        if (scheduler.queues[i].items == NULL) {
+            fprintf(stderr, "Failed to allocate memory for the job scheduler\n");
+            exit(EXIT_FAILURE);
+        }
+        scheduler.queues[i].head = 0;
+        scheduler.queues[i].tail = 0;
+        pthread_mutex_init(&scheduler.queues[i].lock, NULL);
+    }
+    for (i = 0; i < order_count; i++) {
+        JobQueue *queue = &scheduler.queues[i % thread_count];
+        queue->items[queue->tail++] = order[i];
+    }
+    pthread_mutex_init(&scheduler.done_lock, NULL);
+    pthread_cond_init(&scheduler.done_changed, NULL);
+
+    /* Start reading the first files of every queue */
+    scheduler.io = io_create(thread_count);
+    for (i = 0; i < thread_count; i++) {
+        read_ahead(scheduler.io, &scheduler.queues[i]);
+    }
+
+    for (i = 0; i < thread_count; i++) {
+        workers[i].scheduler = &scheduler;
+        workers[i].index = i;
+        if (pthread_create(&threads[i], NULL, worker_main, &workers[i]) != 0) {
+            fprintf(stderr, "Error: Cannot start worker thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Report in argument order as soon as each file is done */
+    for (i = 0; i < job_count; i++) {
+        pthread_mutex_lock(&scheduler.done_lock);
+        while (!jobs[i].done) {
+            pthread_cond_wait(&scheduler.done_changed, &scheduler.done_lock);
+        }
+        pthread_mutex_unlock(&scheduler.done_lock);
+        wait_writes(scheduler.io, &jobs[i]);
+        report(&jobs[i]);
+    }
+
+    /* Every worker may still look into every queue until it exits */
+    for (i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    io_destroy(scheduler.io);
+    for (i = 0; i < thread_count; i++) {
+        pthread_mutex_destroy(&scheduler.queues[i].lock);
+        free(scheduler.queues[i].items);
+    }
+    pthread_mutex_destroy(&scheduler.done_lock);
+    pthread_cond_destroy(&scheduler.done_changed);
+    free(threads);
+    free(workers);
+    free(scheduler.queues);
+    free(order);
+}
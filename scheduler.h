@@ -0,0 +1,45 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "asm.h"
+#include "output.h"
+#include "io_engine.h"
+
+/* Outputs a file can have: .am, .ob, .ent, .ext, .obx, .obz */
+#define JOB_OUTPUTS 6
+
+/* One input file of a parallel run (-j) */
+typedef struct {
+    const char *path;                 /* Input file (.as) */
+    unsigned int options;             /* ASM_* options given before it */
+    int threads;                      /* Threads the file itself may use */
+    long size;                        /* Size in bytes, for largest-first order */
+    int errors;                       /* Result of asm_assemble_file (-1 = not found) */
+    Output messages;                  /* Its diagnostics, kept until reported */
+    int done;                         /* Set once the file is assembled */
+    IoRequest input;                  /* Read of the source, queued ahead of time */
+    int input_queued;                 /* Set once the read is queued */
+    IoRequest outputs[JOB_OUTPUTS];   /* Writes of the outputs it produced */
+    char *output_paths[JOB_OUTPUTS];
+    int output_count;
+    int cached;                       /* Set by the caller: outputs already in place */
+    char **includes;                  /* Files read through .include (caller frees) */
+    int include_count;
+} AsmJob;
+
+/* Called for each job, in job order, once it and all jobs before it are done */
+typedef void (*JobReport)(AsmJob *job);
+
+/* Assembles the jobs on thread_count worker threads, each with its own
+   context. The files are handed out largest first; a worker that runs out
+   of files steals the largest one left to another worker. Sources are
+   read ahead and outputs written behind through the I/O engine (see
+   io_engine.h), so a worker only waits for I/O when it runs ahead of it;
+   streaming jobs (ASM_STREAM) read and write their files directly.
+   The diagnostics of each file are buffered, and report is called in job
+   order on the calling thread once its outputs are written, so the output
+   does not depend on the scheduling. Cached jobs are not assembled; they
+   are only reported. */
+void run_jobs(AsmJob *jobs, int job_count, int thread_count, JobReport report);
+
+#endif /* SCHEDULER_H */
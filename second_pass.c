@@ -1,109 +1,347 @@
+#include <errno.h>
 #include "pre_prossecor.h"
 #include "table.h"
 #include "util.h"
 #include "second_pass.h"
+#include "context.h"
+#include "parallel.h"
+
+/* Programs with at least this many pending words resolve them in parallel */
+#define PARALLEL_PENDING_WORDS 65536
+
+/* A share of the pending words, resolved on one thread. The extern uses
+   and failed patches it finds are recorded in order once all are done. */
+typedef struct {
+    int first;
+    int count;
+    int *extern_uses;                 /* Pending words that use an extern */
+    int extern_count;
+    int *failures;                    /* Pending words that could not be patched */
+    int failure_count;
+} FixupPart;
+
+/* What the threads of a parallel fixup share */
+typedef struct {
+    AsmContext *ctx;
+    PendingWord *words;
+    FixupPart *parts;
+} Fixup;
 
 /* Helper function to encode a data word into 24-bit binary */
 unsigned int encode_data_word(DataWord dw);
 
+static unsigned int encode_label_word(const AsmContext *ctx, StringId name, int usage_ic,
+                                      AddressingMode mode, int *is_extern);
+static unsigned int encode_label_value(int label_addr, int is_extern, int usage_ic, AddressingMode mode);
+static void update_data_words_parallel(AsmContext *ctx);
+
+/* Opens one output of the context; returns 0 with an error if its file
+   cannot be created */
+static int open_output(AsmContext *ctx, Output *out, const char *extension, const char *what) {
+    errno = 0;
+    if (open_context_output(ctx, out, extension)) {
+        return 1;
+    }
+    fprintf(ctx->diagnostics, "%s %s%s: %s\n", what, ctx->baseName, extension,
+            errno ? strerror(errno) : "File name too long");
+    return 0;
+}
+
 /* Second pass:
    - Updates entry and data addresses
    - Finalizes object image
-   - Writes .ob, .ent, .ext files */
-void second_pass(const char *filename, int IC, int DC) {
-    char base_name[MAX_NAME_FILE];
-    char *dot = strstr(filename, ".am");
-
-    if (dot) {
-        *dot = '\0';
-    }
+   - Writes the .ob, .ent, .ext (and .obx) outputs of the context
+   Returns the number of errors (outputs that could not be created) */
+int second_pass(AsmContext *ctx, int IC, int DC) {
+    int errors = 0;
 
     /* Update addresses in the entry table based on the symbol table */
-    update_entry_addresses();
+    update_entry_addresses(ctx);
 
-    /* Resolve all pending operand words (with labels) */
-    update_data_words();
+    /* Resolve all pending operand words (with labels); in one-pass mode
+       only the uses still open at the end of the file are left */
+    if (is_one_pass(ctx)) {
+        if (!resolve_open_uses(ctx)) {
+            return 1;
+        }
+    } else {
+        update_data_words(ctx);
+    }
 
-    /* Write final object file */
-    strcpy(base_name, filename);
-    strcat(base_name, ".ob");
-    write_object_file(base_name, IC - MEMORY_START, DC);
+    /* Write final object file, compressed (.obz) instead if asked; a
+       streamed image is only ever written as text */
+    if ((ctx->options & ASM_WRITE_COMPRESSED) && !is_streaming(ctx)) {
+        if (open_output(ctx, &ctx->compressed, ".obz", "Error opening compressed object file")) {
+            write_compressed_file(ctx, &ctx->compressed, IC - MEMORY_START, DC);
+            output_close(&ctx->compressed);
+        } else {
+            errors++;
+        }
+    } else if (open_output(ctx, &ctx->object, ".ob", "Error opening object file")) {
+        write_object_file(ctx, &ctx->object, IC - MEMORY_START, DC);
+        output_close(&ctx->object);
+    } else {
+        errors++;
+    }
 
     /* Write .ent file (entry symbols) */
-    strcpy(base_name, filename);
-    strcat(base_name, ".ent");
-    write_entries_file(base_name);
+    if (open_output(ctx, &ctx->entries, ".ent", "Error opening entries file")) {
+        write_entries_file(ctx, &ctx->entries);
+        output_close(&ctx->entries);
+    } else {
+        errors++;
+    }
 
     /* Write .ext file (external symbols used) */
-    strcpy(base_name, filename);
-    strcat(base_name, ".ext");
-    write_externals_file(base_name);
+    if (open_output(ctx, &ctx->externals, ".ext", "Error opening externals file")) {
+        write_externals_file(ctx, &ctx->externals);
+        output_close(&ctx->externals);
+    } else {
+        errors++;
+    }
+
+    /* Write the binary object file (.obx) if asked; a streamed image is
+       not in memory, so it has none */
+    if ((ctx->options & ASM_WRITE_BINARY) && !is_streaming(ctx)) {
+        if (open_output(ctx, &ctx->binary, ".obx", "Error opening binary object file")) {
+            write_binary_file(ctx, &ctx->binary, IC - MEMORY_START, DC);
+            output_close(&ctx->binary);
+        } else {
+            errors++;
+        }
+    }
+    return errors;
 }
 
 /* Updates entry table with actual addresses from the symbol table */
-void update_entry_addresses(void) {
-    int i, j;
-    Symbol *symbols = get_symbol_table();
-    int scount = get_symbol_count();
-    Entry *entries = get_entry_table();
-    int ecount = get_entry_count();
+void update_entry_addresses(AsmContext *ctx) {
+    int i;
+    Entry *entries = get_entry_table(ctx);
+    int ecount = get_entry_count(ctx);
 
     for (i = 0; i < ecount; i++) {
-        for (j = 0; j < scount; j++) {
-            if (!strcmp(entries[i].label, symbols[j].label)) {
-                entries[i].address = symbols[j].address;
-                break;
-            }
-        }
+        entries[i].address = resolve_symbol_id(ctx, entries[i].name);
+        set_symbol_flags(ctx, entries[i].name, SYMBOL_ENTRY);
     }
 }
 
 /* Fills in pending operand words (that depended on labels) */
-void update_data_words(void) {
+void update_data_words(AsmContext *ctx) {
     int i;
-    PendingWord *pw = get_pending_words();
-    int pw_count = get_pending_count();
-    Object *objects = get_object_table();
-    int obj_count = get_object_count();
+    PendingWord *pw = get_pending_words(ctx);
+    int pw_count = get_pending_count(ctx);
+
+    /* The symbol table is final, so large programs can split the work */
+    if (ctx->threads > 1 && !is_streaming(ctx) && pw_count >= PARALLEL_PENDING_WORDS) {
+        update_data_words_parallel(ctx);
+        return;
+    }
 
     for (i = 0; i < pw_count; i++) {
-        const char *label = pw[i].label;
-        int usage_ic = pw[i].address;
-        AddressingMode mode = pw[i].mode;
-        int label_addr = resolve_direct_address(label);
-        DataWord dw = {0};
-
-        if (mode == RELATIVE) {
-            /* Calculate relative distance from instruction */
-            int distance = label_addr - (usage_ic + 1);
-            if (distance < 0) {
-                distance = (1 << 21) + distance;
+        unsigned int word = resolve_label_word(ctx, pw[i].name, pw[i].address, pw[i].mode);
+
+        /* Write the encoded value straight into its image slot */
+        if (!patch_pending(ctx, &pw[i], word)) {
+            fprintf(ctx->diagnostics, "Error: usage_ic %d out of range\n", pw[i].address);
+        }
+    }
+}
+
+/* Resolves one share of the pending words (see update_data_words_parallel).
+   Only reads the tables, apart from the pending words' own image slots. */
+static void resolve_fixup_part(void *arg, int index) {
+    Fixup *fixup = arg;
+    FixupPart *part = &fixup->parts[index];
+    PendingWord *pw;
+    unsigned int word;
+    int is_extern;
+    int i;
+
+    part->extern_uses = malloc((part->count + 1) * sizeof(int));
+    part->failures = malloc((part->count + 1) * sizeof(int));
+    if (part->extern_uses == NULL || part->failures == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the second pass\n");
+        exit(EXIT_FAILURE);
+    }
+    part->extern_count = 0;
+    part->failure_count = 0;
+
+    for (i = part->first; i < part->first + part->count; i++) {
+        pw = &fixup->words[i];
+        word = encode_label_word(fixup->ctx, pw->name, pw->address, pw->mode, &is_extern);
+        if (is_extern) {
+            part->extern_uses[part->extern_count++] = i;
+        }
+        if (!patch_pending(fixup->ctx, pw, word)) {
+            part->failures[part->failure_count++] = i;
+        }
+    }
+}
+
+/* Fills in the pending words on ctx->threads threads, each taking an equal
+   share. Extern uses are added to the extern table afterwards, share by
+   share, so the .ext file lists them in the same order as one thread. */
+static void update_data_words_parallel(AsmContext *ctx) {
+    Fixup fixup;
+    FixupPart *part;
+    int pw_count = get_pending_count(ctx);
+    int i, j;
+
+    fixup.ctx = ctx;
+    fixup.words = get_pending_words(ctx);
+    fixup.parts = malloc(ctx->threads * sizeof(FixupPart));
+    if (fixup.parts == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the second pass\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < ctx->threads; i++) {
+        fixup.parts[i].first = (int)((long)pw_count * i / ctx->threads);
+        fixup.parts[i].count = (int)((long)pw_count * (i + 1) / ctx->threads) - fixup.parts[i].first;
+    }
+
+    run_parallel(ctx->threads, resolve_fixup_part, &fixup);
+
+    for (i = 0; i < ctx->threads; i++) {
+        part = &fixup.parts[i];
+        for (j = 0; j < part->extern_count; j++) {
+            add_extern_usage(ctx, fixup.words[part->extern_uses[j]].name,
+                             fixup.words[part->extern_uses[j]].address);
+        }
+        for (j = 0; j < part->failure_count; j++) {
+            fprintf(ctx->diagnostics, "Error: usage_ic %d out of range\n",
+                    fixup.words[part->failures[j]].address);
+        }
+        free(part->extern_uses);
+        free(part->failures);
+    }
+    free(fixup.parts);
+}
+
+/* Orders pending word indexes (for resolve_open_uses) */
+static int compare_indexes(const void *a, const void *b) {
+    int left = *(const int *)a;
+    int right = *(const int *)b;
+
+    return (left > right) - (left < right);
+}
+
+/* One-pass mode: fills in the uses of a label seen before its definition.
+   A label declared .extern is left to resolve_open_uses. */
+void backpatch_label(AsmContext *ctx, StringId name) {
+    PendingWord *pw = get_pending_words(ctx);
+    int label_addr;
+    int i;
+
+    if (is_external_id(ctx, name)) {
+        return;
+    }
+    label_addr = resolve_symbol_id(ctx, name);
+    for (i = get_label_uses(ctx, name); i != -1; i = pw[i].next) {
+        patch_pending(ctx, &pw[i], encode_label_value(label_addr, 0, pw[i].address, pw[i].mode));
+    }
+}
+
+/* One-pass mode: fills in the uses of labels that are undefined or
+   external at the end of the file. Their words are encoded in address
+   order, like update_data_words, so the .ext file lists them the same way.
+   (A label that was defined and then declared .extern is encoded again.)
+   Returns 0 with an error if there is no memory to sort them. */
+int resolve_open_uses(AsmContext *ctx) {
+    PendingWord *pw = get_pending_words(ctx);
+    int string_count = get_string_count(&ctx->strings);
+    int *open = NULL;
+    int *grown;
+    int open_count = 0;
+    int open_capacity = 0;
+    StringId name;
+    unsigned int word;
+    int i;
+
+    for (name = 0; (int)name < string_count; name++) {
+        if (get_label_uses(ctx, name) == -1 ||
+            (!is_external_id(ctx, name) && resolve_symbol_id(ctx, name) != -1)) {
+            continue;
+        }
+        for (i = get_label_uses(ctx, name); i != -1; i = pw[i].next) {
+            if (open_count == open_capacity) {
+                open_capacity = open_capacity ? open_capacity * 2 : 64;
+                grown = realloc(open, open_capacity * sizeof(int));
+                if (grown == NULL) {
+                    fprintf(ctx->diagnostics, "Error: Not enough memory to resolve label uses\n");
+                    free(open);
+                    return 0;
+                }
+                open = grown;
             }
-            dw.value = distance;
-            dw.A = 1;
-        } else if (is_external_label(label)) {
-            /* External labels get 0 value and E=1 */
-            dw.value = 0;
-            dw.E = 1;
-            add_extern(label, usage_ic);
-        } else {
-            /* Regular label reference (R=1) */
-            dw.value = label_addr & 0x1FFFFF;
-            dw.R = 1;
+            open[open_count++] = i;
         }
+    }
 
-        /* Check bounds and write encoded value to object table */
-        if (usage_ic - MEMORY_START >= 0 && usage_ic - MEMORY_START < obj_count) {
-            unsigned int packed = 0;
-            packed |= (dw.value & 0x1FFFFF) << 3;
-            packed |= (dw.A & 1) << 2;
-            packed |= (dw.R & 1) << 1;
-            packed |= (dw.E & 1);
-            objects[usage_ic - MEMORY_START].value = packed;
-        } else {
-            fprintf(stderr, "Error: usage_ic %d out of range\n", usage_ic);
+    if (open_count > 0) {
+        qsort(open, open_count, sizeof(int), compare_indexes);
+    }
+    for (i = 0; i < open_count; i++) {
+        word = resolve_label_word(ctx, pw[open[i]].name, pw[open[i]].address, pw[open[i]].mode);
+        if (!patch_pending(ctx, &pw[open[i]], word)) {
+            fprintf(ctx->diagnostics, "Error: usage_ic %d out of range\n", pw[open[i]].address);
         }
     }
+    free(open);
+    return 1;
+}
+
+/* Returns 1 if a label use can be encoded before the end of the file:
+   the label is defined, or (direct use) declared with .extern */
+int is_label_known(const AsmContext *ctx, StringId name, AddressingMode mode) {
+    if (mode != RELATIVE && is_external_id(ctx, name)) {
+        return 1;
+    }
+    return resolve_symbol_id(ctx, name) != -1;
+}
+
+/* Encodes the operand word of a label used at usage_ic
+   (an extern use is recorded for the .ext file) */
+unsigned int resolve_label_word(AsmContext *ctx, StringId name, int usage_ic, AddressingMode mode) {
+    int is_extern;
+    unsigned int word = encode_label_word(ctx, name, usage_ic, mode, &is_extern);
+
+    if (is_extern) {
+        add_extern_usage(ctx, name, usage_ic);
+    }
+    return word;
+}
+
+/* Encodes the operand word of a label used at usage_ic without changing
+   any table; *is_extern is set for a use of an extern label */
+static unsigned int encode_label_word(const AsmContext *ctx, StringId name, int usage_ic,
+                                      AddressingMode mode, int *is_extern) {
+    *is_extern = mode != RELATIVE && is_external_id(ctx, name);
+    return encode_label_value(resolve_symbol_id(ctx, name), *is_extern, usage_ic, mode);
+}
+
+/* Encodes the operand word of a use at usage_ic of a label at label_addr
+   (-1 if undefined) */
+static unsigned int encode_label_value(int label_addr, int is_extern, int usage_ic, AddressingMode mode) {
+    DataWord dw = {0};
+
+    if (mode == RELATIVE) {
+        /* Calculate relative distance from instruction */
+        int distance = label_addr - (usage_ic + 1);
+        if (distance < 0) {
+            distance = (1 << 21) + distance;
+        }
+        dw.value = distance;
+        dw.A = 1;
+    } else if (is_extern) {
+        /* External labels get 0 value and E=1 */
+        dw.value = 0;
+        dw.E = 1;
+    } else {
+        /* Regular label reference (R=1) */
+        dw.value = label_addr & 0x1FFFFF;
+        dw.R = 1;
+    }
+    return encode_data_word(dw);
 }
 
 /* Encodes a DataWord struct into a 24-bit integer (used in update_data_words) */
@@ -117,14 +355,14 @@ unsigned int encode_data_word(DataWord dw) {
 }
 
 /* Given a memory address, returns the label that matches it (if any) */
-const char* resolve_label_by_address(int address) {
+const char* resolve_label_by_address(AsmContext *ctx, int address) {
     int i;
-    Symbol *symbols = get_symbol_table();
-    int count = get_symbol_count();
+    Symbol *symbols = get_symbol_table(ctx);
+    int count = get_symbol_count(ctx);
 
     for (i = 0; i < count; i++) {
         if (symbols[i].address == address) {
-            return symbols[i].label;
+            return string_of(&ctx->strings, symbols[i].name);
         }
     }
     return NULL;
@@ -137,17 +375,3 @@ int is_relative_label(const char *operand) {
     }
     return 0;
 }
-
-/* Returns 1 if the label is defined as external */
-int is_external_label(const char *label) {
-    int i;
-    Extern *externs = get_extern_table();
-    int count = get_extern_count();
-
-    for (i = 0; i < count; i++) {
-        if (strcmp(externs[i].symbol, label) == 0) {
-            return 1;
-        }
-    }
-    return 0;
-}
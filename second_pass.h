@@ -1,31 +1,58 @@
 #ifndef SECOND_PASS_H
 #define SECOND_PASS_H
 
+#include "util.h"
+#include "intern.h"
+#include "asm.h"
+
 /* Runs the second pass of the assembler.
  * - Resolves pending words (like labels)
  * - Updates object image
- * - Writes .ob, .ent, .ext output files
+ * - Writes the .ob, .ent, .ext outputs of the context (files next to
+ *   the input, or memory buffers; see asm.h)
  * Parameters:
- *   output_filename_base - name of the file (without .am extension)
  *   IC - final instruction counter
  *   DC - final data counter
+ * Returns the number of errors (outputs that could not be created).
  */
-void second_pass(const char *output_filename_base, int IC, int DC);
+int second_pass(AsmContext *ctx, int IC, int DC);
 
 /* Updates addresses for all entry symbols in the entry table
  * by looking them up in the symbol table.
  */
-void update_entry_addresses(void);
+void update_entry_addresses(AsmContext *ctx);
 
 /* Updates the object table by filling in values for operands
  * that were delayed due to label resolution (e.g., direct, relative).
  */
-void update_data_words(void);
+void update_data_words(AsmContext *ctx);
+
+/* One-pass mode (ASM_ONE_PASS): fills in the uses of a label seen before
+ * it was defined, as soon as it is defined.
+ */
+void backpatch_label(AsmContext *ctx, StringId name);
+
+/* One-pass mode: fills in, in address order, the uses of labels that are
+ * still undefined or external at the end of the file.
+ * Returns 0 (with an error) if it runs out of memory.
+ */
+int resolve_open_uses(AsmContext *ctx);
+
+/* Returns 1 if a use of the label can already be encoded: it is defined,
+ * or declared external (direct addressing only).
+ */
+int is_label_known(const AsmContext *ctx, StringId name, AddressingMode mode);
+
+/* Encodes the operand word for a label used at usage_ic, recording
+ * extern uses. Used by the second pass and, in streaming mode, by the
+ * first pass for labels that are already known.
+ */
+unsigned int resolve_label_word(AsmContext *ctx, StringId name, int usage_ic, AddressingMode mode);
 
 /* Returns the label name that appears at a given address,
  * or NULL if no label has that address.
  */
-const char* resolve_label_by_address(int address);
+const char* resolve_label_by_address(AsmContext *ctx, int address);
 
 /* Checks if a given operand represents a relative label.
  * A relative label starts with '&'.
@@ -33,9 +60,4 @@ const char* resolve_label_by_address(int address);
  */
 int is_relative_label(const char *operand);
 
-/* Checks if a label was declared as external using .extern.
- * Returns 1 if the label is external, 0 otherwise.
- */
-int is_external_label(const char *label);
-
 #endif /* SECOND_PASS_H */
@@ -0,0 +1,94 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "source.h"
+
+/* Reads the file into memory when it cannot be mapped (pipes, special files) */
+static int read_source(int fd, SourceFile *source) {
+    char *data = NULL;
+    long size = 0;
+    long capacity = 0;
+    long got;
+
+    do {
+        if (size == capacity) {
+            char *bigger;
+
+            capacity = capacity ? capacity * 2 : 4096;
+            bigger = realloc(data, capacity);
+            if (bigger == NULL) {
+                fprintf(stderr, "Failed to allocate memory for the source file\n");
+                exit(EXIT_FAILURE);
+            }
+            data = bigger;
+        }
+        got = (long)read(fd, data + size, capacity - size);
+        if (got < 0) {
+            free(data);
+            return 0;
+        }
+        size += got;
+    } while (got > 0);
+
+    source->data = data;
+    source->size = size;
+    source->mapped = 0;
+    return 1;
+}
+
+/* Maps the file read-only; falls back to reading it */
+int open_source(const char *path, SourceFile *source) {
+    struct stat info;
+    void *data;
+    int fd;
+    int ok;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode)) {
+        if (info.st_size == 0) {
+            close(fd);
+            source->data = "";
+            source->size = 0;
+            source->mapped = 0;
+            return 1;
+        }
+        data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            close(fd);
+            source->data = data;
+            source->size = (long)info.st_size;
+            source->mapped = 1;
+            return 1;
+        }
+    }
+
+    ok = read_source(fd, source);
+    close(fd);
+    return ok;
+}
+
+void close_source(SourceFile *source) {
+    if (source->mapped) {
+        munmap((void *)source->data, (size_t)source->size);
+    } else if (source->size > 0) {
+        free((void *)source->data);
+    }
+    source->data = NULL;
+    source->size = 0;
+    source->mapped = 0;
+}
+
+int view_equals(TextView view, const char *str) {
+    return (long)strlen(str) == view.length && memcmp(view.start, str, view.length) == 0;
+}
@@ -0,0 +1,27 @@
+#ifndef SOURCE_H
+#define SOURCE_H
+
+/* Read-only view of a piece of source text (not null-terminated).
+   Views point into the source buffer and never own or modify it. */
+typedef struct {
+    const char *start;
+    long length;
+} TextView;
+
+/* Contents of an input file, memory-mapped when the system allows it */
+typedef struct {
+    const char *data;                 /* File bytes (not null-terminated) */
+    long size;                        /* Number of bytes */
+    int mapped;                       /* 1 if data is mapped, 0 if it was read */
+} SourceFile;
+
+/* Maps (or reads) a whole file. Returns 0 if it cannot be opened or read. */
+int open_source(const char *path, SourceFile *source);
+
+/* Releases the file contents; views into it become invalid */
+void close_source(SourceFile *source);
+
+/* Returns 1 if the view holds exactly the given string */
+int view_equals(TextView view, const char *str);
+
+#endif /* SOURCE_H */
@@ -3,162 +3,565 @@
 #include <string.h>
 #include "util.h"
 #include "pre_prossecor.h"
+#include "arena.h"
 #include "table.h"
+#include "context.h"
+#include "parallel.h"
+#include "obx.h"
+#include "obz.h"
 
-/* Global static tables and counters for the assembler's internal data */
-static PendingWord *pending_words = NULL;
-static int pending_count = 0;
-static int symbol_count = 0;
-static int entry_count = 0;
-static int extern_count = 0;
-static int object_count = 0;
+/* Tables start with this many elements and double when full */
+#define INITIAL_TABLE_SIZE 64
 
-static Symbol *symbol_table = NULL;
-static Entry *entry_table = NULL;
-static Extern *extern_table = NULL;
-static Object *object_table = NULL;
+/* Object images with at least this many words are formatted in parallel */
+#define PARALLEL_OBJECT_WORDS 65536
 
-/* Frees all dynamic memory allocations used by the assembler */
-void free_memory(void) {
-    if (entry_table != NULL) {
-        free(entry_table);
-        entry_table = NULL;
+/* Output lines are formatted into blocks of this many bytes, written at once */
+#define OUTPUT_BLOCK 65536
+
+/* Longest "%04d %06X\n" line of the .ob file (and " %04d\n" of a label line) */
+#define NUMBER_LINE_MAX 24
+
+/* Open-addressing hash indexes kept alongside the symbol and extern tables.
+   Each slot holds an index into the matching table, or EMPTY_SLOT.
+   Sizes are always a power of two so the probe can mask instead of modulo. */
+#define EMPTY_SLOT (-1)
+#define INITIAL_INDEX_SIZE 64
+
+/* Hash of an interned label id (Knuth multiplicative hashing) */
+static unsigned long id_hash(StringId name) {
+    return (unsigned long)name * 2654435761UL;
+}
+
+/* Hash of an extern record: the name combined with the usage address */
+static unsigned long extern_hash(StringId name, int address) {
+    return id_hash(name) * 31 + (unsigned long)address;
+}
+
+/* Makes room for one more element in a table, doubling its arena block when full */
+static void *reserve_slot(Tables *tables, void *table, int count, int *capacity, size_t element_size) {
+    int new_capacity;
+
+    if (count < *capacity) {
+        return table;
     }
-    if (extern_table != NULL) {
-        free(extern_table);
-        extern_table = NULL;
+
+    new_capacity = *capacity ? *capacity * 2 : INITIAL_TABLE_SIZE;
+    table = arena_grow(&tables->arena, table, *capacity * element_size,
+                       new_capacity * element_size);
+    *capacity = new_capacity;
+    return table;
+}
+
+/* Allocates a hash index with every slot marked empty */
+static int *create_index(Tables *tables, int size) {
+    int *index;
+    int i;
+
+    index = arena_alloc(&tables->arena, size * sizeof(int));
+    for (i = 0; i < size; i++) {
+        index[i] = EMPTY_SLOT;
     }
-    if (object_table != NULL) {
-        free(object_table);
-        object_table = NULL;
+    return index;
+}
+
+/* Places a table position in the first free slot of its probe sequence */
+static void index_insert(int *index, int size, unsigned long hash, int position) {
+    unsigned long slot = hash & (size - 1);
+
+    while (index[slot] != EMPTY_SLOT) {
+        slot = (slot + 1) & (size - 1);
     }
-    if (symbol_table != NULL) {
-        free(symbol_table);
-        symbol_table = NULL;
+    index[slot] = position;
+}
+
+/* Makes room for one more symbol, rebuilding the index at 50% load */
+static void reserve_symbol_index(Tables *tables) {
+    int i;
+
+    if ((tables->symbol_count + 1) * 2 <= tables->symbol_index_size) {
+        return;
     }
-    if (pending_words != NULL) {
-        free(pending_words);
-        pending_words = NULL;
-        pending_count = 0;
+
+    tables->symbol_index_size = tables->symbol_index_size ? tables->symbol_index_size * 2 : INITIAL_INDEX_SIZE;
+    tables->symbol_index = create_index(tables, tables->symbol_index_size);
+    for (i = 0; i < tables->symbol_count; i++) {
+        index_insert(tables->symbol_index, tables->symbol_index_size,
+                     id_hash(tables->symbol_table[i].name), i);
     }
 }
 
-/* Adds a new entry symbol (.entry directive) */
-void add_entry(const char *label, int address) {
-    Entry *temp;
+/* Makes room for one more extern record, rebuilding the index at 50% load */
+static void reserve_extern_index(Tables *tables) {
+    int i;
 
-    temp = realloc(entry_table, (entry_count + 1) * sizeof(Entry));
-    if (!temp) {
-        fprintf(stderr, "Failed to allocate memory for entry table\n");
-        free_memory();
-        exit(EXIT_FAILURE);
+    if ((tables->extern_count + 1) * 2 <= tables->extern_index_size) {
+        return;
+    }
+
+    tables->extern_index_size = tables->extern_index_size ? tables->extern_index_size * 2 : INITIAL_INDEX_SIZE;
+    tables->extern_index = create_index(tables, tables->extern_index_size);
+    for (i = 0; i < tables->extern_count; i++) {
+        index_insert(tables->extern_index, tables->extern_index_size,
+                     extern_hash(tables->extern_table[i].name, tables->extern_table[i].address), i);
     }
-    entry_table = temp;
+}
 
-    strncpy(entry_table[entry_count].label, label, MAX_LABEL_LENGTH - 1);
-    entry_table[entry_count].label[MAX_LABEL_LENGTH - 1] = '\0';
-    entry_table[entry_count].address = address;
+/* Returns the position of a label in the symbol table, or -1 if not defined */
+static int find_symbol(const Tables *tables, StringId name) {
+    unsigned long slot;
 
-    entry_count++;
+    if (tables->symbol_index == NULL || name == NO_STRING_ID) {
+        return -1;
+    }
+
+    slot = id_hash(name) & (tables->symbol_index_size - 1);
+    while (tables->symbol_index[slot] != EMPTY_SLOT) {
+        if (tables->symbol_table[tables->symbol_index[slot]].name == name) {
+            return tables->symbol_index[slot];
+        }
+        slot = (slot + 1) & (tables->symbol_index_size - 1);
+    }
+    return -1;
 }
 
-/* Adds a new external label usage (.extern directive or use) */
-void add_extern(const char *symbol, int address) {
-    Extern *temp;
+/* Returns the position of an extern record (name + usage address), or -1 */
+static int find_extern(const Tables *tables, StringId name, int address) {
+    unsigned long slot;
     int i;
 
-    /* Avoid duplicates */
-    for (i = 0; i < extern_count; i++) {
-        if (!strcmp(extern_table[i].symbol, symbol) &&
-            extern_table[i].address == address) {
-            return;
+    if (tables->extern_index == NULL || name == NO_STRING_ID) {
+        return -1;
+    }
+
+    slot = extern_hash(name, address) & (tables->extern_index_size - 1);
+    while ((i = tables->extern_index[slot]) != EMPTY_SLOT) {
+        if (tables->extern_table[i].name == name && tables->extern_table[i].address == address) {
+            return i;
         }
+        slot = (slot + 1) & (tables->extern_index_size - 1);
     }
+    return -1;
+}
 
-    temp = realloc(extern_table, (extern_count + 1) * sizeof(Extern));
-    if (!temp) {
-        fprintf(stderr, "Failed to allocate memory for extern table\n");
-        free_memory();
-        exit(EXIT_FAILURE);
+/* Opens a segment's temporary file if needed */
+static FILE *segment_file(Segment *segment) {
+    if (segment->file == NULL) {
+        segment->file = tmpfile();
+        if (segment->file == NULL) {
+            perror("Error opening temporary segment file");
+            exit(EXIT_FAILURE);
+        }
+        segment->size = 0;
+    }
+    return segment->file;
+}
+
+/* Copies a segment to the end of an output and discards it */
+static void copy_segment(Segment *segment, Output *out) {
+    char buffer[BUFSIZ];
+    size_t length;
+
+    if (segment->file == NULL) {
+        return;
+    }
+    fflush(segment->file);
+    rewind(segment->file);
+    while ((length = fread(buffer, 1, sizeof(buffer), segment->file)) > 0) {
+        output_bytes(out, buffer, (long)length);
     }
-    extern_table = temp;
+    fclose(segment->file);
+    segment->file = NULL;
+    segment->size = 0;
+}
 
-    strncpy(extern_table[extern_count].symbol, symbol, MAX_LABEL_LENGTH - 1);
-    extern_table[extern_count].symbol[MAX_LABEL_LENGTH - 1] = '\0';
-    extern_table[extern_count].address = address;
+/* Discards a segment without writing it anywhere */
+static void close_segment(Segment *segment) {
+    if (segment->file != NULL) {
+        fclose(segment->file);
+        segment->file = NULL;
+    }
+    segment->size = 0;
+}
 
-    extern_count++;
+/* Forgets every table without touching the arena */
+static void clear_tables(Tables *tables) {
+    tables->pending_words = NULL;
+    tables->label_uses = NULL;
+    tables->symbol_table = NULL;
+    tables->entry_table = NULL;
+    tables->extern_table = NULL;
+    tables->image_pages = NULL;
+    tables->image_last_page = -1;
+    tables->symbol_index = NULL;
+    tables->extern_index = NULL;
+
+    tables->pending_count = tables->symbol_count = tables->entry_count = tables->extern_count = tables->object_count = 0;
+    tables->pending_capacity = tables->symbol_capacity = tables->entry_capacity = 0;
+    tables->extern_capacity = tables->label_use_capacity = 0;
+    tables->symbol_index_size = tables->extern_index_size = 0;
+
+    close_segment(&tables->word_segment);
+    close_segment(&tables->extern_segment);
+    tables->last_word_offset = -1;
+    tables->pending_overflow = 0;
+    tables->memory_overflow = 0;
 }
 
-/* Adds a new symbol (label) to the symbol table */
-void add_symbol(const char *label, int address) {
-    Symbol *temp;
+/* Empties all tables before assembling the next file.
+   The arena keeps its chunks, so this costs O(1) regardless of table sizes. */
+void reset_tables(AsmContext *ctx) {
+    arena_reset(&ctx->tables.arena);
+    clear_tables(&ctx->tables);
+    reset_string_pool(&ctx->strings, &ctx->tables.arena);
+}
+
+/* Frees all dynamic memory allocations used by the assembler */
+void free_memory(AsmContext *ctx) {
+    arena_free(&ctx->tables.arena);
+    clear_tables(&ctx->tables);
+    reset_string_pool(&ctx->strings, &ctx->tables.arena);
+}
+
+/* Turns streaming mode on or off for the next files */
+void set_streaming(AsmContext *ctx, int enabled) {
+    ctx->tables.streaming = enabled;
+}
+
+int is_streaming(const AsmContext *ctx) {
+    return ctx->tables.streaming;
+}
+
+int get_fatal_errors(const AsmContext *ctx) {
+    return ctx->tables.pending_overflow + ctx->tables.memory_overflow;
+}
+
+/* Turns one-pass mode on or off for the next files */
+void set_one_pass(AsmContext *ctx, int enabled) {
+    ctx->tables.one_pass = enabled;
+}
+
+int is_one_pass(const AsmContext *ctx) {
+    return ctx->tables.one_pass;
+}
+
+/* Makes room in the use chains for a label id; new chains start empty */
+static void reserve_label_uses(Tables *tables, StringId name) {
+    int new_capacity = tables->label_use_capacity ? tables->label_use_capacity : INITIAL_INDEX_SIZE;
     int i;
 
+    if ((long)name < tables->label_use_capacity) {
+        return;
+    }
+    while ((long)name >= new_capacity) {
+        new_capacity *= 2;
+    }
+    tables->label_uses = arena_grow(&tables->arena, tables->label_uses,
+                                    tables->label_use_capacity * sizeof(int),
+                                    new_capacity * sizeof(int));
+    for (i = tables->label_use_capacity; i < new_capacity; i++) {
+        tables->label_uses[i] = EMPTY_SLOT;
+    }
+    tables->label_use_capacity = new_capacity;
+}
+
+int get_label_uses(const AsmContext *ctx, StringId name) {
+    if ((long)name >= ctx->tables.label_use_capacity) {
+        return -1;
+    }
+    return ctx->tables.label_uses[name];
+}
+
+/* Adds a new entry symbol (.entry directive) */
+void add_entry(AsmContext *ctx, StringId name, int address) {
+    Tables *tables = &ctx->tables;
+
+    tables->entry_table = reserve_slot(tables, tables->entry_table, tables->entry_count, &tables->entry_capacity, sizeof(Entry));
+
+    tables->entry_table[tables->entry_count].name = name;
+    tables->entry_table[tables->entry_count].address = address;
+
+    tables->entry_count++;
+}
+
+/* Adds a new external label usage (.extern directive or use) */
+void add_extern(AsmContext *ctx, const char *symbol, int address) {
+    add_extern_usage(ctx, intern_string(&ctx->strings, symbol), address);
+}
+
+/* Adds an external record for an interned name, ignoring exact duplicates */
+void add_extern_usage(AsmContext *ctx, StringId name, int address) {
+    Tables *tables = &ctx->tables;
+
+    /* A use is final once resolved: stream it to the .ext segment */
+    if (tables->streaming && address >= 0) {
+        tables->extern_segment.size += fprintf(segment_file(&tables->extern_segment), "%s %04d\n",
+                                               string_of(&ctx->strings, name), address);
+        return;
+    }
+
+    /* Avoid duplicates */
+    if (find_extern(tables, name, address) != -1) {
+        return;
+    }
+
+    tables->extern_table = reserve_slot(tables, tables->extern_table, tables->extern_count, &tables->extern_capacity, sizeof(Extern));
+
+    tables->extern_table[tables->extern_count].name = name;
+    tables->extern_table[tables->extern_count].address = address;
+
+    reserve_extern_index(tables);
+    index_insert(tables->extern_index, tables->extern_index_size,
+                 extern_hash(name, address), tables->extern_count);
+    tables->extern_count++;
+}
+
+/* Adds a new symbol (label) to the symbol table */
+int add_symbol(AsmContext *ctx, StringId name, int address) {
+    Tables *tables = &ctx->tables;
+    int index;
+
     /* Ignore duplicates */
-    for (i = 0; i < symbol_count; i++) {
-        if (strcmp(symbol_table[i].label, label) == 0) {
-            return;
-        }
+    index = find_symbol(tables, name);
+    if (index != -1) {
+        return index;
     }
 
-    temp = realloc(symbol_table, (symbol_count + 1) * sizeof(Symbol));
-    if (temp == NULL) {
-        fprintf(stderr, "Failed to allocate memory for symbol table\n");
-        free_memory();
-        exit(EXIT_FAILURE);
+    tables->symbol_table = reserve_slot(tables, tables->symbol_table, tables->symbol_count, &tables->symbol_capacity, sizeof(Symbol));
+
+    tables->symbol_table[tables->symbol_count].name = name;
+    tables->symbol_table[tables->symbol_count].address = address;
+    tables->symbol_table[tables->symbol_count].data_length = 0;
+    tables->symbol_table[tables->symbol_count].kind = SYMBOL_CODE;
+    tables->symbol_table[tables->symbol_count].flags = 0;
+
+    reserve_symbol_index(tables);
+    index_insert(tables->symbol_index, tables->symbol_index_size,
+                 id_hash(name), tables->symbol_count);
+    return tables->symbol_count++;
+}
+
+/* Records the data extent of a label (for .data or .string):
+   the values themselves stay in the object image */
+void set_symbol_data(AsmContext *ctx, int index, unsigned int length) {
+    Tables *tables = &ctx->tables;
+
+    if (index >= 0 && index < tables->symbol_count) {
+        tables->symbol_table[index].kind = SYMBOL_DATA;
+        tables->symbol_table[index].data_length += length;
+    } else {
+        fprintf(ctx->diagnostics, "Error: Invalid symbol index %d\n", index);
     }
-    symbol_table = temp;
+}
 
-    strncpy(symbol_table[symbol_count].label, label, MAX_LABEL_LENGTH - 1);
-    symbol_table[symbol_count].label[MAX_LABEL_LENGTH - 1] = '\0';
-    symbol_table[symbol_count].address = address;
-    symbol_table[symbol_count].data_count = 0;
-    symbol_count++;
+/* Sets flags on a defined label; undefined labels are left to the caller */
+void set_symbol_flags(AsmContext *ctx, StringId name, unsigned char flags) {
+    int index = find_symbol(&ctx->tables, name);
+
+    if (index != -1) {
+        ctx->tables.symbol_table[index].flags |= flags;
+    }
 }
 
-/* Adds a value to a symbol's associated data (for .data or .string) */
-void add_data_to_symbol(int symbol_index, int value) {
-    if (symbol_index < symbol_count) {
-        if (symbol_table[symbol_index].data_count < SIZE_DATA) {
-            symbol_table[symbol_index].data_value[symbol_table[symbol_index].data_count++] = value;
-        } else {
-            fprintf(stderr, "Error: Exceeded data storage for symbol %s\n", symbol_table[symbol_index].label);
+/* Returns the image slot of an address, allocating its page if asked to.
+   Returns NULL for a page that was never written when allocate is 0. */
+static unsigned int *image_slot(Tables *tables, unsigned int address, int allocate) {
+    int page = address / IMAGE_PAGE_SIZE;
+
+    if (tables->image_pages == NULL || tables->image_pages[page] == NULL) {
+        if (!allocate) {
+            return NULL;
+        }
+        if (tables->image_pages == NULL) {
+            tables->image_pages = arena_alloc(&tables->arena, IMAGE_PAGES * sizeof(unsigned int *));
+            memset(tables->image_pages, 0, IMAGE_PAGES * sizeof(unsigned int *));
         }
+        tables->image_pages[page] = arena_alloc(&tables->arena, IMAGE_PAGE_SIZE * sizeof(unsigned int));
+        memset(tables->image_pages[page], 0, IMAGE_PAGE_SIZE * sizeof(unsigned int));
+        if (page > tables->image_last_page) {
+            tables->image_last_page = page;
+        }
+    }
+    return &tables->image_pages[page][address % IMAGE_PAGE_SIZE];
+}
+
+/* Digits of 00 to 99, two characters each */
+static const char decimal_pairs[] =
+    "00010203040506070809" "10111213141516171819" "20212223242526272829"
+    "30313233343536373839" "40414243444546474849" "50515253545556575859"
+    "60616263646566676869" "70717273747576777879" "80818283848586878889"
+    "90919293949596979899";
+
+static const char hex_digits[] = "0123456789ABCDEF";
+
+/* Formats a number like "%04d" at pos, two digits per table lookup.
+   Returns the end of the text. */
+static char *format_number(char *pos, unsigned int value) {
+    char digits[12];
+    char *end = digits + sizeof(digits);
+    char *first = end;
+
+    while (value >= 100) {
+        first -= 2;
+        memcpy(first, decimal_pairs + (value % 100) * 2, 2);
+        value /= 100;
+    }
+    if (value >= 10) {
+        first -= 2;
+        memcpy(first, decimal_pairs + value * 2, 2);
     } else {
-        fprintf(stderr, "Error: Invalid symbol index %d\n", symbol_index);
+        *--first = (char)('0' + value);
+    }
+    while (end - first < 4) {
+        *--first = '0';
     }
+    memcpy(pos, first, end - first);
+    return pos + (end - first);
 }
 
-/* Adds a word to the object table (machine code memory) */
-void add_object(unsigned int address, int value) {
-    Object *temp;
+/* Formats the .ob line of a word ("%04d %06X\n") at pos; returns its end */
+static char *format_object_line(char *pos, unsigned int address, unsigned int word) {
+    pos = format_number(pos, address);
+    pos[0] = ' ';
+    pos[1] = hex_digits[(word >> 20) & 0xF];
+    pos[2] = hex_digits[(word >> 16) & 0xF];
+    pos[3] = hex_digits[(word >> 12) & 0xF];
+    pos[4] = hex_digits[(word >> 8) & 0xF];
+    pos[5] = hex_digits[(word >> 4) & 0xF];
+    pos[6] = hex_digits[word & 0xF];
+    pos[7] = '\n';
+    return pos + 8;
+}
 
-    if (address >= MAX_MEMORY) {
-        fprintf(stderr, "Error: Exceeded memory limit of %d bytes\n", MAX_MEMORY);
-        free_memory();
-        exit(EXIT_FAILURE);
+/* Streams a word to the .ob segment, remembering where its value is
+   written so a pending word can be filled in later */
+static void append_word(Tables *tables, unsigned int address, int value) {
+    char line[NUMBER_LINE_MAX];
+    int length = (int)(format_object_line(line, address, (unsigned int)value) - line);
+
+    fwrite(line, 1, length, segment_file(&tables->word_segment));
+    tables->word_segment.size += length;
+    tables->last_word_offset = tables->word_segment.size - 7;
+    tables->object_count++;
+}
+
+/* Returns 1 if count words from address fit in memory; the first time
+   they do not, reports it (the file is then rejected after pass 1) */
+static int words_fit(AsmContext *ctx, unsigned int address, int count) {
+    if (address + count <= MAX_MEMORY) {
+        return 1;
+    }
+    if (!ctx->tables.memory_overflow) {
+        fprintf(ctx->diagnostics, "Error: Exceeded memory limit of %d bytes\n", MAX_MEMORY);
+        ctx->tables.memory_overflow = 1;
     }
+    return 0;
+}
 
-    temp = realloc(object_table, (object_count + 1) * sizeof(Object));
-    if (temp == NULL) {
-        fprintf(stderr, "Failed to allocate memory for object table\n");
-        free_memory();
-        exit(EXIT_FAILURE);
+/* Adds a word to the object image (machine code memory) */
+void add_object(AsmContext *ctx, unsigned int address, int value) {
+    Tables *tables = &ctx->tables;
+    unsigned int *slot;
+
+    if (!words_fit(ctx, address, 1)) {
+        return;
+    }
+
+    if (tables->streaming) {
+        append_word(tables, address, value);
+        return;
     }
 
-    object_table = temp;
-    object_table[object_count].address = address;
-    object_table[object_count].value = value & 0xFFFFFF; /* 24-bit */
-    object_count++;
+    slot = image_slot(tables, address, 1);
+    if (!(*slot & WORD_PRESENT)) {
+        tables->object_count++;
+    }
+    *slot = (value & 0xFFFFFF) | WORD_PRESENT; /* 24-bit */
 }
 
-/* Determines ARE type (A/R/E) for an operand */
-int get_are_code(const char *operand) {
+/* Adds count consecutive words to the object image, filling a page at a time */
+void add_objects(AsmContext *ctx, unsigned int address, const int *values, int count) {
+    Tables *tables = &ctx->tables;
+    unsigned int *slot;
+    int run;
     int i;
 
+    if (count <= 0) {
+        return;
+    }
+    if (!words_fit(ctx, address, count)) {
+        return;
+    }
+
+    if (tables->streaming) {
+        for (i = 0; i < count; i++) {
+            append_word(tables, address + i, values[i]);
+        }
+        return;
+    }
+
+    while (count > 0) {
+        slot = image_slot(tables, address, 1);
+        run = IMAGE_PAGE_SIZE - address % IMAGE_PAGE_SIZE;
+        if (run > count) {
+            run = count;
+        }
+        for (i = 0; i < run; i++) {
+            if (!(slot[i] & WORD_PRESENT)) {
+                tables->object_count++;
+            }
+            slot[i] = (values[i] & 0xFFFFFF) | WORD_PRESENT;
+        }
+        address += run;
+        values += run;
+        count -= run;
+    }
+}
+
+/* Replaces a word already in the image (used to fill in pending words) */
+int patch_object(AsmContext *ctx, unsigned int address, unsigned int value) {
+    unsigned int *slot;
+
+    if (address >= MAX_MEMORY || (slot = image_slot(&ctx->tables, address, 0)) == NULL ||
+        !(*slot & WORD_PRESENT)) {
+        return 0;
+    }
+    *slot = (value & 0xFFFFFF) | WORD_PRESENT;
+    return 1;
+}
+
+/* Fills in a pending word once its label is resolved: in the image, or at
+   its place in the streamed .ob segment */
+int patch_pending(AsmContext *ctx, const PendingWord *word, unsigned int value) {
+    FILE *file = ctx->tables.word_segment.file;
+
+    if (!ctx->tables.streaming) {
+        return patch_object(ctx, word->address, value);
+    }
+    if (file == NULL || word->offset < 0 || fseek(file, word->offset, SEEK_SET) != 0) {
+        return 0;
+    }
+    fprintf(file, "%06X", value & 0xFFFFFF);
+    return fseek(file, 0, SEEK_END) == 0;
+}
+
+/* Reads a word of the image */
+int get_object_word(AsmContext *ctx, unsigned int address, unsigned int *value) {
+    unsigned int *slot;
+
+    if (address >= MAX_MEMORY || (slot = image_slot(&ctx->tables, address, 0)) == NULL ||
+        !(*slot & WORD_PRESENT)) {
+        return 0;
+    }
+    *value = *slot & 0xFFFFFF;
+    return 1;
+}
+
+/* Determines ARE type (A/R/E) for an operand */
+int get_are_code(AsmContext *ctx, const char *operand) {
+
     if (operand == NULL || operand[0] == '\0') {
-        fprintf(stderr, "Error: Invalid operand passed to get_are_code\n");
+        fprintf(ctx->diagnostics, "Error: Invalid operand passed to get_are_code\n");
         return -1;
     }
 
@@ -166,157 +569,587 @@ int get_are_code(const char *operand) {
         return ABSULUTE;
     }
 
-    for (i = 0; i < symbol_count; i++) {
-        if (strcmp(symbol_table[i].label, operand) == 0) {
-            return RELOCATABLE;
+    if (find_symbol(&ctx->tables, find_string(&ctx->strings, operand)) != -1) {
+        return RELOCATABLE;
+    }
+
+    if (is_external_label(ctx, operand)) {
+        return EXTERNAL;
+    }
+
+    return RELOCATABLE;
+}
+
+/* Lines of an output, collected into large blocks before being written */
+typedef struct {
+    Output *out;
+    long length;                      /* Bytes in data */
+    char data[OUTPUT_BLOCK];
+} LineBlock;
+
+/* Starts an empty block of lines for an output */
+static LineBlock *new_block(Output *out) {
+    LineBlock *block = malloc(sizeof(LineBlock));
+
+    if (block == NULL) {
+        fprintf(stderr, "Failed to allocate memory for assembler output\n");
+        exit(EXIT_FAILURE);
+    }
+    block->out = out;
+    block->length = 0;
+    return block;
+}
+
+/* Writes the lines collected so far */
+static void flush_block(LineBlock *block) {
+    output_bytes(block->out, block->data, block->length);
+    block->length = 0;
+}
+
+/* Appends a "LABEL ADDRESS" line (.ent and .ext files) */
+static void output_label_line(LineBlock *block, const char *label, int address) {
+    long length = (long)strlen(label);
+    char *pos;
+
+    if (block->length + length + NUMBER_LINE_MAX > OUTPUT_BLOCK) {
+        flush_block(block);
+    }
+    if (length + NUMBER_LINE_MAX > OUTPUT_BLOCK) {
+        output_bytes(block->out, label, length);
+        length = 0;
+    } else {
+        memcpy(block->data + block->length, label, length);
+    }
+    pos = block->data + block->length + length;
+    *pos++ = ' ';
+    pos = format_number(pos, (unsigned int)address);
+    *pos++ = '\n';
+    block->length = pos - block->data;
+}
+
+/* Length of the .ob line of the word at an address ("%04d %06X\n") */
+static long object_line_length(unsigned int address) {
+    long digits = 4;
+    unsigned int limit = 10000;
+
+    while (address >= limit && digits < 10) {
+        digits++;
+        limit *= 10;
+    }
+    return digits + 8;
+}
+
+/* The .ob lines of the image, formatted a range of pages per thread */
+typedef struct {
+    const Tables *tables;
+    Output *out;
+    long start;                       /* Offset of the first word line in out */
+    long *page_offsets;               /* Offset of each page's lines from start */
+    int page_count;
+    int part_count;
+} ObjectWriter;
+
+/* Formats the lines of one range of pages and writes them at their offset */
+static void write_object_part(void *arg, int index) {
+    ObjectWriter *writer = arg;
+    int first = (int)((long)writer->page_count * index / writer->part_count);
+    int last = (int)((long)writer->page_count * (index + 1) / writer->part_count);
+    long length = writer->page_offsets[last] - writer->page_offsets[first];
+    const unsigned int *words;
+    char *buffer;
+    char *pos;
+    int page, i;
+
+    if (length == 0) {
+        return;
+    }
+    buffer = malloc(length + 1);
+    if (buffer == NULL) {
+        fprintf(stderr, "Failed to allocate memory for assembler output\n");
+        exit(EXIT_FAILURE);
+    }
+    pos = buffer;
+    for (page = first; page < last; page++) {
+        words = writer->tables->image_pages[page];
+        if (words == NULL) {
+            continue;
+        }
+        for (i = 0; i < IMAGE_PAGE_SIZE; i++) {
+            if (words[i] & WORD_PRESENT) {
+                pos = format_object_line(pos, page * IMAGE_PAGE_SIZE + i, words[i]);
+            }
+        }
+    }
+    output_write_at(writer->out, writer->start + writer->page_offsets[first], buffer, length);
+    free(buffer);
+}
+
+/* Writes the word lines of the image on ctx->threads threads. Every line's
+   length follows from its address, so the offset of each page is known
+   before any line is formatted, and the ranges are written in place. */
+static void write_object_parallel(AsmContext *ctx, Output *out) {
+    ObjectWriter writer;
+    const unsigned int *words;
+    int page, i;
+
+    writer.tables = &ctx->tables;
+    writer.out = out;
+    writer.page_count = ctx->tables.image_last_page + 1;
+    writer.part_count = ctx->threads;
+    writer.page_offsets = malloc((writer.page_count + 1) * sizeof(long));
+    if (writer.page_offsets == NULL) {
+        fprintf(stderr, "Failed to allocate memory for assembler output\n");
+        exit(EXIT_FAILURE);
+    }
+
+    writer.page_offsets[0] = 0;
+    for (page = 0; page < writer.page_count; page++) {
+        writer.page_offsets[page + 1] = writer.page_offsets[page];
+        words = ctx->tables.image_pages[page];
+        for (i = 0; words != NULL && i < IMAGE_PAGE_SIZE; i++) {
+            if (words[i] & WORD_PRESENT) {
+                writer.page_offsets[page + 1] += object_line_length(page * IMAGE_PAGE_SIZE + i);
+            }
         }
     }
 
-    for (i = 0; i < extern_count; i++) {
-        if (strcmp(extern_table[i].symbol, operand) == 0) {
-            return EXTERNAL;
+    writer.start = output_reserve(out, writer.page_offsets[writer.page_count]);
+    run_parallel(writer.part_count, write_object_part, &writer);
+    free(writer.page_offsets);
+}
+
+/* Writes the .ob (object) output with IC, DC and all code words */
+void write_object_file(AsmContext *ctx, Output *out, int IC, int DC) {
+    Tables *tables = &ctx->tables;
+    char line[32];
+    int page, i;
+    unsigned int *words;
+    LineBlock *block;
+
+    sprintf(line, "%d %d\n", IC, DC);
+    output_string(out, line);
+    if (tables->streaming) {
+        copy_segment(&tables->word_segment, out);
+        return;
+    }
+    if (ctx->threads > 1 && tables->object_count >= PARALLEL_OBJECT_WORDS) {
+        write_object_parallel(ctx, out);
+        return;
+    }
+
+    block = new_block(out);
+    for (page = 0; page <= tables->image_last_page; page++) {
+        words = tables->image_pages[page];
+        if (words == NULL) {
+            continue;
+        }
+        for (i = 0; i < IMAGE_PAGE_SIZE; i++) {
+            if (words[i] & WORD_PRESENT) {
+                if (block->length + NUMBER_LINE_MAX > OUTPUT_BLOCK) {
+                    flush_block(block);
+                }
+                block->length = format_object_line(block->data + block->length,
+                                                   page * IMAGE_PAGE_SIZE + i, words[i]) - block->data;
+            }
         }
     }
+    flush_block(block);
+    free(block);
+}
 
-    return RELOCATABLE;
+/* Writes the .ent output with all entry symbols and their addresses */
+void write_entries_file(AsmContext *ctx, Output *out) {
+    Tables *tables = &ctx->tables;
+    LineBlock *block = new_block(out);
+    int i, j;
+
+    for (i = 0; i < tables->entry_count; i++) {
+        j = find_symbol(tables, tables->entry_table[i].name);
+        if (j != -1) {
+            output_label_line(block, string_of(&ctx->strings, tables->entry_table[i].name),
+                              tables->symbol_table[j].address);
+        }
+    }
+    flush_block(block);
+    free(block);
 }
 
-/* Writes the .ob (object) file with IC, DC and all code words */
-void write_object_file(const char *filename, int IC, int DC) {
-    FILE *file;
+/* Writes the .ext output with all used external labels and their usage addresses */
+void write_externals_file(AsmContext *ctx, Output *out) {
+    Tables *tables = &ctx->tables;
+    LineBlock *block;
     int i;
 
-    file = fopen(filename, "w");
-    if (!file) {
-        perror("Error opening object file");
-        exit(EXIT_FAILURE);
+    copy_segment(&tables->extern_segment, out);
+    block = new_block(out);
+    for (i = 0; i < tables->extern_count; i++) {
+        if (tables->extern_table[i].address < 0) {
+            continue;
+        }
+        output_label_line(block, string_of(&ctx->strings, tables->extern_table[i].name),
+                          tables->extern_table[i].address);
     }
+    flush_block(block);
+    free(block);
+}
+
+/* Makes room for length bytes in a block and returns where they go */
+static unsigned char *block_space(LineBlock *block, long length) {
+    unsigned char *pos;
 
-    fprintf(file, "%d %d\n", IC, DC);
-    for (i = 0; i < object_count; i++) {
-        fprintf(file, "%04d %06X\n", object_table[i].address, object_table[i].value);
+    if (block->length + length > OUTPUT_BLOCK) {
+        flush_block(block);
     }
-    fclose(file);
+    pos = (unsigned char *)block->data + block->length;
+    block->length += length;
+    return pos;
 }
 
-/* Writes the .ent file with all entry symbols and their addresses */
-void write_entries_file(const char *filename) {
-    FILE *file;
+/* Finds the next run of consecutive words of the image at or after
+   *cursor. Returns 0 when there is none; *cursor moves past the run. */
+static int next_run(const Tables *tables, long *cursor, long *start, long *count) {
+    long end = (long)(tables->image_last_page + 1) * IMAGE_PAGE_SIZE;
+    const unsigned int *words;
+    long address = *cursor;
+
+    while (address < end) {
+        words = tables->image_pages[address / IMAGE_PAGE_SIZE];
+        if (words == NULL) {
+            address = (address / IMAGE_PAGE_SIZE + 1) * IMAGE_PAGE_SIZE;
+        } else if (!(words[address % IMAGE_PAGE_SIZE] & WORD_PRESENT)) {
+            address++;
+        } else {
+            break;
+        }
+    }
+    if (address >= end) {
+        *cursor = end;
+        return 0;
+    }
+
+    *start = address;
+    while (address < end && (words = tables->image_pages[address / IMAGE_PAGE_SIZE]) != NULL &&
+           (words[address % IMAGE_PAGE_SIZE] & WORD_PRESENT)) {
+        address++;
+    }
+    *count = address - *start;
+    *cursor = address;
+    return 1;
+}
+
+/* Gives a name its offset in the .obx string table, adding it the first time */
+static unsigned long obx_name(AsmContext *ctx, Output *strings, long *offsets, StringId name) {
+    const char *text;
+
+    if (offsets[name] == -1) {
+        text = string_of(&ctx->strings, name);
+        offsets[name] = strings->length;
+        output_bytes(strings, text, (long)strlen(text) + 1);
+    }
+    return (unsigned long)offsets[name];
+}
+
+/* Writes the .obx output: the image, entries and extern uses of the .ob,
+   .ent and .ext outputs in the binary layout of obx.h */
+void write_binary_file(AsmContext *ctx, Output *out, int IC, int DC) {
+    Tables *tables = &ctx->tables;
+    int string_count = get_string_count(&ctx->strings);
+    Output strings = OUTPUT_INIT;
+    long *offsets = malloc((string_count + 1) * sizeof(long));
+    long *entry_names = malloc((tables->entry_count + 1) * sizeof(long));
+    long *extern_names = malloc((tables->extern_count + 1) * sizeof(long));
+    LineBlock *block = new_block(out);
+    ObxHeader header;
+    unsigned char *pos;
+    const unsigned int *words;
+    long cursor, start, count, k;
     int i, j;
-    Symbol *symbol_table = get_symbol_table();
-    int symbol_count = get_symbol_count();
 
-    file = fopen(filename, "w");
-    if (!file) {
-        perror("Error opening entries file");
+    if (offsets == NULL || entry_names == NULL || extern_names == NULL) {
+        fprintf(stderr, "Failed to allocate memory for assembler output\n");
         exit(EXIT_FAILURE);
     }
+    for (i = 0; i < string_count; i++) {
+        offsets[i] = -1;
+    }
+
+    /* Names and counts, of the same lines as the .ent and .ext outputs */
+    memset(&header, 0, sizeof(header));
+    output_open(&strings, NULL);
+    for (i = 0; i < tables->entry_count; i++) {
+        if (find_symbol(tables, tables->entry_table[i].name) != -1) {
+            entry_names[i] = (long)obx_name(ctx, &strings, offsets, tables->entry_table[i].name);
+            header.entry_count++;
+        }
+    }
+    for (i = 0; i < tables->extern_count; i++) {
+        if (tables->extern_table[i].address >= 0) {
+            extern_names[i] = (long)obx_name(ctx, &strings, offsets, tables->extern_table[i].name);
+            header.extern_count++;
+        }
+    }
+
+    header.ic = (unsigned long)IC;
+    header.dc = (unsigned long)DC;
+    header.base = MEMORY_START;
+    cursor = 0;
+    while (next_run(tables, &cursor, &start, &count)) {
+        if (header.run_count == 0) {
+            header.base = (unsigned long)start;
+        }
+        header.run_count++;
+        header.word_count += (unsigned long)count;
+    }
+    header.strings_size = (unsigned long)strings.length;
+    obx_layout(&header);
+    obx_put_header(block_space(block, OBX_HEADER_SIZE), &header);
+
+    /* Runs, entries and extern uses */
+    cursor = 0;
+    while (next_run(tables, &cursor, &start, &count)) {
+        pos = block_space(block, OBX_RECORD_SIZE);
+        obx_put_u32(pos, (unsigned long)start);
+        obx_put_u32(pos + 4, (unsigned long)count);
+    }
+    for (i = 0; i < tables->entry_count; i++) {
+        j = find_symbol(tables, tables->entry_table[i].name);
+        if (j != -1) {
+            pos = block_space(block, OBX_RECORD_SIZE);
+            obx_put_u32(pos, (unsigned long)entry_names[i]);
+            obx_put_u32(pos + 4, tables->symbol_table[j].address);
+        }
+    }
+    for (i = 0; i < tables->extern_count; i++) {
+        if (tables->extern_table[i].address >= 0) {
+            pos = block_space(block, OBX_RECORD_SIZE);
+            obx_put_u32(pos, (unsigned long)extern_names[i]);
+            obx_put_u32(pos + 4, (unsigned long)tables->extern_table[i].address);
+        }
+    }
+
+    /* The words of every run, then the padding before the strings */
+    cursor = 0;
+    while (next_run(tables, &cursor, &start, &count)) {
+        for (k = start; k < start + count; k++) {
+            words = tables->image_pages[k / IMAGE_PAGE_SIZE];
+            obx_put_word(block_space(block, OBX_WORD_SIZE), words[k % IMAGE_PAGE_SIZE] & 0xFFFFFF);
+        }
+    }
+    count = (long)(header.strings_offset - header.image_offset - header.word_count * OBX_WORD_SIZE);
+    memset(block_space(block, count), 0, count);
+
+    flush_block(block);
+    output_bytes(out, strings.data, strings.length);
 
-    for (i = 0; i < entry_count; i++) {
-        for (j = 0; j < symbol_count; j++) {
-            if (strcmp(entry_table[i].label, symbol_table[j].label) == 0) {
-                fprintf(file, "%s %04d\n", entry_table[i].label, symbol_table[j].address);
-                break;
+    output_free(&strings);
+    free(offsets);
+    free(entry_names);
+    free(extern_names);
+    free(block);
+}
+
+/* Writes the .obz output: the words of the .ob, compressed (obz.h) */
+void write_compressed_file(AsmContext *ctx, Output *out, int IC, int DC) {
+    Tables *tables = &ctx->tables;
+    ObzWriter *writer = malloc(sizeof(ObzWriter));
+    const unsigned int *words;
+    int page, i, start;
+
+    if (writer == NULL) {
+        fprintf(stderr, "Failed to allocate memory for assembler output\n");
+        exit(EXIT_FAILURE);
+    }
+    obz_start(writer, out, (unsigned long)IC, (unsigned long)DC);
+    for (page = 0; page <= tables->image_last_page; page++) {
+        words = tables->image_pages[page];
+        if (words == NULL) {
+            continue;
+        }
+        for (i = 0; i < IMAGE_PAGE_SIZE; i++) {
+            if (!(words[i] & WORD_PRESENT)) {
+                continue;
             }
+            for (start = i; i < IMAGE_PAGE_SIZE && (words[i] & WORD_PRESENT); i++) {
+            }
+            obz_add_words(writer, (unsigned long)page * IMAGE_PAGE_SIZE + start, words + start, i - start);
         }
     }
+    obz_finish(writer);
+    free(writer);
+}
 
-    fclose(file);
+/* Maps a string id of a part to this context's pool. Ids below shared are
+   the same in both pools; map caches the other ids once looked up. */
+static StringId merged_id(AsmContext *ctx, const AsmContext *part, int shared, StringId *map,
+                          StringId id) {
+    if (id == NO_STRING_ID || id < (StringId)shared) {
+        return id;
+    }
+    if (map[id - shared] == NO_STRING_ID) {
+        map[id - shared] = intern_string(&ctx->strings, string_of(&part->strings, id));
+    }
+    return map[id - shared];
 }
 
-/* Writes the .ext file with all used external labels and their usage addresses */
-void write_externals_file(const char *filename) {
-    FILE *file;
+/* Appends the tables of a part of the program, assembled on its own from
+   address 0, as if its lines had been assembled here starting at base.
+   Every table keeps its order, so the result is the same as one pass. */
+void merge_tables(AsmContext *ctx, const AsmContext *part, int shared, int base) {
+    const Tables *from = &part->tables;
+    int local = get_string_count(&part->strings) - shared;
+    StringId *map = malloc((local + 1) * sizeof(StringId));
+    int values[IMAGE_PAGE_SIZE];
+    const Symbol *symbol;
+    const unsigned int *words;
+    int page, count, start;
+    int index;
     int i;
 
-    file = fopen(filename, "w");
-    if (!file) {
-        perror("Error opening externals file");
+    if (map == NULL) {
+        fprintf(stderr, "Failed to allocate memory for assembler tables\n");
         exit(EXIT_FAILURE);
     }
+    for (i = 0; i < local; i++) {
+        map[i] = NO_STRING_ID;
+    }
+
+    /* Labels: the first definition of a name still wins */
+    for (i = 0; i < from->symbol_count; i++) {
+        symbol = &from->symbol_table[i];
+        index = add_symbol(ctx, merged_id(ctx, part, shared, map, symbol->name), symbol->address + base);
+        if (symbol->kind == SYMBOL_DATA) {
+            set_symbol_data(ctx, index, symbol->data_length);
+        }
+    }
+    for (i = 0; i < from->entry_count; i++) {
+        add_entry(ctx, merged_id(ctx, part, shared, map, from->entry_table[i].name),
+                  from->entry_table[i].address);
+    }
+    for (i = 0; i < from->extern_count; i++) {
+        add_extern_usage(ctx, merged_id(ctx, part, shared, map, from->extern_table[i].name),
+                         from->extern_table[i].address < 0 ? from->extern_table[i].address
+                                                           : from->extern_table[i].address + base);
+    }
+    for (i = 0; i < from->pending_count; i++) {
+        add_pending_id(ctx, merged_id(ctx, part, shared, map, from->pending_words[i].name),
+                       from->pending_words[i].address + base, from->pending_words[i].mode);
+    }
 
-    for (i = 0; i < extern_count; i++) {
-        if (extern_table[i].address < 0) {
+    /* Words, a run of present slots at a time */
+    for (page = 0; page <= from->image_last_page; page++) {
+        words = from->image_pages[page];
+        if (words == NULL) {
             continue;
         }
-        fprintf(file, "%s %04d\n", extern_table[i].symbol, extern_table[i].address);
+        for (i = 0; i < IMAGE_PAGE_SIZE; i++) {
+            if (!(words[i] & WORD_PRESENT)) {
+                continue;
+            }
+            for (start = i, count = 0; i < IMAGE_PAGE_SIZE && (words[i] & WORD_PRESENT); i++) {
+                values[count++] = (int)(words[i] & 0xFFFFFF);
+            }
+            add_objects(ctx, base + page * IMAGE_PAGE_SIZE + start, values, count);
+        }
     }
 
-    fclose(file);
+    free(map);
 }
 
 /* Accessor functions (getters) for each internal table and count */
 
-int get_symbol_count(void) {
-    return symbol_count;
+int get_symbol_count(const AsmContext *ctx) {
+    return ctx->tables.symbol_count;
 }
 
-int get_entry_count(void) {
-    return entry_count;
+int get_entry_count(const AsmContext *ctx) {
+    return ctx->tables.entry_count;
 }
 
-int get_extern_count(void) {
-    return extern_count;
+int get_extern_count(const AsmContext *ctx) {
+    return ctx->tables.extern_count;
 }
 
-int get_object_count(void) {
-    return object_count;
+int get_object_count(const AsmContext *ctx) {
+    return ctx->tables.object_count;
 }
 
-Symbol* get_symbol_table(void) {
-    return symbol_table;
+Symbol* get_symbol_table(AsmContext *ctx) {
+    return ctx->tables.symbol_table;
 }
 
-Extern* get_extern_table(void) {
-    return extern_table;
+Extern* get_extern_table(AsmContext *ctx) {
+    return ctx->tables.extern_table;
 }
 
-Entry* get_entry_table(void) {
-    return entry_table;
+Entry* get_entry_table(AsmContext *ctx) {
+    return ctx->tables.entry_table;
 }
 
-Object* get_object_table(void) {
-    return object_table;
+/* Finds and returns the address of a label from the symbol table */
+int resolve_direct_address(AsmContext *ctx, const char *label) {
+    return resolve_symbol_id(ctx, find_string(&ctx->strings, label));
 }
 
-/* Finds and returns the address of a label from the symbol table */
-int resolve_direct_address(const char *label) {
-    Symbol *symbol_table = get_symbol_table();
-    int symbol_count = get_symbol_count();
-    int i;
+/* Finds and returns the address of an interned label */
+int resolve_symbol_id(const AsmContext *ctx, StringId name) {
+    int i = find_symbol(&ctx->tables, name);
 
-    for (i = 0; i < symbol_count; i++) {
-        if (strcmp(symbol_table[i].label, label) == 0) {
-            return symbol_table[i].address;
-        }
+    if (i == -1) {
+        return -1;
     }
+    return ctx->tables.symbol_table[i].address;
+}
 
-    return -1;
+/* Returns 1 if the label was declared with .extern (stored with address -1) */
+int is_external_label(const AsmContext *ctx, const char *label) {
+    return is_external_id(ctx, find_string(&ctx->strings, label));
+}
+
+/* Returns 1 if the interned label was declared with .extern */
+int is_external_id(const AsmContext *ctx, StringId name) {
+    return find_extern(&ctx->tables, name, -1) != -1;
 }
 
 /* Adds a word to the pending list to be resolved in the second pass */
-void add_pending_word(const char *label, int address, AddressingMode mode) {
-    PendingWord *temp;
+void add_pending_word(AsmContext *ctx, const char *label, int address, AddressingMode mode) {
+    add_pending_id(ctx, intern_string(&ctx->strings, label), address, mode);
+}
 
-    temp = realloc(pending_words, (pending_count + 1) * sizeof(PendingWord));
-    if (!temp) {
-        fprintf(stderr, "Failed to allocate memory for pending words\n");
-        free_memory();
-        exit(EXIT_FAILURE);
+/* Adds a pending word for an interned label */
+void add_pending_id(AsmContext *ctx, StringId name, int address, AddressingMode mode) {
+    Tables *tables = &ctx->tables;
+
+    /* Past the limit the use is dropped; the file is rejected after pass 1 */
+    if (tables->streaming && tables->pending_count >= STREAM_PENDING_LIMIT) {
+        if (!tables->pending_overflow) {
+            fprintf(ctx->diagnostics, "Error: More than %d unresolved label uses in streaming mode\n",
+                    STREAM_PENDING_LIMIT);
+            tables->pending_overflow = 1;
+        }
+        return;
     }
 
-    pending_words = temp;
-    strncpy(pending_words[pending_count].label, label, MAX_LABEL_LENGTH - 1);
-    pending_words[pending_count].label[MAX_LABEL_LENGTH - 1] = '\0';
-    pending_words[pending_count].address = address;
-    pending_words[pending_count].mode = mode;
-    pending_count++;
+    tables->pending_words = reserve_slot(tables, tables->pending_words, tables->pending_count,
+                                   &tables->pending_capacity, sizeof(PendingWord));
+    tables->pending_words[tables->pending_count].name = name;
+    tables->pending_words[tables->pending_count].address = address;
+    tables->pending_words[tables->pending_count].mode = mode;
+    tables->pending_words[tables->pending_count].offset = tables->streaming ? tables->last_word_offset : -1;
+    tables->pending_words[tables->pending_count].next = -1;
+
+    /* One-pass: chain the use to the label's earlier ones */
+    if (tables->one_pass && name != NO_STRING_ID) {
+        reserve_label_uses(tables, name);
+        tables->pending_words[tables->pending_count].next = tables->label_uses[name];
+        tables->label_uses[name] = tables->pending_count;
+    }
+    tables->pending_count++;
 }
 
-PendingWord* get_pending_words(void) {
-    return pending_words;
+PendingWord* get_pending_words(AsmContext *ctx) {
+    return ctx->tables.pending_words;
 }
 
-int get_pending_count(void) {
-    return pending_count;
+int get_pending_count(const AsmContext *ctx) {
+    return ctx->tables.pending_count;
 }
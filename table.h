@@ -1,107 +1,243 @@
 #ifndef TABLE_H
 #define TABLE_H
 
+#include <stdio.h>
 #include "util.h"
+#include "intern.h"
+#include "arena.h"
+#include "output.h"
+#include "asm.h"
 
-#define MAX_LABEL_LENGTH 31
+/* Labels are interned in the string pool (intern.h); the tables below
+   store only their 32-bit ids, so comparing two labels is an integer compare. */
 
-/* Structure for storing label definitions in the symbol table */
+/* Kinds of symbols */
+#define SYMBOL_CODE 0                 /* Label of an instruction (or nothing) */
+#define SYMBOL_DATA 1                 /* Label of a .data/.string directive */
+
+/* Symbol flags */
+#define SYMBOL_ENTRY 0x1              /* Declared with .entry */
+
+/* Structure for storing label definitions in the symbol table.
+   A data label does not copy its values: they are the data_length words
+   of the object image starting at its address. */
 typedef struct {
-    char label[MAX_LABEL_LENGTH];     /* Label name */
+    StringId name;                    /* Label name (interned) */
     unsigned int address;             /* Address in memory */
-    int data_value[SIZE_DATA];        /* Associated data (for .data/.string) */
-    int data_count;                   /* Number of data values */
+    unsigned int data_length;         /* Words of data at address (data labels) */
+    unsigned char kind;               /* SYMBOL_CODE or SYMBOL_DATA */
+    unsigned char flags;              /* SYMBOL_ENTRY, ... */
 } Symbol;
 
 /* Structure for storing .entry labels */
 typedef struct {
-    char label[MAX_LABEL_LENGTH];     /* Label name */
+    StringId name;                    /* Label name (interned) */
     int address;                      /* Address in memory */
 } Entry;
 
 /* Structure for storing .extern symbols and where they were used */
 typedef struct {
-    char symbol[MAX_LABEL_LENGTH];    /* External symbol name */
+    StringId name;                    /* External symbol name (interned) */
     int address;                      /* Address where it was used */
 } Extern;
 
-/* Structure for storing memory words of the final object image */
-typedef struct {
-    unsigned short address;           /* Memory address */
-    unsigned int value;               /* Encoded 24-bit machine word */
-} Object;
+/* The object image is a paged dense array covering the whole address space
+   (MAX_MEMORY words). Pages of IMAGE_PAGE_SIZE words are allocated the first
+   time one of their words is written, so memory follows the words in use. */
+#define IMAGE_PAGE_SIZE 1024
+#define IMAGE_PAGES (MAX_MEMORY / IMAGE_PAGE_SIZE)
+
+/* Marks an image slot that holds a word (bits 0-23 hold the word itself) */
+#define WORD_PRESENT 0x1000000u
 
 /* Structure for storing unresolved words that need to be completed in second pass */
 typedef struct {
     int address;                      /* Address in memory */
-    char label[MAX_LABEL_LENGTH];     /* Label name that will be resolved */
+    StringId name;                    /* Label name that will be resolved (interned) */
     AddressingMode mode;              /* Addressing mode (direct/relative/etc.) */
+    long offset;                      /* Place of its value in the .ob segment (streaming) */
+    int next;                         /* Previous use of the same label (one-pass), or -1 */
 } PendingWord;
 
-/* Adds a symbol (label) to the symbol table */
-void add_symbol(const char *label, int address);
+/* Streaming mode keeps neither the object image nor the extern uses in
+   memory: words are written to a temporary .ob segment in address order as
+   they are encoded, and a resolved extern use goes straight to a .ext
+   segment. Only label uses that cannot be resolved yet are kept, at most
+   this many; the second pass fills them in inside the segment. A file
+   with more is rejected with an error (see get_fatal_errors). */
+#define STREAM_PENDING_LIMIT 1048576
+
+/* A temporary file that streamed output goes to (see STREAM_PENDING_LIMIT) */
+typedef struct {
+    FILE *file;                       /* Opened on first write */
+    long size;                        /* Bytes written so far */
+} Segment;
+
+/* All tables of one assembly, owned by its context (see context.h).
+   Everything lives in the arena, which reset_tables empties in O(1). */
+typedef struct {
+    Arena arena;
+
+    Symbol *symbol_table;
+    int symbol_count;
+    int symbol_capacity;
+    int *symbol_index;                /* Open-addressing index into symbol_table */
+    int symbol_index_size;
+
+    Entry *entry_table;
+    int entry_count;
+    int entry_capacity;
+
+    Extern *extern_table;
+    int extern_count;
+    int extern_capacity;
+    int *extern_index;                /* Index by name and usage address */
+    int extern_index_size;
+
+    PendingWord *pending_words;
+    int pending_count;
+    int pending_capacity;
+    int *label_uses;                  /* One-pass: last pending word of each label id, or -1 */
+    int label_use_capacity;
+
+    unsigned int **image_pages;       /* Page table of the image, allocated on first touch */
+    int image_last_page;              /* Highest page allocated so far */
+    int object_count;                 /* Words present in the image */
+
+    int streaming;                    /* Streaming mode (words go to segments) */
+    int one_pass;                     /* One-pass mode (uses are backpatched, see ASM_ONE_PASS) */
+    Segment word_segment;             /* .ob lines, in address order */
+    Segment extern_segment;           /* .ext lines */
+    long last_word_offset;            /* Offset of the last word's value */
+    int pending_overflow;             /* Set once STREAM_PENDING_LIMIT was passed */
+    int memory_overflow;              /* Set once a word went past MAX_MEMORY */
+} Tables;
+
+/* Adds an interned label to the symbol table.
+   Returns its index (the existing one for a duplicate label). */
+int add_symbol(AsmContext *ctx, StringId name, int address);
 
 /* Adds an object word (instruction or data) to the object image */
-void add_object(unsigned int address, int value);
+void add_object(AsmContext *ctx, unsigned int address, int value);
+
+/* Adds count consecutive words starting at an address (a .data or .string block) */
+void add_objects(AsmContext *ctx, unsigned int address, const int *values, int count);
+
+/* Replaces the word at an address; returns 0 if no word was added there */
+int patch_object(AsmContext *ctx, unsigned int address, unsigned int value);
+
+/* Fills in a pending word (in the image or the streamed segment); returns 0 on failure */
+int patch_pending(AsmContext *ctx, const PendingWord *word, unsigned int value);
+
+/* Turns streaming mode on or off (applies from the next file on) */
+void set_streaming(AsmContext *ctx, int enabled);
+
+/* Returns 1 if streaming mode is on */
+int is_streaming(const AsmContext *ctx);
+
+/* Turns one-pass mode on or off (applies from the next file on) */
+void set_one_pass(AsmContext *ctx, int enabled);
+
+/* Returns 1 if one-pass mode is on */
+int is_one_pass(const AsmContext *ctx);
+
+/* Returns the last pending word that uses an interned label, or -1; the
+   earlier ones follow through PendingWord.next (one-pass mode only) */
+int get_label_uses(const AsmContext *ctx, StringId name);
+
+/* Reads the word at an address; returns 0 if no word was added there */
+int get_object_word(AsmContext *ctx, unsigned int address, unsigned int *value);
 
 /* Adds an external symbol reference */
-void add_extern(const char *symbol, int address);
+void add_extern(AsmContext *ctx, const char *symbol, int address);
 
-/* Adds an entry symbol (.entry directive) */
-void add_entry(const char *label, int address);
+/* Adds an interned entry symbol (.entry directive) */
+void add_entry(AsmContext *ctx, StringId name, int address);
 
-/* Adds data to a symbol's data array (used in .data/.string) */
-void add_data_to_symbol(int symbol_index, int value);
+/* Marks a symbol as the label of length data words (used in .data/.string) */
+void set_symbol_data(AsmContext *ctx, int symbol_index, unsigned int length);
+
+/* Sets flags (SYMBOL_ENTRY, ...) on an interned label if it is defined */
+void set_symbol_flags(AsmContext *ctx, StringId name, unsigned char flags);
 
 /* Frees all dynamically allocated memory tables */
-void free_memory(void);
+void free_memory(AsmContext *ctx);
+
+/* Appends the tables of part (a piece of the program assembled from
+   address 0 in its own context) as if assembled here from base.
+   The first shared string ids of part are the same as in ctx. */
+void merge_tables(AsmContext *ctx, const AsmContext *part, int shared, int base);
+
+/* Empties all tables in O(1) so the next input file starts from a clean state.
+   Called before assembling each file (including the first one). */
+void reset_tables(AsmContext *ctx);
 
 /* Resolves the address of a label by name from the symbol table */
-int resolve_direct_address(const char *label);
+int resolve_direct_address(AsmContext *ctx, const char *label);
 
 /* Returns 1 if the label is external, 0 otherwise */
-int is_external_label(const char *label);
+int is_external_label(const AsmContext *ctx, const char *label);
+
+/* Resolves the address of an interned label, or -1 if it is not defined */
+int resolve_symbol_id(const AsmContext *ctx, StringId name);
+
+/* Returns 1 if the interned label was declared with .extern, 0 otherwise */
+int is_external_id(const AsmContext *ctx, StringId name);
+
+/* Records a use of an external symbol at the given address */
+void add_extern_usage(AsmContext *ctx, StringId name, int address);
 
 /* Adds a word to be resolved later (in second pass) */
-void add_pending_word(const char *label, int address, AddressingMode mode);
+void add_pending_word(AsmContext *ctx, const char *label, int address, AddressingMode mode);
+
+/* Same as add_pending_word, for a label that is already interned */
+void add_pending_id(AsmContext *ctx, StringId name, int address, AddressingMode mode);
+
+/* Returns the number of pass-1 errors after which the file cannot be
+   assembled: words past MAX_MEMORY, or label uses past
+   STREAM_PENDING_LIMIT in streaming mode (both are dropped) */
+int get_fatal_errors(const AsmContext *ctx);
 
 /* Returns the array of pending words */
-PendingWord* get_pending_words(void);
+PendingWord* get_pending_words(AsmContext *ctx);
 
 /* Returns the number of pending words */
-int get_pending_count(void);
+int get_pending_count(const AsmContext *ctx);
 
 /* Returns the number of defined symbols */
-int get_symbol_count(void);
+int get_symbol_count(const AsmContext *ctx);
 
 /* Returns the number of .entry declarations */
-int get_entry_count(void);
+int get_entry_count(const AsmContext *ctx);
 
 /* Returns the number of .extern declarations */
-int get_extern_count(void);
+int get_extern_count(const AsmContext *ctx);
 
 /* Returns the number of object words in memory */
-int get_object_count(void);
+int get_object_count(const AsmContext *ctx);
 
 /* Returns a pointer to the symbol table */
-Symbol* get_symbol_table(void);
+Symbol* get_symbol_table(AsmContext *ctx);
 
 /* Returns a pointer to the extern table */
-Extern* get_extern_table(void);
+Extern* get_extern_table(AsmContext *ctx);
 
 /* Returns a pointer to the entry table */
-Entry* get_entry_table(void);
+Entry* get_entry_table(AsmContext *ctx);
+
+/* Writes the .ob output with the object image */
+void write_object_file(AsmContext *ctx, Output *out, int IC, int DC);
 
-/* Returns a pointer to the object memory table */
-Object* get_object_table(void);
+/* Writes the .ent output with all entry symbols */
+void write_entries_file(AsmContext *ctx, Output *out);
 
-/* Writes the final .ob file with object image */
-void write_object_file(const char *filename, int IC, int DC);
+/* Writes the .ext output with all external symbols used */
+void write_externals_file(AsmContext *ctx, Output *out);
 
-/* Writes the .ent file with all entry symbols */
-void write_entries_file(const char *filename);
+/* Writes the .obx output: .ob, .ent and .ext in one binary file (obx.h) */
+void write_binary_file(AsmContext *ctx, Output *out, int IC, int DC);
 
-/* Writes the .ext file with all external symbols used */
-void write_externals_file(const char *filename);
+/* Writes the .obz output: the .ob words, compressed (obz.h) */
+void write_compressed_file(AsmContext *ctx, Output *out, int IC, int DC);
 
 #endif /* TABLE_H */
@@ -37,16 +37,18 @@ char* binary_to_hexa(const char *binary) {
 
 
 /* Checks if a line is empty or a comment (starts with ;) */
-int is_comment_or_empty_line(const char *line) {
-    while (*line && isspace(*line)) {
+int is_comment_or_empty_line(const char *line, long length) {
+    const char *end = line + length;
+
+    while (line < end && *line && isspace((unsigned char)*line)) {
         line++;
     }
-    return (*line == '\0' || *line == ';');
+    return (line == end || *line == '\0' || *line == ';');
 }
 
 /* Returns 1 if line exceeds allowed maximum length */
-int is_line_to_long(const char *line) {
-    return strlen(line) > MAX_LINE_LEN;
+int is_line_to_long(long length) {
+    return length > MAX_LINE_LEN;
 }
 
 /* Returns 1 if character is a digit (0-9) */
@@ -54,23 +56,98 @@ int is_digit(char c) {
     return (c >= '0' && c <= '9');
 }
 
-/* Checks if a string is a valid integer (with optional +/- sign) */
-int is_valid_integer(const char *str) {
-    if (*str == '\0') {
+/* Largest magnitude kept while converting digits: INT_MAX + 1 */
+#define DIGITS_LIMIT ((unsigned long)INT_MAX + 1)
+
+/* Returns the value of four ASCII digits, or -1 if one of them is not a
+   digit. The bytes are checked and combined inside one word (SWAR):
+   pairs of digits first, then the two pairs. */
+static long four_digits(const char *str) {
+    unsigned long chunk = (unsigned long)(unsigned char)str[0]
+                        | (unsigned long)(unsigned char)str[1] << 8
+                        | (unsigned long)(unsigned char)str[2] << 16
+                        | (unsigned long)(unsigned char)str[3] << 24;
+
+    /* Every byte must be 0x30..0x39: high nibble 3, and still 3 after adding 6 */
+    if ((chunk & 0xF0F0F0F0UL) != 0x30303030UL ||
+        ((chunk + 0x06060606UL) & 0xF0F0F0F0UL) != 0x30303030UL) {
+        return -1;
+    }
+    chunk -= 0x30303030UL;
+    chunk = (chunk * 10 + (chunk >> 8)) & 0x00FF00FFUL;
+    return (long)((chunk & 0xFF) * 100 + ((chunk >> 16) & 0xFF));
+}
+
+/* Converts the digits at the start of [str, end), four at a time while
+   there are four, and returns the first byte after them. A value above
+   DIGITS_LIMIT is clamped to it. */
+static const char *convert_digits(const char *str, const char *end, unsigned long *value) {
+    unsigned long result = 0;
+    long four;
+
+    while (end - str >= 4 && (four = four_digits(str)) != -1) {
+        if (result > (DIGITS_LIMIT - four) / 10000) {
+            result = DIGITS_LIMIT;
+        } else {
+            result = result * 10000 + four;
+        }
+        str += 4;
+    }
+    while (str < end && is_digit(*str)) {
+        if (result > (DIGITS_LIMIT - (*str - '0')) / 10) {
+            result = DIGITS_LIMIT;
+        } else {
+            result = result * 10 + (*str - '0');
+        }
+        str++;
+    }
+    *value = result;
+    return str;
+}
+
+/* Applies the sign to a converted magnitude, clamping to the int range */
+static int signed_value(unsigned long magnitude, int negative) {
+    if (magnitude >= DIGITS_LIMIT) {
+        return negative ? INT_MIN : INT_MAX;
+    }
+    return negative ? -(int)magnitude : (int)magnitude;
+}
+
+/* Parses a whole token as an integer (optional +/- sign, then digits) */
+int parse_integer(const char *str, long length, int *value) {
+    const char *end = str + length;
+    unsigned long magnitude;
+    int negative = 0;
+
+    if (length == 0) {
         return 0;
     }
     if (*str == '-' || *str == '+') {
+        negative = (*str == '-');
         str++;
     }
-    while (*str) {
-        if (!is_digit(*str)) {
-            return 0;
-        }
-        str++;
+    if (convert_digits(str, end, &magnitude) != end) {
+        return 0;
     }
+    *value = signed_value(magnitude, negative);
     return 1;
 }
 
+/* Converts the leading integer of a token, like atoi:
+   optional sign, then digits up to the first non-digit */
+int text_to_int(const char *str, long length) {
+    const char *end = str + length;
+    unsigned long magnitude;
+    int negative = 0;
+
+    if (str < end && (*str == '-' || *str == '+')) {
+        negative = (*str == '-');
+        str++;
+    }
+    convert_digits(str, end, &magnitude);
+    return signed_value(magnitude, negative);
+}
+
 /* Converts an integer to its two's complement binary string representation.
  * Assumes binary has enough space to hold 'bits' characters + '\0'.
  */
@@ -87,22 +164,44 @@ void int_to_twos_complement_binary(int value, char *binary, int bits) {
 }
 
 /* Returns 1 if the operand is a valid register (r0–r7) */
-int is_register(const char *operand) {
-    return operand[0] == 'r' && operand[1] >= '0' && operand[1] <= '7' && operand[2] == '\0';
+int is_register(const char *operand, long length) {
+    return length == 2 && operand[0] == 'r' && operand[1] >= '0' && operand[1] <= '7';
 }
 
 /* Determines addressing mode of an operand */
-AddressingMode get_addressing_mode(const char *operand) {
+AddressingMode get_addressing_mode(const char *operand, long length) {
     if (operand[0] == '#') return IMMEDIATE;
     if (operand[0] == '&') return RELATIVE;
-    if (is_register(operand)) return REGISTER_DIRECT;
+    if (is_register(operand, length)) return REGISTER_DIRECT;
     return DIRECT;
 }
 
 /* Extracts register number (0–7) from operand r0–r7 */
-int get_register_code(const char *operand) {
-    if (is_register(operand)) {
+int get_register_code(const char *operand, long length) {
+    if (is_register(operand, length)) {
         return operand[1] - '0';
     }
     return 0;
 }
+
+/* Computes the djb2 hash of a string, used by the hashed lookup tables */
+unsigned long hash_string(const char *str) {
+    unsigned long hash = 5381;
+    int c;
+
+    while ((c = (unsigned char)*str++) != 0) {
+        hash = ((hash << 5) + hash) + c;
+    }
+    return hash;
+}
+
+/* Computes the djb2 hash of a block of bytes, used to key cached files */
+unsigned long hash_bytes(const char *data, long length) {
+    unsigned long hash = 5381;
+    long i;
+
+    for (i = 0; i < length; i++) {
+        hash = ((hash << 5) + hash) + (unsigned char)data[i];
+    }
+    return hash;
+}
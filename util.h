@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 
 /*defenition for ARE*/
 #define ABSULUTE 4
@@ -41,11 +42,14 @@ typedef struct {
 } DataWord;
 
 
+/* Source text is passed as (pointer, length): tokens are views into the
+   input and are not null-terminated (see source.h). */
+
 /*Checks if the line is empty or a comment*/
-int is_comment_or_empty_line(const char *line);
+int is_comment_or_empty_line(const char *line, long length);
 
 /* Checks if a given input line exceeds the maximum allowed length (81 chars including '\0') */
-int is_line_to_long(const char *line);
+int is_line_to_long(long length);
 
 /* Converts a binary string to a hexadecimal string using dynamic allocation */
 char* binary_to_hexa(const char *binary);
@@ -53,17 +57,28 @@ char* binary_to_hexa(const char *binary);
 /* Returns 1 if the character is a digit ('0' to '9'), otherwise 0 */
 int is_digit(char c);
 
-/* Checks if a string represents a valid integer (with optional sign) */
-int is_valid_integer(const char *str);
+/* Parses a token that is a whole integer (with optional sign) into *value.
+   Returns 0 if it is not one. Values beyond the int range are clamped to
+   INT_MIN / INT_MAX, so range checks still reject them. */
+int parse_integer(const char *str, long length, int *value);
+
+/* Converts the leading integer of a token, like atoi (clamped like parse_integer) */
+int text_to_int(const char *str, long length);
 
 /* Converts an integer to its two's complement binary representation with a fixed number of bits */
 void int_to_twos_complement_binary(int value, char *binary, int bits);
 
 /* Returns the addressing mode of the given operand (e.g., IMMEDIATE, DIRECT, REGISTER) */
-AddressingMode get_addressing_mode(const char *operand);
+AddressingMode get_addressing_mode(const char *operand, long length);
 
 /* Extracts the register code from an operand string like "r3" or "r0" */
-int get_register_code(const char *operand);
+int get_register_code(const char *operand, long length);
+
+/* Returns a hash value for a null-terminated string (djb2) */
+unsigned long hash_string(const char *str);
+
+/* Returns a hash value for a block of bytes (djb2) */
+unsigned long hash_bytes(const char *data, long length);
 
 
 